@@ -0,0 +1,510 @@
+/* Notes:
+ * - Teleoperation of the two-wheeler without forking: the keys come from the terminal (raw mode) or as datagrams on a local socket, both waited for with epoll together with a timerfd ticking every period_ms.
+ * - The keys are the ones of control.sh. A driving key sets the target speed and turn, and the ticks ramp the sent command towards it by at most ramp per mille per tick, so holding a key (auto-repeat) drives smoothly and changing direction does not jerk the robot.
+ * - The command goes to the drive pair of motor.ko as one MOTOR_IOC_DRIVE ioctl on /dev/motor_drive (sync mode, both wheels changing in the same control_loop tick), and only when it has changed.
+ * - The watchdog stops the motors when no key has arrived for watchdog_ms, i.e. a driving key has been released or the client on the socket has gone. The default is longer than the usual auto-repeat delay of a terminal (500 ms); 0 disables it, so the keys latch like in control.sh.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "motor_ioctl.h"
+
+#define DEFAULT_DEVICE "/dev/motor_drive"
+#define DEFAULT_SOCKET "/tmp/teleop.sock"
+
+#define MAX_EVENTS 4
+
+enum source {
+  SOURCE_TERMINAL,
+  SOURCE_SOCKET,
+  SOURCE_TIMER,
+};
+
+struct teleop {
+  int drive; /* /dev/motor_drive, -1 for a dry run printing the commands */
+  int period_ms;
+  int ramp; /* Per mille per tick */
+  int watchdog_ms;
+
+  int target_speed; /* Set by the keys */
+  int target_turn;
+  int speed; /* Last sent */
+  int turn;
+  int driving; /* The drive has been given a command since the last stop */
+  struct timespec last_key;
+  int quit;
+};
+
+static volatile sig_atomic_t terminated;
+
+/***********************************************************************
+ *
+ * Commands to the drive pair
+ *
+ ***********************************************************************/
+static int drive_send(struct teleop *t, int speed, int turn) {
+  struct motor_drive command;
+
+  if (t->drive < 0) {
+    printf("sync %d %d\r\n", speed, turn);
+    return 0;
+  }
+
+  memset(&command, 0, sizeof(command));
+  command.mode = MOTOR_DRIVE_SYNC;
+  command.speed = speed;
+  command.turn = turn;
+
+  if (ioctl(t->drive, MOTOR_IOC_DRIVE, &command) < 0) {
+    perror("MOTOR_IOC_DRIVE");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Stops at once, without ramping */
+static int drive_stop(struct teleop *t, int mode) {
+  static const char *names[] = {"coast", "brake", "hold", "default"};
+
+  t->target_speed = t->speed = 0;
+  t->target_turn = t->turn = 0;
+  t->driving = 0;
+
+  if (t->drive < 0) {
+    printf("stop %s\r\n", names[mode]);
+    return 0;
+  }
+
+  if (ioctl(t->drive, MOTOR_IOC_DRIVE_STOP, &mode) < 0) {
+    perror("MOTOR_IOC_DRIVE_STOP");
+    return -1;
+  }
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * Keys, the same as control.sh
+ *
+ ***********************************************************************/
+static void set_target(struct teleop *t, int speed, int turn) {
+  t->target_speed = speed;
+  t->target_turn = turn;
+}
+
+static void handle_key(struct teleop *t, char key) {
+  switch (key) {
+  case '8':
+    set_target(t, MOTOR_SPEED_MAX, 0);
+    break;
+  case '2':
+    set_target(t, -MOTOR_SPEED_MAX, 0);
+    break;
+  case '4':
+    set_target(t, MOTOR_SPEED_MAX, -MOTOR_DRIVE_TURN_MAX);
+    break;
+  case '6':
+    set_target(t, MOTOR_SPEED_MAX, MOTOR_DRIVE_TURN_MAX);
+    break;
+  case '7':
+    set_target(t, MOTOR_SPEED_MAX, -MOTOR_DRIVE_TURN_MAX / 2);
+    break;
+  case '9':
+    set_target(t, MOTOR_SPEED_MAX, MOTOR_DRIVE_TURN_MAX / 2);
+    break;
+  case '1':
+    set_target(t, -MOTOR_SPEED_MAX, MOTOR_DRIVE_TURN_MAX / 2);
+    break;
+  case '3':
+    set_target(t, -MOTOR_SPEED_MAX, -MOTOR_DRIVE_TURN_MAX / 2);
+    break;
+  case '5':
+    drive_stop(t, MOTOR_STOP_DEFAULT);
+    return;
+  case '0':
+    drive_stop(t, MOTOR_STOP_BRAKE);
+    return;
+  case '.':
+    drive_stop(t, MOTOR_STOP_COAST);
+    return;
+  case 'q':
+    t->quit = 1;
+    return;
+  default:
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t->last_key);
+  t->driving = 1;
+}
+
+static void handle_keys(struct teleop *t, const char *keys, ssize_t count) {
+  ssize_t i;
+
+  for (i = 0; i < count && !t->quit; ++i) {
+    handle_key(t, keys[i]);
+  }
+}
+
+/***********************************************************************
+ *
+ * The tick: the watchdog and the ramp
+ *
+ ***********************************************************************/
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int ramp_to(int value, int target, int step) {
+  if (value < target) {
+    return (target - value > step ? value + step : target);
+  } else {
+    return (value - target > step ? value - step : target);
+  }
+}
+
+static void tick(struct teleop *t) {
+  int speed;
+  int turn;
+
+  if (!t->driving) {
+    return;
+  }
+
+  if (t->watchdog_ms > 0 && elapsed_ms(&t->last_key) >= t->watchdog_ms) {
+    drive_stop(t, MOTOR_STOP_DEFAULT);
+    return;
+  }
+
+  speed = ramp_to(t->speed, t->target_speed, t->ramp);
+  /* The turn is a ratio, ramped at the same pace relative to its range */
+  turn = ramp_to(t->turn, t->target_turn, (t->ramp * MOTOR_DRIVE_TURN_MAX + MOTOR_SPEED_MAX - 1) / MOTOR_SPEED_MAX);
+
+  if (speed != t->speed || turn != t->turn) {
+    if (drive_send(t, speed, turn) == 0) {
+      t->speed = speed;
+      t->turn = turn;
+    }
+  }
+}
+
+/***********************************************************************
+ *
+ * Setup of the sources
+ *
+ ***********************************************************************/
+static struct termios saved_termios;
+static int terminal_raw;
+
+static void terminal_restore(void) {
+  if (terminal_raw) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+    terminal_raw = 0;
+  }
+}
+
+/* No echo and no line buffering, like read -s -n1 */
+static int terminal_setup(void) {
+  struct termios raw;
+
+  if (tcgetattr(STDIN_FILENO, &saved_termios) < 0) {
+    return -1;
+  }
+
+  raw = saved_termios;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+
+  if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0) {
+    return -1;
+  }
+
+  terminal_raw = 1;
+  atexit(terminal_restore);
+
+  return 0;
+}
+
+/* A datagram socket, every datagram carrying one or more keys */
+static int socket_setup(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int timer_setup(int period_ms) {
+  struct itimerspec spec;
+  int fd;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  spec.it_interval.tv_sec = period_ms / 1000;
+  spec.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+  spec.it_value = spec.it_interval;
+
+  if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+    perror("timerfd_settime");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int epoll_add(int epfd, int fd, enum source source) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = source;
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void on_signal(int sig) {
+  terminated = 1;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-d device] [-s socket] [-S] [-T] [-p period_ms] [-r ramp] [-w watchdog_ms] [-n]\n"
+          "  -d  drive pair device (default " DEFAULT_DEVICE ")\n"
+          "  -s  datagram socket for the keys (default " DEFAULT_SOCKET ")\n"
+          "  -S  no socket\n"
+          "  -T  no terminal, e.g. when run as a daemon\n"
+          "  -p  tick of the ramp and the watchdog (default 20 ms)\n"
+          "  -r  ramp in per mille speed per tick (default 100)\n"
+          "  -w  stop when no key arrived for this long, 0 latches the keys (default 600 ms)\n"
+          "  -n  dry run, print the commands instead of driving\n",
+          name);
+}
+
+/***********************************************************************
+ *
+ * Main loop
+ *
+ ***********************************************************************/
+int main(int argc, char **argv) {
+  const char *device = DEFAULT_DEVICE;
+  const char *socket_path = DEFAULT_SOCKET;
+  struct epoll_event events[MAX_EVENTS];
+  struct sigaction action;
+  struct teleop t;
+  int use_terminal = 1;
+  int use_socket = 1;
+  int dry_run = 0;
+  int epfd = -1;
+  int sockfd = -1;
+  int timerfd = -1;
+  int res = EXIT_FAILURE;
+  char keys[64];
+  uint64_t expirations;
+  ssize_t count;
+  int n;
+  int i;
+  int opt;
+
+  memset(&t, 0, sizeof(t));
+  t.period_ms = 20;
+  t.ramp = 100;
+  t.watchdog_ms = 600;
+
+  while ((opt = getopt(argc, argv, "d:s:STp:r:w:nh")) != -1) {
+    switch (opt) {
+    case 'd':
+      device = optarg;
+      break;
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'S':
+      use_socket = 0;
+      break;
+    case 'T':
+      use_terminal = 0;
+      break;
+    case 'p':
+      t.period_ms = atoi(optarg);
+      break;
+    case 'r':
+      t.ramp = atoi(optarg);
+      break;
+    case 'w':
+      t.watchdog_ms = atoi(optarg);
+      break;
+    case 'n':
+      dry_run = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (t.period_ms <= 0 || t.ramp <= 0 || t.watchdog_ms < 0 || (!use_terminal && !use_socket)) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (dry_run) {
+    t.drive = -1;
+  } else {
+    t.drive = open(device, O_WRONLY | O_CLOEXEC);
+    if (t.drive < 0) {
+      perror(device);
+      fprintf(stderr, "The motor driver is not loaded\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    goto out;
+  }
+
+  if (use_terminal) {
+    if (!isatty(STDIN_FILENO) || terminal_setup() < 0) {
+      fprintf(stderr, "stdin is not a terminal, use -T\n");
+      goto out;
+    }
+    if (epoll_add(epfd, STDIN_FILENO, SOURCE_TERMINAL) < 0)
+      goto out;
+  }
+
+  if (use_socket) {
+    sockfd = socket_setup(socket_path);
+    if (sockfd < 0 || epoll_add(epfd, sockfd, SOURCE_SOCKET) < 0)
+      goto out;
+  }
+
+  timerfd = timer_setup(t.period_ms);
+  if (timerfd < 0 || epoll_add(epfd, timerfd, SOURCE_TIMER) < 0)
+    goto out;
+
+  if (drive_stop(&t, MOTOR_STOP_DEFAULT) < 0)
+    goto out;
+
+  if (use_terminal) {
+    printf("FirstBot control program:\r\n");
+    printf("Use numeric keypad for controlling the robot or q to quit.\r\n");
+    printf("5 stops, 0 brakes and . lets the robot coast.\r\n");
+    fflush(stdout);
+  }
+
+  while (!t.quit && !terminated) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < n; ++i) {
+      switch (events[i].data.u32) {
+      case SOURCE_TERMINAL:
+        count = read(STDIN_FILENO, keys, sizeof(keys));
+        if (count <= 0) {
+          t.quit = 1;
+        } else {
+          handle_keys(&t, keys, count);
+        }
+        break;
+      case SOURCE_SOCKET:
+        while ((count = recv(sockfd, keys, sizeof(keys), 0)) > 0) {
+          handle_keys(&t, keys, count);
+        }
+        break;
+      case SOURCE_TIMER:
+        if (read(timerfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+          tick(&t);
+        }
+        break;
+      }
+    }
+
+    fflush(stdout);
+  }
+
+  res = EXIT_SUCCESS;
+
+ out:
+  if (t.drive >= 0 || dry_run) {
+    drive_stop(&t, MOTOR_STOP_DEFAULT);
+  }
+  if (use_terminal && t.quit) {
+    printf("Bye!\r\n");
+  }
+  fflush(stdout);
+  terminal_restore();
+  if (timerfd >= 0)
+    close(timerfd);
+  if (sockfd >= 0) {
+    close(sockfd);
+    unlink(socket_path);
+  }
+  if (epfd >= 0)
+    close(epfd);
+  if (t.drive >= 0)
+    close(t.drive);
+
+  return res;
+}
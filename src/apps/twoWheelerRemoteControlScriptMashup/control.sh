@@ -2,8 +2,9 @@
 
 echo "FirstBot control program:"
 echo "Use numeric keypad for controlling the robot or q to quit."
+echo "5 stops, 0 brakes and . lets the robot coast."
 
-./setup-motors.sh
+./setup-motors.sh || exit 1
 
 while true
 do
@@ -25,6 +26,12 @@ do
   '5')
      ./stop.sh
      ;;
+  '0')
+     ./stop.sh brake
+     ;;
+  '.')
+     ./stop.sh coast
+     ;;
   '7')
      ./forwardleft.sh
      ;;
@@ -38,6 +45,7 @@ do
      ./backright.sh
      ;;
   'q')
+     ./stop.sh
      echo "Bye!"
      exit 0
      ;;
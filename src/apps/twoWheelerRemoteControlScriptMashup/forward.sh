@@ -1,9 +1,4 @@
 #! /bin/sh
 
-# forward motor 1
-echo 0 > /sys/class/gpio/gpio91/value
-echo 0 > /sys/class/gpio/gpio144/value
-
-#forward motor 2
-echo 0 > /sys/class/gpio/gpio83/value
-echo 0 > /sys/class/gpio/gpio146/value
+# forward, both wheels change in the same control tick
+echo "sync 1000 0" > /sys/class/motor/motor_drive/drive
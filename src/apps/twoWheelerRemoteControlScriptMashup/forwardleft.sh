@@ -1,8 +1,4 @@
 #! /bin/sh
 
-# shutdown motor 1 
-echo 1 > /sys/class/gpio/gpio144/value
-
-# forward motor 2
-echo 0 > /sys/class/gpio/gpio83/value
-echo 0 > /sys/class/gpio/gpio146/value
+# forward left, motor 1 stopped, both wheels change in the same control tick
+echo "sync 1000 -50" > /sys/class/motor/motor_drive/drive
@@ -1,8 +1,4 @@
 #! /bin/sh
 
-# forward motor 1
-echo 0 > /sys/class/gpio/gpio91/value
-echo 0 > /sys/class/gpio/gpio144/value
-
-# shutdown motor 2
-echo 1 > /sys/class/gpio/gpio146/value
+# forward right, motor 2 stopped, both wheels change in the same control tick
+echo "sync 1000 50" > /sys/class/motor/motor_drive/drive
@@ -1,9 +1,4 @@
 #! /bin/sh
 
-# forward motor 1
-echo 0 > /sys/class/gpio/gpio91/value
-echo 0 > /sys/class/gpio/gpio144/value
-
-# backward motor 2
-echo 1 > /sys/class/gpio/gpio83/value
-echo 0 > /sys/class/gpio/gpio146/value
+# spin right, motor 1 forward and motor 2 backward, both wheels change in the same control tick
+echo "sync 1000 100" > /sys/class/motor/motor_drive/drive
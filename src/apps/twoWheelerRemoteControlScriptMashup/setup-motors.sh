@@ -1,24 +1,12 @@
 #! /bin/sh
 
-# OE for the level converter, direction is fixed as output in hw
-echo 92 > /sys/class/gpio/export
-echo out > /sys/class/gpio/gpio92/direction
-echo 0 > /sys/class/gpio/gpio92/value
-
-# GPIO144 is set up by another driver by default so just shut down the motor
-echo 1 > /sys/class/gpio/gpio144/value
-
-# Enable for motor 2
-echo 146 > /sys/class/gpio/export
-echo out > /sys/class/gpio/gpio146/direction
-echo 1 > /sys/class/gpio/gpio146/value
-
-# direction for motor 1
-echo 91 > /sys/class/gpio/export
-echo out > /sys/class/gpio/gpio91/direction
-echo 0 > /sys/class/gpio/gpio91/value
-
-# direction for motor 2
-echo 83 > /sys/class/gpio/export
-echo out > /sys/class/gpio/gpio83/direction
-echo 0 > /sys/class/gpio/gpio83/value
+# The motors are driven by the motor driver (motor.ko), as the drive pair
+# of motor 1 (left) and motor 2 (right), see
+# src/drivers/NXT_Sense/module_loading_utility/load_modules.sh
+if [ ! -w /sys/class/motor/motor_drive/drive ]
+then
+  echo "The motor driver is not loaded"
+  exit 1
+fi
+
+echo "stop" > /sys/class/motor/motor_drive/drive
@@ -1,7 +1,5 @@
 #! /bin/sh
 
-# shutdown motor 1
-echo 1 > /sys/class/gpio/gpio144/value
-
-# shutdown motor 2
-echo 1 > /sys/class/gpio/gpio146/value
+# stop both motors, with coast, brake or hold as the first argument or
+# else with the stop mode of the motors
+echo "stop $1" > /sys/class/motor/motor_drive/drive
@@ -0,0 +1,47 @@
+#ifndef __H_backend_h_
+#define __H_backend_h_
+
+/* What udp_server drives and samples: the motor driver of the robot (backend_robot.c), or a simulated robot (backend_sim.c) so the server runs on any Linux box.
+ * Everything is in host byte order, udp_server encodes it.
+ */
+#include <stdint.h>
+
+#define BACKEND_MOTORS 3
+#define BACKEND_SENSORS 4
+
+struct backend_pose {
+  int64_t time_ns;
+  int64_t x; /* In micrometres */
+  int64_t y;
+  uint32_t heading; /* 2^32 being a full turn */
+};
+
+struct backend_motor {
+  int64_t time_ns;
+  int64_t position; /* Tachometer edges */
+  int64_t velocity; /* In thousandths of an edge per second */
+  uint32_t confidence; /* Of the velocity, in per mille */
+};
+
+struct backend_sensor {
+  int64_t time_ns;
+  int32_t value;
+};
+
+struct backend {
+  int sensors; /* Sensors sampled, at most BACKEND_SENSORS */
+  int (*drive)(struct backend *b, int speed, int turn); /* The sync mode of the drive pair */
+  int (*stop)(struct backend *b, int mode);
+  int (*get_pose)(struct backend *b, struct backend_pose *pose);
+  int (*get_motor)(struct backend *b, int motor, struct backend_motor *m);
+  int (*get_sensor)(struct backend *b, int sensor, struct backend_sensor *s);
+  void (*close)(struct backend *b);
+};
+
+/* The sensors are device files of nxt_sense, e.g. /dev/light2, read as text */
+extern struct backend *backend_robot_open(const char *const *sensors, int count);
+extern struct backend *backend_sim_open(int sensors);
+
+extern int64_t backend_now_ns(void);
+
+#endif
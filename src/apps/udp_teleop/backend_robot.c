@@ -0,0 +1,231 @@
+/* Notes:
+ * - The backend of the robot: the drive pair of motor.ko through ioctls on /dev/motor_drive, the pose and the tachometers from their pages mapped from /dev/motor_drive and /dev/motor0, so sampling them costs no system call.
+ * - The velocity of a motor is the estimate of motor.ko (MOTOR_IOC_GET_VELOCITY on /dev/motor<n>), the one its speed controller uses, with its confidence.
+ * - The sensors are read as text with pread(), which nxt_sense serves from offset 0 only. They are opened O_NONBLOCK, as the server samples from its only thread: the ultrasonic and sound sensors give a value only once per measurement or window, and a sample without a new one has no record of them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "motor_ioctl.h"
+#include "backend.h"
+
+#define DRIVE_DEVICE "/dev/motor_drive"
+#define MOTOR_DEVICE "/dev/motor%d" /* The tachometer page is mapped from the first one */
+
+struct backend_robot {
+  struct backend backend;
+  int drive;
+  int motor[BACKEND_MOTORS];
+  const struct motor_odometry_page *odometry;
+  const struct motor_tacho_page *tachos;
+  int sensor[BACKEND_SENSORS];
+};
+
+#define to_robot(b) ((struct backend_robot *) (b))
+
+int64_t backend_now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/***********************************************************************
+ *
+ * Driving
+ *
+ ***********************************************************************/
+static int robot_drive(struct backend *b, int speed, int turn) {
+  struct motor_drive command;
+
+  memset(&command, 0, sizeof(command));
+  command.mode = MOTOR_DRIVE_SYNC;
+  command.speed = speed;
+  command.turn = turn;
+
+  return ioctl(to_robot(b)->drive, MOTOR_IOC_DRIVE, &command);
+}
+
+static int robot_stop(struct backend *b, int mode) {
+  return ioctl(to_robot(b)->drive, MOTOR_IOC_DRIVE_STOP, &mode);
+}
+
+/***********************************************************************
+ *
+ * Sampling, the pages are read as described in motor_ioctl.h
+ *
+ ***********************************************************************/
+static int robot_get_pose(struct backend *b, struct backend_pose *pose) {
+  const struct motor_odometry_page *page = to_robot(b)->odometry;
+  struct motor_pose copy;
+  uint32_t seq;
+
+  do {
+    seq = page->seq;
+    __sync_synchronize();
+    copy = page->pose;
+    __sync_synchronize();
+  } while ((seq & 1) || seq != page->seq);
+
+  pose->time_ns = copy.time_ns;
+  pose->x = copy.x;
+  pose->y = copy.y;
+  pose->heading = copy.heading;
+
+  return 0;
+}
+
+static int robot_get_motor(struct backend *b, int motor, struct backend_motor *m) {
+  const struct motor_tacho_state *s = &to_robot(b)->tachos->motor[motor];
+  struct motor_tacho_state copy;
+  struct motor_velocity velocity;
+  uint32_t seq;
+
+  if (ioctl(to_robot(b)->motor[motor], MOTOR_IOC_GET_VELOCITY, &velocity) != 0) {
+    return -1;
+  }
+
+  do {
+    seq = s->seq;
+    __sync_synchronize();
+    copy = *s;
+    __sync_synchronize();
+  } while ((seq & 1) || seq != s->seq);
+
+  m->time_ns = backend_now_ns();
+  m->position = copy.position;
+  m->velocity = velocity.velocity;
+  m->confidence = velocity.confidence;
+
+  return 0;
+}
+
+static int robot_get_sensor(struct backend *b, int sensor, struct backend_sensor *s) {
+  char buf[16];
+  ssize_t count;
+
+  /* -EAGAIN until the sensor has a new value */
+  count = pread(to_robot(b)->sensor[sensor], buf, sizeof(buf) - 1, 0);
+  if (count <= 0) {
+    return -1;
+  }
+
+  buf[count] = '\0';
+  s->time_ns = backend_now_ns();
+  s->value = atoi(buf);
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * Opening and closing
+ *
+ ***********************************************************************/
+static void robot_close(struct backend *b) {
+  struct backend_robot *r = to_robot(b);
+  int i;
+
+  for (i = 0; i < r->backend.sensors; ++i) {
+    close(r->sensor[i]);
+  }
+  munmap((void *) r->tachos, sysconf(_SC_PAGESIZE));
+  for (i = 0; i < BACKEND_MOTORS; ++i) {
+    close(r->motor[i]);
+  }
+  munmap((void *) r->odometry, sysconf(_SC_PAGESIZE));
+  close(r->drive);
+  free(r);
+}
+
+struct backend *backend_robot_open(const char *const *sensors, int count) {
+  struct backend_robot *r;
+  long page_size = sysconf(_SC_PAGESIZE);
+  char name[32];
+  void *page;
+  int motors;
+
+  if (count > BACKEND_SENSORS) {
+    fprintf(stderr, "At most %d sensors\n", BACKEND_SENSORS);
+    return NULL;
+  }
+
+  r = calloc(1, sizeof(*r));
+  if (!r) {
+    goto open_fail_1;
+  }
+
+  r->drive = open(DRIVE_DEVICE, O_RDWR | O_CLOEXEC);
+  if (r->drive < 0) {
+    perror(DRIVE_DEVICE);
+    goto open_fail_2;
+  }
+
+  page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, r->drive, 0);
+  if (page == MAP_FAILED) {
+    perror("mmap(" DRIVE_DEVICE ")");
+    goto open_fail_3;
+  }
+  r->odometry = page;
+
+  for (motors = 0; motors < BACKEND_MOTORS; ++motors) {
+    snprintf(name, sizeof(name), MOTOR_DEVICE, motors);
+    r->motor[motors] = open(name, O_RDONLY | O_CLOEXEC);
+    if (r->motor[motors] < 0) {
+      perror(name);
+      goto open_fail_4;
+    }
+  }
+
+  page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, r->motor[0], 0);
+  if (page == MAP_FAILED) {
+    perror("mmap(/dev/motor0)");
+    goto open_fail_4;
+  }
+  r->tachos = page;
+
+  for (r->backend.sensors = 0; r->backend.sensors < count; ++r->backend.sensors) {
+    r->sensor[r->backend.sensors] = open(sensors[r->backend.sensors], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (r->sensor[r->backend.sensors] < 0) {
+      perror(sensors[r->backend.sensors]);
+      goto open_fail_5;
+    }
+  }
+
+  r->backend.drive = robot_drive;
+  r->backend.stop = robot_stop;
+  r->backend.get_pose = robot_get_pose;
+  r->backend.get_motor = robot_get_motor;
+  r->backend.get_sensor = robot_get_sensor;
+  r->backend.close = robot_close;
+
+  return &r->backend;
+
+ open_fail_5:
+  while (r->backend.sensors-- > 0) {
+    close(r->sensor[r->backend.sensors]);
+  }
+  munmap((void *) r->tachos, page_size);
+
+ open_fail_4:
+  while (motors-- > 0) {
+    close(r->motor[motors]);
+  }
+  munmap((void *) r->odometry, page_size);
+
+ open_fail_3:
+  close(r->drive);
+
+ open_fail_2:
+  free(r);
+
+ open_fail_1:
+  return NULL;
+}
@@ -0,0 +1,130 @@
+/* Notes:
+ * - A simulated robot for running udp_server without the motor driver: the wheels follow the drive command at once, with the drive factors of the sync mode of motor_drive, and the pose is integrated from them whenever it is sampled, with the defaults of the odometry of motor.ko.
+ * - The sensors read a slow triangle wave, so the telemetry changes.
+ */
+#include <stdlib.h>
+#include <math.h>
+
+#include "backend.h"
+
+#define SIM_EDGES_PER_SECOND 1440.0 /* Of a wheel at full speed, 2 turns per second */
+#define SIM_EDGES_PER_REV 720.0
+#define SIM_WHEEL_RADIUS_UM 28000.0
+#define SIM_WHEEL_BASE_UM 112000.0
+
+struct backend_sim {
+  struct backend backend;
+  int64_t time_ns; /* Of the last integration */
+  double left; /* Wheel velocities in edges per second */
+  double right;
+  double position[2]; /* Of the wheels, in edges */
+  double x;
+  double y;
+  double heading; /* In radians */
+};
+
+#define to_sim(b) ((struct backend_sim *) (b))
+
+static void sim_advance(struct backend_sim *s) {
+  int64_t now = backend_now_ns();
+  double dt = (now - s->time_ns) / 1e9;
+  double um_per_edge = 2 * M_PI * SIM_WHEEL_RADIUS_UM / SIM_EDGES_PER_REV;
+  double left = s->left * dt * um_per_edge;
+  double right = s->right * dt * um_per_edge;
+  double turn = (right - left) / SIM_WHEEL_BASE_UM;
+  double middle = s->heading + turn / 2;
+
+  s->x += (left + right) / 2 * cos(middle);
+  s->y += (left + right) / 2 * sin(middle);
+  s->heading = fmod(s->heading + turn, 2 * M_PI);
+  s->position[0] += s->left * dt;
+  s->position[1] += s->right * dt;
+  s->time_ns = now;
+}
+
+/* Like drive_factors of motor_drive, positive turns right */
+static int sim_drive(struct backend *b, int speed, int turn) {
+  struct backend_sim *s = to_sim(b);
+  int left = (turn < 0 ? 100 + 2 * turn : 100);
+  int right = (turn > 0 ? 100 - 2 * turn : 100);
+
+  if (speed < -1000 || speed > 1000 || turn < -100 || turn > 100) {
+    return -1;
+  }
+
+  sim_advance(s);
+  s->left = speed * left / 100 * SIM_EDGES_PER_SECOND / 1000;
+  s->right = speed * right / 100 * SIM_EDGES_PER_SECOND / 1000;
+
+  return 0;
+}
+
+static int sim_stop(struct backend *b, int mode) {
+  return sim_drive(b, 0, 0);
+}
+
+static int sim_get_pose(struct backend *b, struct backend_pose *pose) {
+  struct backend_sim *s = to_sim(b);
+  double heading;
+
+  sim_advance(s);
+  heading = (s->heading < 0 ? s->heading + 2 * M_PI : s->heading);
+
+  pose->time_ns = s->time_ns;
+  pose->x = llround(s->x);
+  pose->y = llround(s->y);
+  pose->heading = (uint32_t) (heading / (2 * M_PI) * 4294967296.0);
+
+  return 0;
+}
+
+static int sim_get_motor(struct backend *b, int motor, struct backend_motor *m) {
+  struct backend_sim *s = to_sim(b);
+
+  sim_advance(s);
+
+  m->time_ns = s->time_ns;
+  m->position = (motor < 2 ? llround(s->position[motor]) : 0);
+  m->velocity = (motor < 2 ? llround((motor == 0 ? s->left : s->right) * 1000) : 0);
+  m->confidence = 1000;
+
+  return 0;
+}
+
+static int sim_get_sensor(struct backend *b, int sensor, struct backend_sensor *s) {
+  int64_t now = backend_now_ns();
+  int phase = (int) ((now / 1000000 + sensor * 500) % 2000);
+
+  s->time_ns = now;
+  s->value = (phase < 1000 ? phase : 2000 - phase) * 4;
+
+  return 0;
+}
+
+static void sim_close(struct backend *b) {
+  free(to_sim(b));
+}
+
+struct backend *backend_sim_open(int sensors) {
+  struct backend_sim *s;
+
+  if (sensors > BACKEND_SENSORS) {
+    return NULL;
+  }
+
+  s = calloc(1, sizeof(*s));
+  if (!s) {
+    return NULL;
+  }
+
+  s->time_ns = backend_now_ns();
+  s->backend.sensors = sensors;
+  s->backend.drive = sim_drive;
+  s->backend.stop = sim_stop;
+  s->backend.get_pose = sim_get_pose;
+  s->backend.get_motor = sim_get_motor;
+  s->backend.get_sensor = sim_get_sensor;
+  s->backend.close = sim_close;
+
+  return &s->backend;
+}
@@ -0,0 +1,120 @@
+#ifndef __H_nxt_proto_h_
+#define __H_nxt_proto_h_
+
+/* The UDP protocol between a robot (udp_server) and its remote control (udp_client or any other program).
+ * Every datagram starts with a struct nxt_header, all fields are little-endian and the structs are packed. A datagram is never larger than NXT_PROTO_MTU, so it is never fragmented on an Ethernet or WiFi link.
+ *
+ * Client to server:
+ * - NXT_MSG_DRIVE drives the robot. The seq of the header numbers the commands of the client, a command not newer than the last one applied is stale (reordered or duplicated by the network) and dropped. With NXT_DRIVE_ACK in flags the server answers at once with an NXT_MSG_ACK.
+ * - NXT_MSG_STOP stops the robot, whatever its seq.
+ * - NXT_MSG_SUBSCRIBE asks for telemetry at rate_hz samples per second, sent to the address of the subscriber. A rate of 0 ends the subscription.
+ * The server stops the robot when no drive command arrived for its watchdog time, so a client has to repeat its command while driving.
+ *
+ * Server to client:
+ * - NXT_MSG_ACK answers a drive command, echoing its seq and sent_ns so the client can measure the round trip with its own clock.
+ * - NXT_MSG_TELEMETRY carries count records, the samples of flush_ms or as many as fit into NXT_PROTO_MTU, whatever comes first. The seq of the header numbers the telemetry packets, so the client can count the lost ones.
+ */
+#include <stdint.h>
+
+#define NXT_PROTO_MAGIC 0x584E /* "NX" */
+#define NXT_PROTO_VERSION 1
+#define NXT_PROTO_PORT 4950
+#define NXT_PROTO_MTU 1472 /* 1500 - IP header - UDP header */
+
+#define NXT_MSG_DRIVE 1
+#define NXT_MSG_STOP 2
+#define NXT_MSG_SUBSCRIBE 3
+#define NXT_MSG_ACK 4
+#define NXT_MSG_TELEMETRY 5
+
+struct nxt_header {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t type;
+  uint32_t seq;
+} __attribute__((packed));
+
+#define NXT_DRIVE_ACK 0x01
+
+/* Like MOTOR_DRIVE_SYNC of the drive pair: speed in per mille, turn from -100 (spin left) to 100 (spin right) */
+struct nxt_drive {
+  struct nxt_header header;
+  int64_t sent_ns; /* Clock of the client, only echoed */
+  int16_t speed;
+  int8_t turn;
+  uint8_t flags;
+} __attribute__((packed));
+
+/* The stop modes of the motor driver */
+#define NXT_STOP_COAST 0
+#define NXT_STOP_BRAKE 1
+#define NXT_STOP_HOLD 2
+#define NXT_STOP_DEFAULT 3 /* The stop mode of the motors */
+
+struct nxt_stop {
+  struct nxt_header header;
+  uint8_t mode;
+  uint8_t reserved[3];
+} __attribute__((packed));
+
+#define NXT_TELEMETRY_POSE 0x01
+#define NXT_TELEMETRY_MOTORS 0x02
+#define NXT_TELEMETRY_SENSORS 0x04
+
+struct nxt_subscribe {
+  struct nxt_header header;
+  uint16_t rate_hz;
+  uint16_t flush_ms; /* Longest time a sample waits for the packet to fill, 0 sends every sample at once */
+  uint32_t mask; /* NXT_TELEMETRY_* */
+} __attribute__((packed));
+
+struct nxt_ack {
+  struct nxt_header header; /* seq of the drive command */
+  int64_t sent_ns;
+  uint32_t stale; /* Drive commands dropped since the server started */
+  uint32_t reserved;
+} __attribute__((packed));
+
+struct nxt_telemetry {
+  struct nxt_header header;
+  int64_t server_ns; /* CLOCK_MONOTONIC of the server when sent */
+  uint32_t ack; /* seq of the last drive command applied */
+  uint16_t count; /* Records following */
+  uint16_t reserved;
+} __attribute__((packed));
+
+/* Every record starts with a struct nxt_record, length covering the whole record, so a client skips the types it does not know */
+#define NXT_RECORD_POSE 1
+#define NXT_RECORD_MOTOR 2
+#define NXT_RECORD_SENSOR 3
+
+struct nxt_record {
+  uint8_t type;
+  uint8_t length;
+  uint16_t index; /* Of the motor or the sensor */
+} __attribute__((packed));
+
+/* The odometry of the drive pair, see struct motor_pose */
+struct nxt_pose_record {
+  struct nxt_record record;
+  uint32_t heading; /* Counterclockwise from the x axis, 2^32 being a full turn */
+  int64_t time_ns;
+  int64_t x; /* In micrometres */
+  int64_t y;
+} __attribute__((packed));
+
+struct nxt_motor_record {
+  struct nxt_record record;
+  uint32_t confidence; /* Of the velocity in per mille, see struct motor_velocity */
+  int64_t time_ns;
+  int64_t position; /* Tachometer edges */
+  int64_t velocity; /* In thousandths of an edge per second, the estimate of the motor driver */
+} __attribute__((packed));
+
+struct nxt_sensor_record {
+  struct nxt_record record;
+  int32_t value; /* The reading of the sensor device */
+  int64_t time_ns;
+} __attribute__((packed));
+
+#endif
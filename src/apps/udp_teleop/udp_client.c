@@ -0,0 +1,466 @@
+/* Notes:
+ * - The test client of the protocol in nxt_proto.h: it subscribes to the telemetry, sends drive commands at a rate for a while and then reports the round trip of the commands (from their acks), the stale commands dropped by the server and the telemetry received. Run against "udp_server -s" over loopback it benchmarks the server on any Linux box.
+ * - Every stale_every-th command is followed by a copy of an older one, which the server has to drop; the report compares the drops counted by the server with the copies sent.
+ * - With -c 0 the commands are sent back to back, each as soon as the ack of the one before arrived (or after ACK_TIMEOUT_MS), measuring the throughput of the server.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "nxt_proto.h"
+
+#define MAX_EVENTS 2
+#define MAX_SAMPLES 1000000
+#define ACK_TIMEOUT_MS 100
+#define STALE_AGE 3 /* Commands a stale copy is behind */
+
+enum source {
+  SOURCE_SOCKET,
+  SOURCE_TIMER,
+};
+
+struct client {
+  int sock;
+  int stale_every;
+  int back_to_back;
+  int draining; /* Only receiving the last acks */
+
+  uint32_t seq; /* Of the next drive command */
+  unsigned long sent;
+  unsigned long stale_sent;
+  unsigned long acks;
+  uint32_t server_stale; /* From the last ack */
+  int64_t *rtt_ns; /* One per ack, up to MAX_SAMPLES */
+  int64_t last_sent_ns;
+
+  unsigned long packets;
+  unsigned long records;
+  unsigned long bytes;
+  unsigned long lost; /* Gaps in the seq of the telemetry */
+  uint32_t next_telemetry;
+  int has_telemetry;
+  int64_t last_pose_x;
+  int64_t last_pose_y;
+  uint32_t last_heading;
+};
+
+static int64_t now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void header_init(struct nxt_header *header, uint8_t type, uint32_t seq) {
+  header->magic = htole16(NXT_PROTO_MAGIC);
+  header->version = NXT_PROTO_VERSION;
+  header->type = type;
+  header->seq = htole32(seq);
+}
+
+/***********************************************************************
+ *
+ * Messages to the server
+ *
+ ***********************************************************************/
+static void send_drive(struct client *c, uint32_t seq, int speed, int turn) {
+  struct nxt_drive drive;
+
+  header_init(&drive.header, NXT_MSG_DRIVE, seq);
+  drive.sent_ns = htole64(now_ns());
+  drive.speed = htole16((int16_t) speed);
+  drive.turn = turn;
+  drive.flags = NXT_DRIVE_ACK;
+
+  if (send(c->sock, &drive, sizeof(drive), 0) < 0) {
+    perror("send");
+  }
+}
+
+/* Sweeps the speed and the turn, so a simulated robot drives around */
+static void drive_next(struct client *c) {
+  int speed = (int) (c->seq % 2000) - 1000;
+  int turn = (int) (c->seq % 201) - 100;
+
+  send_drive(c, c->seq, speed, turn);
+  ++c->sent;
+  c->last_sent_ns = now_ns();
+
+  if (c->stale_every > 0 && c->seq % c->stale_every == 0 && c->seq >= STALE_AGE) {
+    send_drive(c, c->seq - STALE_AGE, 0, 0);
+    ++c->stale_sent;
+  }
+
+  ++c->seq;
+}
+
+static void send_stop(struct client *c) {
+  struct nxt_stop stop;
+
+  memset(&stop, 0, sizeof(stop));
+  header_init(&stop.header, NXT_MSG_STOP, 0);
+  stop.mode = NXT_STOP_DEFAULT;
+  send(c->sock, &stop, sizeof(stop), 0);
+}
+
+static void send_subscribe(struct client *c, int rate_hz, int flush_ms, uint32_t mask) {
+  struct nxt_subscribe subscribe;
+
+  header_init(&subscribe.header, NXT_MSG_SUBSCRIBE, 0);
+  subscribe.rate_hz = htole16(rate_hz);
+  subscribe.flush_ms = htole16(flush_ms);
+  subscribe.mask = htole32(mask);
+  send(c->sock, &subscribe, sizeof(subscribe), 0);
+}
+
+/***********************************************************************
+ *
+ * Messages from the server
+ *
+ ***********************************************************************/
+static void handle_ack(struct client *c, const struct nxt_ack *ack) {
+  int64_t rtt = now_ns() - (int64_t) le64toh(ack->sent_ns);
+
+  if (c->acks < MAX_SAMPLES) {
+    c->rtt_ns[c->acks] = rtt;
+  }
+  ++c->acks;
+  c->server_stale = le32toh(ack->stale);
+}
+
+static void handle_telemetry(struct client *c, const uint8_t *buf, ssize_t length) {
+  const struct nxt_telemetry *telemetry = (const struct nxt_telemetry *) buf;
+  const struct nxt_pose_record *pose;
+  const struct nxt_record *record;
+  uint32_t seq = le32toh(telemetry->header.seq);
+  ssize_t offset = sizeof(*telemetry);
+  int count = le16toh(telemetry->count);
+  int i;
+
+  if (c->has_telemetry && (int32_t) (seq - c->next_telemetry) > 0) {
+    c->lost += seq - c->next_telemetry;
+  }
+  c->next_telemetry = seq + 1;
+  c->has_telemetry = 1;
+
+  ++c->packets;
+  c->bytes += length;
+
+  for (i = 0; i < count; ++i) {
+    record = (const struct nxt_record *) (buf + offset);
+    if (offset + (ssize_t) sizeof(*record) > length || record->length < sizeof(*record) || offset + record->length > length) {
+      fprintf(stderr, "Malformed telemetry packet %u\n", seq);
+      return;
+    }
+
+    if (record->type == NXT_RECORD_POSE && record->length >= sizeof(*pose)) {
+      pose = (const struct nxt_pose_record *) record;
+      c->last_pose_x = le64toh(pose->x);
+      c->last_pose_y = le64toh(pose->y);
+      c->last_heading = le32toh(pose->heading);
+    }
+
+    offset += record->length;
+    ++c->records;
+  }
+}
+
+static void receive(struct client *c) {
+  uint8_t buf[NXT_PROTO_MTU];
+  const struct nxt_header *header = (const struct nxt_header *) buf;
+  ssize_t length;
+
+  while ((length = recv(c->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    if (length < (ssize_t) sizeof(*header) || le16toh(header->magic) != NXT_PROTO_MAGIC || header->version != NXT_PROTO_VERSION) {
+      continue;
+    }
+
+    if (header->type == NXT_MSG_ACK && length >= (ssize_t) sizeof(struct nxt_ack)) {
+      handle_ack(c, (const struct nxt_ack *) buf);
+      if (c->back_to_back && !c->draining) {
+        drive_next(c);
+      }
+    } else if (header->type == NXT_MSG_TELEMETRY && length >= (ssize_t) sizeof(struct nxt_telemetry)) {
+      handle_telemetry(c, buf, length);
+    }
+  }
+}
+
+/***********************************************************************
+ *
+ * The report
+ *
+ ***********************************************************************/
+static int compare_ns(const void *a, const void *b) {
+  int64_t x = *(const int64_t *) a;
+  int64_t y = *(const int64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void report(struct client *c, double seconds) {
+  unsigned long samples = (c->acks < MAX_SAMPLES ? c->acks : MAX_SAMPLES);
+  int64_t sum = 0;
+  unsigned long i;
+
+  printf("commands: %lu sent, %lu acked, %.0f/s\n", c->sent, c->acks, c->acks / seconds);
+  if (samples > 0) {
+    qsort(c->rtt_ns, samples, sizeof(*c->rtt_ns), compare_ns);
+    for (i = 0; i < samples; ++i) {
+      sum += c->rtt_ns[i];
+    }
+    printf("round trip: min %.1f us, mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           c->rtt_ns[0] / 1e3, (double) sum / samples / 1e3, c->rtt_ns[samples / 2] / 1e3,
+           c->rtt_ns[samples * 99 / 100] / 1e3, c->rtt_ns[samples - 1] / 1e3);
+  }
+  printf("stale: %lu sent, %u dropped by the server as of the last ack\n", c->stale_sent, c->server_stale);
+  printf("telemetry: %lu packets, %lu lost, %lu records (%.1f per packet), %.0f bytes/s\n",
+         c->packets, c->lost, c->records, (c->packets > 0 ? (double) c->records / c->packets : 0.0), c->bytes / seconds);
+  printf("pose: x %lld um, y %lld um, heading %.1f degrees\n",
+         (long long) c->last_pose_x, (long long) c->last_pose_y, c->last_heading * 360.0 / 4294967296.0);
+}
+
+/***********************************************************************
+ *
+ * Setup and main loop
+ *
+ ***********************************************************************/
+static int socket_setup(const char *host, int port) {
+  struct addrinfo hints;
+  struct addrinfo *info;
+  char service[16];
+  int fd;
+  int res;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  snprintf(service, sizeof(service), "%d", port);
+
+  res = getaddrinfo(host, service, &hints, &info);
+  if (res != 0) {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(res));
+    return -1;
+  }
+
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+  } else if (connect(fd, info->ai_addr, info->ai_addrlen) < 0) {
+    perror("connect");
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(info);
+
+  return fd;
+}
+
+static int timer_setup(long period_ns) {
+  struct itimerspec spec;
+  int fd;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  spec.it_interval.tv_sec = period_ns / 1000000000L;
+  spec.it_interval.tv_nsec = period_ns % 1000000000L;
+  spec.it_value = spec.it_interval;
+
+  if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+    perror("timerfd_settime");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int epoll_add(int epfd, int fd, enum source source) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = source;
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-H host] [-p port] [-c command_hz] [-t seconds] [-r rate_hz] [-f flush_ms] [-m mask] [-x stale_every]\n"
+          "  -H  the robot (default 127.0.0.1)\n"
+          "  -p  UDP port (default %d)\n"
+          "  -c  drive commands per second, 0 back to back (default 50)\n"
+          "  -t  duration (default 5 s)\n"
+          "  -r  telemetry samples per second, 0 none (default 100)\n"
+          "  -f  longest wait of a sample for its packet to fill (default 50 ms)\n"
+          "  -m  telemetry, 1 pose | 2 motors | 4 sensors (default 7)\n"
+          "  -x  send a stale command after every so many, 0 never (default 10)\n",
+          name, NXT_PROTO_PORT);
+}
+
+int main(int argc, char **argv) {
+  struct epoll_event events[MAX_EVENTS];
+  struct client c;
+  const char *host = "127.0.0.1";
+  uint64_t expirations;
+  int64_t end;
+  int port = NXT_PROTO_PORT;
+  int command_hz = 50;
+  int seconds = 5;
+  int rate_hz = 100;
+  int flush_ms = 50;
+  uint32_t mask = NXT_TELEMETRY_POSE | NXT_TELEMETRY_MOTORS | NXT_TELEMETRY_SENSORS;
+  int res = EXIT_FAILURE;
+  int epfd = -1;
+  int timer = -1;
+  int n;
+  int i;
+  int opt;
+
+  memset(&c, 0, sizeof(c));
+  c.stale_every = 10;
+
+  while ((opt = getopt(argc, argv, "H:p:c:t:r:f:m:x:h")) != -1) {
+    switch (opt) {
+    case 'H':
+      host = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'c':
+      command_hz = atoi(optarg);
+      break;
+    case 't':
+      seconds = atoi(optarg);
+      break;
+    case 'r':
+      rate_hz = atoi(optarg);
+      break;
+    case 'f':
+      flush_ms = atoi(optarg);
+      break;
+    case 'm':
+      mask = strtoul(optarg, NULL, 0);
+      break;
+    case 'x':
+      c.stale_every = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (command_hz < 0 || seconds <= 0 || rate_hz < 0 || flush_ms < 0 || c.stale_every < 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  c.back_to_back = (command_hz == 0);
+
+  c.rtt_ns = malloc(MAX_SAMPLES * sizeof(*c.rtt_ns));
+  if (!c.rtt_ns) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+
+  c.sock = socket_setup(host, port);
+  if (c.sock < 0)
+    goto out;
+
+  /* Back to back, the timer only restarts a stream that lost a packet */
+  timer = timer_setup(c.back_to_back ? ACK_TIMEOUT_MS * 1000000L : 1000000000L / command_hz);
+  if (timer < 0)
+    goto out;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    goto out;
+  }
+  if (epoll_add(epfd, c.sock, SOURCE_SOCKET) < 0 || epoll_add(epfd, timer, SOURCE_TIMER) < 0)
+    goto out;
+
+  if (rate_hz > 0) {
+    send_subscribe(&c, rate_hz, flush_ms, mask);
+  }
+
+  end = now_ns() + (int64_t) seconds * 1000000000LL;
+  drive_next(&c);
+
+  /* Sending until end, then only receiving the acks of the last commands */
+  while (now_ns() < end || !c.draining) {
+    if (!c.draining && now_ns() >= end) {
+      c.draining = 1;
+      end += ACK_TIMEOUT_MS * 1000000LL;
+      send_stop(&c);
+      if (rate_hz > 0) {
+        send_subscribe(&c, 0, 0, 0);
+      }
+    }
+
+    n = epoll_wait(epfd, events, MAX_EVENTS, (int) ((end - now_ns()) / 1000000) + 1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      goto out;
+    }
+
+    for (i = 0; i < n; ++i) {
+      switch (events[i].data.u32) {
+      case SOURCE_SOCKET:
+        receive(&c);
+        break;
+      case SOURCE_TIMER:
+        if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+          break;
+        }
+        if (c.draining) {
+          break;
+        }
+        if (!c.back_to_back || now_ns() - c.last_sent_ns >= ACK_TIMEOUT_MS * 1000000LL) {
+          drive_next(&c);
+        }
+        break;
+      }
+    }
+  }
+
+  report(&c, seconds);
+  res = EXIT_SUCCESS;
+
+ out:
+  if (epfd >= 0)
+    close(epfd);
+  if (timer >= 0)
+    close(timer);
+  if (c.sock >= 0)
+    close(c.sock);
+  free(c.rtt_ns);
+
+  return res;
+}
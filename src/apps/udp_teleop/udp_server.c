@@ -0,0 +1,481 @@
+/* Notes:
+ * - The server on the robot of the protocol in nxt_proto.h: one UDP socket and a timerfd, waited for with epoll. The socket is drained on every wakeup, so a burst of commands costs one epoll_wait.
+ * - Drive commands are applied in the order of their seq, a command not newer than the last one applied being stale and dropped. A command from another address takes the robot over and starts the sequence over.
+ * - The timer ticks every WATCHDOG_TICK_MS at most, so the watchdog holds with any telemetry rate. A sample period longer than that is split into equal ticks, and every sample_ticks-th tick samples the records into the batch. The batch is sent when the next record does not fit into NXT_PROTO_MTU or its first record is flush_ms old, checked on every tick.
+ * - -s drives a simulated robot (backend_sim.c), so the server and udp_client run over loopback on any Linux box.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <endian.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "nxt_proto.h"
+#include "backend.h"
+
+#define WATCHDOG_TICK_MS 20
+#define MAX_RATE_HZ 1000
+#define MAX_EVENTS 2
+
+enum source {
+  SOURCE_SOCKET,
+  SOURCE_TIMER,
+};
+
+struct server {
+  struct backend *backend;
+  int sock;
+  int timer;
+  int watchdog_ms;
+
+  /* The client driving the robot */
+  struct sockaddr_in driver;
+  int has_driver;
+  uint32_t last_seq; /* Of the last drive command applied */
+  int64_t last_drive_ns;
+  int driving;
+  uint32_t stale;
+
+  /* The subscriber of the telemetry */
+  struct sockaddr_in subscriber;
+  int rate_hz; /* 0 without a subscriber */
+  int flush_ms;
+  int sample_ticks; /* Timer ticks per sample */
+  int ticks; /* Since the last sample */
+  uint32_t mask;
+  uint32_t telemetry_seq;
+
+  /* The batch of records being filled */
+  uint8_t batch[NXT_PROTO_MTU];
+  size_t length;
+  uint16_t count;
+  int64_t batch_ns; /* Time of the first record */
+};
+
+static volatile sig_atomic_t terminated;
+
+static void header_init(struct nxt_header *header, uint8_t type, uint32_t seq) {
+  header->magic = htole16(NXT_PROTO_MAGIC);
+  header->version = NXT_PROTO_VERSION;
+  header->type = type;
+  header->seq = htole32(seq);
+}
+
+static int same_address(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/***********************************************************************
+ *
+ * The telemetry batch
+ *
+ ***********************************************************************/
+static void batch_reset(struct server *s) {
+  s->length = sizeof(struct nxt_telemetry);
+  s->count = 0;
+}
+
+static void batch_send(struct server *s) {
+  struct nxt_telemetry *telemetry = (struct nxt_telemetry *) s->batch;
+
+  if (s->count == 0) {
+    return;
+  }
+
+  header_init(&telemetry->header, NXT_MSG_TELEMETRY, s->telemetry_seq++);
+  telemetry->server_ns = htole64(backend_now_ns());
+  telemetry->ack = htole32(s->last_seq);
+  telemetry->count = htole16(s->count);
+  telemetry->reserved = 0;
+
+  /* A lost packet is not sent again, the next samples are newer anyway */
+  if (sendto(s->sock, s->batch, s->length, 0, (struct sockaddr *) &s->subscriber, sizeof(s->subscriber)) < 0 && errno != EAGAIN) {
+    perror("sendto");
+  }
+
+  batch_reset(s);
+}
+
+/* Room for a record of size bytes, sending the batch first when it is full */
+static void *batch_reserve(struct server *s, uint8_t type, uint16_t index, size_t size) {
+  struct nxt_record *record;
+
+  if (s->length + size > sizeof(s->batch)) {
+    batch_send(s);
+  }
+
+  if (s->count == 0) {
+    s->batch_ns = backend_now_ns();
+  }
+
+  record = (struct nxt_record *) (s->batch + s->length);
+  record->type = type;
+  record->length = size;
+  record->index = htole16(index);
+
+  s->length += size;
+  ++s->count;
+
+  return record;
+}
+
+static void sample(struct server *s) {
+  struct backend *b = s->backend;
+  struct backend_pose pose;
+  struct backend_motor motor;
+  struct backend_sensor sensor;
+  struct nxt_pose_record *p;
+  struct nxt_motor_record *m;
+  struct nxt_sensor_record *r;
+  int i;
+
+  if ((s->mask & NXT_TELEMETRY_POSE) && b->get_pose(b, &pose) == 0) {
+    p = batch_reserve(s, NXT_RECORD_POSE, 0, sizeof(*p));
+    p->heading = htole32(pose.heading);
+    p->time_ns = htole64(pose.time_ns);
+    p->x = htole64(pose.x);
+    p->y = htole64(pose.y);
+  }
+
+  if (s->mask & NXT_TELEMETRY_MOTORS) {
+    for (i = 0; i < BACKEND_MOTORS; ++i) {
+      if (b->get_motor(b, i, &motor) == 0) {
+        m = batch_reserve(s, NXT_RECORD_MOTOR, i, sizeof(*m));
+        m->confidence = htole32(motor.confidence);
+        m->time_ns = htole64(motor.time_ns);
+        m->position = htole64(motor.position);
+        m->velocity = htole64(motor.velocity);
+      }
+    }
+  }
+
+  if (s->mask & NXT_TELEMETRY_SENSORS) {
+    for (i = 0; i < b->sensors; ++i) {
+      if (b->get_sensor(b, i, &sensor) == 0) {
+        r = batch_reserve(s, NXT_RECORD_SENSOR, i, sizeof(*r));
+        r->value = htole32(sensor.value);
+        r->time_ns = htole64(sensor.time_ns);
+      }
+    }
+  }
+}
+
+/***********************************************************************
+ *
+ * The timer: the watchdog and the samples
+ *
+ ***********************************************************************/
+static int timer_set(struct server *s) {
+  struct itimerspec spec;
+  long watchdog_ns = WATCHDOG_TICK_MS * 1000000L;
+  long sample_ns;
+  long period_ns = watchdog_ns;
+
+  s->sample_ticks = 1;
+  s->ticks = 0;
+  if (s->rate_hz > 0) {
+    sample_ns = 1000000000L / s->rate_hz;
+    s->sample_ticks = (int) ((sample_ns + watchdog_ns - 1) / watchdog_ns);
+    period_ns = sample_ns / s->sample_ticks;
+  }
+
+  spec.it_interval.tv_sec = period_ns / 1000000000L;
+  spec.it_interval.tv_nsec = period_ns % 1000000000L;
+  spec.it_value = spec.it_interval;
+
+  if (timerfd_settime(s->timer, 0, &spec, NULL) < 0) {
+    perror("timerfd_settime");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void tick(struct server *s) {
+  int64_t now = backend_now_ns();
+
+  if (s->driving && s->watchdog_ms > 0 && now - s->last_drive_ns >= (int64_t) s->watchdog_ms * 1000000) {
+    s->backend->stop(s->backend, NXT_STOP_DEFAULT);
+    s->driving = 0;
+  }
+
+  if (s->rate_hz == 0) {
+    return;
+  }
+
+  if (++s->ticks >= s->sample_ticks) {
+    s->ticks = 0;
+    sample(s);
+  }
+
+  if (s->count > 0 && backend_now_ns() - s->batch_ns >= (int64_t) s->flush_ms * 1000000) {
+    batch_send(s);
+  }
+}
+
+/***********************************************************************
+ *
+ * The messages from the clients
+ *
+ ***********************************************************************/
+static void handle_drive(struct server *s, const struct nxt_drive *drive, const struct sockaddr_in *from) {
+  uint32_t seq = le32toh(drive->header.seq);
+  struct nxt_ack ack;
+
+  if (!s->has_driver || !same_address(&s->driver, from)) {
+    s->driver = *from;
+    s->has_driver = 1;
+  } else if ((int32_t) (seq - s->last_seq) <= 0) {
+    ++s->stale;
+    return;
+  }
+
+  s->last_seq = seq;
+  s->last_drive_ns = backend_now_ns();
+
+  if (s->backend->drive(s->backend, (int16_t) le16toh(drive->speed), drive->turn) == 0) {
+    s->driving = 1;
+  }
+
+  if (drive->flags & NXT_DRIVE_ACK) {
+    header_init(&ack.header, NXT_MSG_ACK, seq);
+    ack.sent_ns = drive->sent_ns; /* Only echoed, no conversion */
+    ack.stale = htole32(s->stale);
+    ack.reserved = 0;
+    sendto(s->sock, &ack, sizeof(ack), 0, (struct sockaddr *) from, sizeof(*from));
+  }
+}
+
+static void handle_subscribe(struct server *s, const struct nxt_subscribe *subscribe, const struct sockaddr_in *from) {
+  int rate_hz = le16toh(subscribe->rate_hz);
+
+  batch_send(s);
+
+  s->subscriber = *from;
+  s->rate_hz = (rate_hz > MAX_RATE_HZ ? MAX_RATE_HZ : rate_hz);
+  s->flush_ms = le16toh(subscribe->flush_ms);
+  s->mask = le32toh(subscribe->mask);
+  timer_set(s);
+}
+
+static void handle_datagram(struct server *s, const uint8_t *buf, ssize_t length, const struct sockaddr_in *from) {
+  const struct nxt_header *header = (const struct nxt_header *) buf;
+
+  if (length < (ssize_t) sizeof(*header) || le16toh(header->magic) != NXT_PROTO_MAGIC || header->version != NXT_PROTO_VERSION) {
+    return;
+  }
+
+  switch (header->type) {
+  case NXT_MSG_DRIVE:
+    if (length >= (ssize_t) sizeof(struct nxt_drive)) {
+      handle_drive(s, (const struct nxt_drive *) buf, from);
+    }
+    break;
+  case NXT_MSG_STOP:
+    if (length >= (ssize_t) sizeof(struct nxt_stop)) {
+      s->backend->stop(s->backend, ((const struct nxt_stop *) buf)->mode & 3);
+      s->driving = 0;
+    }
+    break;
+  case NXT_MSG_SUBSCRIBE:
+    if (length >= (ssize_t) sizeof(struct nxt_subscribe)) {
+      handle_subscribe(s, (const struct nxt_subscribe *) buf, from);
+    }
+    break;
+  }
+}
+
+static void receive(struct server *s) {
+  uint8_t buf[NXT_PROTO_MTU];
+  struct sockaddr_in from;
+  socklen_t from_length;
+  ssize_t length;
+
+  for (;;) {
+    from_length = sizeof(from);
+    length = recvfrom(s->sock, buf, sizeof(buf), 0, (struct sockaddr *) &from, &from_length);
+    if (length < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("recvfrom");
+      }
+      return;
+    }
+
+    handle_datagram(s, buf, length, &from);
+  }
+}
+
+/***********************************************************************
+ *
+ * Setup and main loop
+ *
+ ***********************************************************************/
+static int socket_setup(int port) {
+  struct sockaddr_in addr;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int epoll_add(int epfd, int fd, enum source source) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = source;
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void on_signal(int sig) {
+  terminated = 1;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-w watchdog_ms] [-s] [sensor device...]\n"
+          "  -p  UDP port (default %d)\n"
+          "  -w  stop when no drive command arrived for this long, 0 never (default 500 ms)\n"
+          "  -s  simulate the robot, without the motor driver\n"
+          "  the sensor devices (e.g. /dev/light2) are sampled into the telemetry, at most %d\n",
+          name, NXT_PROTO_PORT, BACKEND_SENSORS);
+}
+
+int main(int argc, char **argv) {
+  struct epoll_event events[MAX_EVENTS];
+  struct sigaction action;
+  struct server s;
+  uint64_t expirations;
+  int port = NXT_PROTO_PORT;
+  int simulate = 0;
+  int res = EXIT_FAILURE;
+  int epfd = -1;
+  int n;
+  int i;
+  int opt;
+
+  memset(&s, 0, sizeof(s));
+  s.sock = -1;
+  s.timer = -1;
+  s.watchdog_ms = 500;
+  batch_reset(&s);
+
+  while ((opt = getopt(argc, argv, "p:w:sh")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'w':
+      s.watchdog_ms = atoi(optarg);
+      break;
+    case 's':
+      simulate = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (simulate) {
+    s.backend = backend_sim_open(argc - optind);
+  } else {
+    s.backend = backend_robot_open((const char *const *) argv + optind, argc - optind);
+  }
+  if (!s.backend) {
+    fprintf(stderr, "Cannot open the %s\n", (simulate ? "simulation" : "motor driver"));
+    return EXIT_FAILURE;
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  s.sock = socket_setup(port);
+  if (s.sock < 0)
+    goto out;
+
+  s.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (s.timer < 0) {
+    perror("timerfd_create");
+    goto out;
+  }
+  if (timer_set(&s) < 0)
+    goto out;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    goto out;
+  }
+  if (epoll_add(epfd, s.sock, SOURCE_SOCKET) < 0 || epoll_add(epfd, s.timer, SOURCE_TIMER) < 0)
+    goto out;
+
+  while (!terminated) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      goto out;
+    }
+
+    for (i = 0; i < n; ++i) {
+      switch (events[i].data.u32) {
+      case SOURCE_SOCKET:
+        receive(&s);
+        break;
+      case SOURCE_TIMER:
+        if (read(s.timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+          tick(&s);
+        }
+        break;
+      }
+    }
+  }
+
+  res = EXIT_SUCCESS;
+
+ out:
+  s.backend->stop(s.backend, NXT_STOP_DEFAULT);
+  s.backend->close(s.backend);
+  if (epfd >= 0)
+    close(epfd);
+  if (s.timer >= 0)
+    close(s.timer);
+  if (s.sock >= 0)
+    close(s.sock);
+
+  return res;
+}
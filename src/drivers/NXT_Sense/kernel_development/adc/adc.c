@@ -33,6 +33,12 @@
 #define SPI_DEVICE_IS_NULL -1
 #define SPI_MASTER_IS_NULL -2
 #define SPI_BUFF_SIZE 4
+/* Bursts of samples from one channel, see adc_sample_channel_burst() */
+#define ADC_BURST_MAX 256
+#define SPI_BURST_BUFF_SIZE (2 * (ADC_BURST_MAX + 1))
+#define SPI_CLOCKS_PER_SAMPLE 16
+/* Scans of several channels, see adc_sample_channels() */
+#define ADC_SCAN_MAX 8
 
 /***********************************************************************
  *
@@ -73,6 +79,8 @@ struct spi_control {
   struct spi_transfer transfer;
   u8 *tx_buff; 
   u8 *rx_buff;
+  u8 *burst_tx_buff;
+  u8 *burst_rx_buff;
 };
 
 struct adc_info {
@@ -89,9 +97,8 @@ static struct adc_info adc_info[NO_ADC_CHANNELS];
  * the SPI subsystem
  *
  ***********************************************************************/
-static void spi_prepare_message(int channel) {
+static u8 adc_channel_address(int channel) {
   u8 adc_channel;
-  spi_message_init(&spi_ctl.msg);
 
   switch(channel) {
   case 0:
@@ -123,7 +130,13 @@ static void spi_prepare_message(int channel) {
     /* signal some sort of error? */
   }
 
-  spi_ctl.tx_buff[0] = adc_channel;
+  return adc_channel;
+}
+
+static void spi_prepare_message(int channel) {
+  spi_message_init(&spi_ctl.msg);
+
+  spi_ctl.tx_buff[0] = adc_channel_address(channel);
   spi_ctl.tx_buff[1] = 0x00;
 
   /* Not doing message merging for now */
@@ -132,6 +145,7 @@ static void spi_prepare_message(int channel) {
 	
   memset(spi_ctl.rx_buff, 0, SPI_BUFF_SIZE);
   
+  memset(&spi_ctl.transfer, 0, sizeof(spi_ctl.transfer));
   spi_ctl.transfer.tx_buf = spi_ctl.tx_buff;
   spi_ctl.transfer.rx_buf = spi_ctl.rx_buff;
   spi_ctl.transfer.len = SPI_BUFF_SIZE;
@@ -139,6 +153,52 @@ static void spi_prepare_message(int channel) {
   spi_message_add_tail(&spi_ctl.transfer, &spi_ctl.msg);
 }
 
+/* Every 16 bit frame selects the channel converted during the next frame, so count samples take count + 1 frames merged into one transfer.
+ * The transfer is clocked at SPI_CLOCKS_PER_SAMPLE times the sample rate, which the McSPI rounds down to the next divider of its clock.
+ */
+static void spi_prepare_burst_message(int channel, int count, unsigned int rate) {
+  int i;
+  u8 adc_channel = adc_channel_address(channel);
+
+  spi_message_init(&spi_ctl.msg);
+
+  for (i = 0; i <= count; ++i) {
+    spi_ctl.burst_tx_buff[2 * i] = adc_channel;
+    spi_ctl.burst_tx_buff[2 * i + 1] = 0x00;
+  }
+
+  memset(spi_ctl.burst_rx_buff, 0, SPI_BURST_BUFF_SIZE);
+
+  memset(&spi_ctl.transfer, 0, sizeof(spi_ctl.transfer));
+  spi_ctl.transfer.tx_buf = spi_ctl.burst_tx_buff;
+  spi_ctl.transfer.rx_buf = spi_ctl.burst_rx_buff;
+  spi_ctl.transfer.len = 2 * (count + 1);
+  spi_ctl.transfer.speed_hz = min(rate * SPI_CLOCKS_PER_SAMPLE, (unsigned int) SPI_BUS_SPEED);
+
+  spi_message_add_tail(&spi_ctl.transfer, &spi_ctl.msg);
+}
+
+/* As a burst, but every frame selects the next channel of the scan, at the full bus speed */
+static void spi_prepare_scan_message(const int *channels, int count) {
+  int i;
+
+  spi_message_init(&spi_ctl.msg);
+
+  for (i = 0; i <= count; ++i) {
+    spi_ctl.burst_tx_buff[2 * i] = adc_channel_address(channels[min(i, count - 1)]);
+    spi_ctl.burst_tx_buff[2 * i + 1] = 0x00;
+  }
+
+  memset(spi_ctl.burst_rx_buff, 0, SPI_BURST_BUFF_SIZE);
+
+  memset(&spi_ctl.transfer, 0, sizeof(spi_ctl.transfer));
+  spi_ctl.transfer.tx_buf = spi_ctl.burst_tx_buff;
+  spi_ctl.transfer.rx_buf = spi_ctl.burst_rx_buff;
+  spi_ctl.transfer.len = 2 * (count + 1);
+
+  spi_message_add_tail(&spi_ctl.transfer, &spi_ctl.msg);
+}
+
 /* Returns zero on success, else a negative error code */
 static int spi_do_message(int channel) {
   int status;
@@ -184,6 +244,72 @@ static int adc_sample_channel(int channel, int *data) {
 }
 EXPORT_SYMBOL(adc_sample_channel);
 
+/* Takes count (at most ADC_BURST_MAX) samples from one channel at about the given rate in one SPI transfer, for the clients needing more samples than one adc_sample_channel() call each can give.
+ * Returns zero on success, else a negative error code
+ */
+int adc_sample_channel_burst(int channel, int *data, int count, unsigned int rate) {
+  int status;
+  int i;
+
+  if (count <= 0 || count > ADC_BURST_MAX || rate == 0) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&adc_mutex);
+
+  if (!adc_dev.spi_device) {
+    status = SPI_DEVICE_IS_NULL;
+  } else if (!adc_dev.spi_device->master) {
+    status = SPI_MASTER_IS_NULL;
+  } else {
+    spi_prepare_burst_message(channel, count, rate);
+    status = spi_sync(adc_dev.spi_device, &spi_ctl.msg);
+
+    /* The first frame only selects the channel */
+    for (i = 0; i < count; ++i) {
+      data[i] = (spi_ctl.burst_rx_buff[2 * (i + 1)] << 8) | spi_ctl.burst_rx_buff[2 * (i + 1) + 1];
+    }
+  }
+
+  mutex_unlock(&adc_mutex);
+
+  return status;
+}
+EXPORT_SYMBOL(adc_sample_channel_burst);
+
+/* Samples count (at most ADC_SCAN_MAX) channels in one SPI transfer, the samples being taken microseconds apart, for the clients needing a coherent snapshot of several channels.
+ * Returns zero on success, else a negative error code
+ */
+int adc_sample_channels(const int *channels, int *data, int count) {
+  int status;
+  int i;
+
+  if (count <= 0 || count > ADC_SCAN_MAX) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&adc_mutex);
+
+  if (!adc_dev.spi_device) {
+    status = SPI_DEVICE_IS_NULL;
+  } else if (!adc_dev.spi_device->master) {
+    status = SPI_MASTER_IS_NULL;
+  } else {
+    spi_prepare_scan_message(channels, count);
+    status = spi_sync(adc_dev.spi_device, &spi_ctl.msg);
+
+    /* The first frame only selects the first channel */
+    for (i = 0; i < count; ++i) {
+      data[i] = (spi_ctl.burst_rx_buff[2 * (i + 1)] << 8) | spi_ctl.burst_rx_buff[2 * (i + 1) + 1];
+    }
+  }
+
+  mutex_unlock(&adc_mutex);
+
+  return status;
+}
+EXPORT_SYMBOL(adc_sample_channels);
+
 /***********************************************************************
  *
  * File operations for the /dev/adc# files
@@ -345,6 +471,18 @@ static int __init init_spi(void) {
     goto init_error;
   }
 
+  spi_ctl.burst_tx_buff = kzalloc(SPI_BURST_BUFF_SIZE, GFP_KERNEL | GFP_DMA);
+  if (!spi_ctl.burst_tx_buff) {
+    error = -ENOMEM;
+    goto init_error;
+  }
+
+  spi_ctl.burst_rx_buff = kzalloc(SPI_BURST_BUFF_SIZE, GFP_KERNEL | GFP_DMA);
+  if (!spi_ctl.burst_rx_buff) {
+    error = -ENOMEM;
+    goto init_error;
+  }
+
   error = spi_register_driver(&spi_driver);
   if (error < 0) {
     printk(KERN_CRIT DEVICE_NAME ": spi_register_driver() failed %d\n", error);
@@ -372,6 +510,16 @@ static int __init init_spi(void) {
     spi_ctl.rx_buff = 0;
   }
 
+  if (spi_ctl.burst_tx_buff) {
+    kfree(spi_ctl.burst_tx_buff);
+    spi_ctl.burst_tx_buff = 0;
+  }
+
+  if (spi_ctl.burst_rx_buff) {
+    kfree(spi_ctl.burst_rx_buff);
+    spi_ctl.burst_rx_buff = 0;
+  }
+
   return error;
 }
 
@@ -519,6 +667,12 @@ static void __exit adc_exit(void) {
   if (spi_ctl.rx_buff)
     kfree(spi_ctl.rx_buff);
 
+  if (spi_ctl.burst_tx_buff)
+    kfree(spi_ctl.burst_tx_buff);
+
+  if (spi_ctl.burst_rx_buff)
+    kfree(spi_ctl.burst_rx_buff);
+
   /* Release spi level shifter pins */
   unregister_use_of_level_shifter(LS_U3_1);
   unregister_use_of_level_shifter(LS_U3_2);
@@ -2,5 +2,9 @@
 #define __H_adc_h_
 
 extern int adc_sample_channel(int, int*);
+/* Samples from one channel in a single SPI transfer: channel, data, count (at most 256) and sample rate in Hz */
+extern int adc_sample_channel_burst(int, int*, int, unsigned int);
+/* Samples several channels in a single SPI transfer: channels, data and count (at most 8) */
+extern int adc_sample_channels(const int*, int*, int);
 
 #endif
@@ -0,0 +1,416 @@
+/* Notes:
+ * - Runs the registered control callbacks at a fixed period: an hrtimer ticks every period_us and wakes a SCHED_FIFO thread, which takes a snapshot of the ADC channels, runs compute of every callback and then commit of every callback (applying the motor and LED outputs).
+ * - The ADC is on the SPI bus and sampling sleeps, so the callbacks cannot run in the timer interrupt itself. The latency from the tick being due to the thread running is the jitter of the loop.
+ * - A tick arriving while the previous one is still running is skipped and counted as an overrun, as are the ticks the timer itself missed.
+ * - The timer only runs while callbacks are registered.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/math64.h>
+#include <linux/stat.h>
+
+#include "../adc/adc.h"
+#include "control_loop.h"
+
+#define DEVICE_NAME "control_loop"
+
+#define CONTROL_LOOP_MIN_PERIOD_US 500
+#define CONTROL_LOOP_MAX_PERIOD_US 1000000
+
+struct control_loop_stats {
+  unsigned long long cycles;
+  unsigned long overruns;
+  s64 latency_min; /* ns from the tick being due to the cycle starting */
+  s64 latency_max;
+  s64 latency_sum;
+  s64 runtime_max; /* ns the cycle took */
+  s64 runtime_sum;
+};
+
+struct control_loop_dev {
+  struct class *class;
+  struct device *device;
+  struct hrtimer timer;
+  struct task_struct *thread;
+  wait_queue_head_t wait;
+  spinlock_t lock; /* Guards the tick state, the period and the stats, shared with the timer */
+  ktime_t period;
+  bool pending; /* A tick is due and the thread has not taken it yet */
+  bool busy; /* The thread is running a cycle */
+  ktime_t due;
+  unsigned long long tick;
+  struct control_loop_stats stats;
+  struct list_head callbacks; /* Guarded by the control_loop_mutex */
+};
+
+static struct control_loop_dev control_loop_dev;
+
+/* Held while a cycle runs the callbacks, so a callback is not running once control_loop_unregister() returns */
+DEFINE_MUTEX(control_loop_mutex);
+
+static unsigned int period_us = 10000;
+module_param(period_us, uint, S_IRUGO);
+MODULE_PARM_DESC(period_us, "Period of the control loop in microseconds when loading the module, see the period_us attribute");
+
+static int rt_priority = 80;
+module_param(rt_priority, int, S_IRUGO);
+MODULE_PARM_DESC(rt_priority, "SCHED_FIFO priority of the control loop thread");
+
+/***********************************************************************
+ *
+ * The timer and the thread running the cycles
+ *
+ ***********************************************************************/
+static enum hrtimer_restart control_loop_tick(struct hrtimer *timer) {
+  u64 missed;
+  unsigned long flags;
+
+  spin_lock_irqsave(&control_loop_dev.lock, flags);
+
+  missed = hrtimer_forward_now(timer, control_loop_dev.period);
+  control_loop_dev.stats.overruns += missed - 1;
+
+  if (control_loop_dev.pending || control_loop_dev.busy) {
+    ++control_loop_dev.stats.overruns;
+  } else {
+    control_loop_dev.pending = true;
+    control_loop_dev.due = ktime_sub(hrtimer_get_expires(timer), control_loop_dev.period);
+  }
+
+  spin_unlock_irqrestore(&control_loop_dev.lock, flags);
+
+  wake_up(&control_loop_dev.wait);
+
+  return HRTIMER_RESTART;
+}
+
+/* Requires the control_loop_mutex */
+static void control_loop_sample(struct control_loop_snapshot *snapshot) {
+  struct control_loop_ops *ops;
+  int channels[CONTROL_LOOP_ADC_CHANNELS];
+  int values[CONTROL_LOOP_ADC_CHANNELS];
+  int count = 0;
+  int i;
+
+  snapshot->adc_mask = 0;
+  list_for_each_entry(ops, &control_loop_dev.callbacks, list) {
+    snapshot->adc_mask |= ops->adc_mask;
+  }
+
+  for (i = 0; i < CONTROL_LOOP_ADC_CHANNELS; ++i) {
+    if (snapshot->adc_mask & (1 << i)) {
+      channels[count++] = i;
+    }
+  }
+
+  snapshot->adc_status = 0;
+  if (count == 0) {
+    return;
+  }
+
+  snapshot->adc_status = adc_sample_channels(channels, values, count);
+  if (snapshot->adc_status != 0) {
+    return;
+  }
+
+  for (i = 0; i < count; ++i) {
+    snapshot->adc[channels[i]] = values[i];
+  }
+}
+
+static void control_loop_cycle(unsigned long long tick, ktime_t due) {
+  struct control_loop_snapshot snapshot;
+  struct control_loop_ops *ops;
+
+  memset(&snapshot, 0, sizeof(snapshot));
+  snapshot.tick = tick;
+  snapshot.time = due;
+  snapshot.period_us = (unsigned int) ktime_to_us(control_loop_dev.period);
+
+  mutex_lock(&control_loop_mutex);
+
+  control_loop_sample(&snapshot);
+
+  list_for_each_entry(ops, &control_loop_dev.callbacks, list) {
+    ops->compute(&snapshot, ops->data);
+  }
+
+  list_for_each_entry(ops, &control_loop_dev.callbacks, list) {
+    if (ops->commit) {
+      ops->commit(ops->data);
+    }
+  }
+
+  mutex_unlock(&control_loop_mutex);
+}
+
+static int control_loop_thread(void *data) {
+  struct sched_param param = { .sched_priority = rt_priority };
+  struct control_loop_stats *stats = &control_loop_dev.stats;
+  unsigned long long tick;
+  unsigned long flags;
+  ktime_t due;
+  ktime_t start;
+  s64 latency;
+  s64 runtime;
+
+  if (sched_setscheduler(current, SCHED_FIFO, &param) != 0) {
+    printk(KERN_WARNING DEVICE_NAME ": could not make the thread SCHED_FIFO, the loop runs with the normal priority\n");
+  }
+
+  while (!kthread_should_stop()) {
+    wait_event_interruptible(control_loop_dev.wait, control_loop_dev.pending || kthread_should_stop());
+
+    spin_lock_irqsave(&control_loop_dev.lock, flags);
+    if (!control_loop_dev.pending) {
+      spin_unlock_irqrestore(&control_loop_dev.lock, flags);
+      continue;
+    }
+    control_loop_dev.pending = false;
+    control_loop_dev.busy = true;
+    due = control_loop_dev.due;
+    tick = ++control_loop_dev.tick;
+    spin_unlock_irqrestore(&control_loop_dev.lock, flags);
+
+    start = ktime_get();
+    control_loop_cycle(tick, due);
+    runtime = ktime_to_ns(ktime_sub(ktime_get(), start));
+    latency = ktime_to_ns(ktime_sub(start, due));
+
+    spin_lock_irqsave(&control_loop_dev.lock, flags);
+    if (stats->cycles == 0 || latency < stats->latency_min) {
+      stats->latency_min = latency;
+    }
+    stats->latency_max = max(stats->latency_max, latency);
+    stats->latency_sum += latency;
+    stats->runtime_max = max(stats->runtime_max, runtime);
+    stats->runtime_sum += runtime;
+    ++stats->cycles;
+    control_loop_dev.busy = false;
+    spin_unlock_irqrestore(&control_loop_dev.lock, flags);
+  }
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * Registration of the control callbacks
+ *
+ ***********************************************************************/
+int control_loop_register(struct control_loop_ops *ops) {
+  if (!ops || !ops->compute || (ops->adc_mask & ~((1 << CONTROL_LOOP_ADC_CHANNELS) - 1))) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&control_loop_mutex);
+
+  list_add_tail(&ops->list, &control_loop_dev.callbacks);
+  if (list_is_singular(&control_loop_dev.callbacks)) {
+    hrtimer_start(&control_loop_dev.timer, control_loop_dev.period, HRTIMER_MODE_REL);
+  }
+
+  mutex_unlock(&control_loop_mutex);
+
+  printk(KERN_DEBUG DEVICE_NAME ": registered %s\n", ops->name);
+
+  return 0;
+}
+EXPORT_SYMBOL(control_loop_register);
+
+void control_loop_unregister(struct control_loop_ops *ops) {
+  mutex_lock(&control_loop_mutex);
+
+  list_del(&ops->list);
+  if (list_empty(&control_loop_dev.callbacks)) {
+    hrtimer_cancel(&control_loop_dev.timer);
+  }
+
+  mutex_unlock(&control_loop_mutex);
+
+  printk(KERN_DEBUG DEVICE_NAME ": unregistered %s\n", ops->name);
+}
+EXPORT_SYMBOL(control_loop_unregister);
+
+/***********************************************************************
+ *
+ * Sysfs entries for the period, the statistics and the callbacks
+ *
+ ***********************************************************************/
+static ssize_t period_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  return scnprintf(buf, PAGE_SIZE, "%lld\n", ktime_to_us(control_loop_dev.period));
+}
+
+/* The new period applies from the next tick on */
+static ssize_t period_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  unsigned int new_period;
+  unsigned long flags;
+
+  if (sscanf(buf, "%u", &new_period) != 1 || new_period < CONTROL_LOOP_MIN_PERIOD_US || new_period > CONTROL_LOOP_MAX_PERIOD_US) {
+    printk(KERN_WARNING DEVICE_NAME ": the period is %d to %d us\n", CONTROL_LOOP_MIN_PERIOD_US, CONTROL_LOOP_MAX_PERIOD_US);
+    return -EINVAL;
+  }
+
+  spin_lock_irqsave(&control_loop_dev.lock, flags);
+  control_loop_dev.period = ns_to_ktime((u64) new_period * NSEC_PER_USEC);
+  spin_unlock_irqrestore(&control_loop_dev.lock, flags);
+
+  return count;
+}
+
+/* "<cycles> <overruns> <latency min> <latency mean> <latency max> <runtime mean> <runtime max>", the times in microseconds */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct control_loop_stats stats;
+  unsigned long flags;
+  s64 latency_mean = 0;
+  s64 runtime_mean = 0;
+
+  spin_lock_irqsave(&control_loop_dev.lock, flags);
+  stats = control_loop_dev.stats;
+  spin_unlock_irqrestore(&control_loop_dev.lock, flags);
+
+  if (stats.cycles > 0) {
+    latency_mean = div64_s64(stats.latency_sum, stats.cycles);
+    runtime_mean = div64_s64(stats.runtime_sum, stats.cycles);
+  }
+
+  return scnprintf(buf, PAGE_SIZE, "%llu %lu %lld %lld %lld %lld %lld\n", stats.cycles, stats.overruns,
+                   div_s64(stats.latency_min, NSEC_PER_USEC), div_s64(latency_mean, NSEC_PER_USEC), div_s64(stats.latency_max, NSEC_PER_USEC),
+                   div_s64(runtime_mean, NSEC_PER_USEC), div_s64(stats.runtime_max, NSEC_PER_USEC));
+}
+
+/* Any write starts the statistics over */
+static ssize_t stats_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&control_loop_dev.lock, flags);
+  memset(&control_loop_dev.stats, 0, sizeof(control_loop_dev.stats));
+  spin_unlock_irqrestore(&control_loop_dev.lock, flags);
+
+  return count;
+}
+
+static ssize_t callbacks_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct control_loop_ops *ops;
+  ssize_t len = 0;
+
+  mutex_lock(&control_loop_mutex);
+  list_for_each_entry(ops, &control_loop_dev.callbacks, list) {
+    len += scnprintf(buf + len, PAGE_SIZE - len, "%s\n", ops->name);
+  }
+  mutex_unlock(&control_loop_mutex);
+
+  return len;
+}
+
+DEVICE_ATTR(period_us, (S_IRUGO | S_IWUSR), period_us_show, period_us_store);
+DEVICE_ATTR(stats, (S_IRUGO | S_IWUSR), stats_show, stats_store);
+DEVICE_ATTR(callbacks, S_IRUGO, callbacks_show, NULL);
+
+/***********************************************************************
+ *
+ * Module initialisation and uninitialisation
+ *
+ ***********************************************************************/
+static int __init control_loop_init_class(void) {
+  control_loop_dev.class = class_create(THIS_MODULE, DEVICE_NAME);
+
+  if (IS_ERR(control_loop_dev.class)) {
+    printk(KERN_CRIT DEVICE_NAME ": class_create() failed: %ld\n", PTR_ERR(control_loop_dev.class));
+    return -1;
+  }
+
+  /* Only a sysfs entry, the loop has no device file */
+  control_loop_dev.device = device_create(control_loop_dev.class, NULL, MKDEV(0, 0), NULL, DEVICE_NAME);
+  if (IS_ERR(control_loop_dev.device)) {
+    printk(KERN_CRIT DEVICE_NAME ": device_create() failed: %ld\n", PTR_ERR(control_loop_dev.device));
+    goto init_class_fail_1;
+  }
+
+  if (device_create_file(control_loop_dev.device, &dev_attr_period_us)) {
+    goto init_class_fail_2;
+  }
+
+  if (device_create_file(control_loop_dev.device, &dev_attr_stats)) {
+    goto init_class_fail_3;
+  }
+
+  if (device_create_file(control_loop_dev.device, &dev_attr_callbacks)) {
+    goto init_class_fail_4;
+  }
+
+  return 0;
+
+ init_class_fail_4:
+  device_remove_file(control_loop_dev.device, &dev_attr_stats);
+
+ init_class_fail_3:
+  device_remove_file(control_loop_dev.device, &dev_attr_period_us);
+
+ init_class_fail_2:
+  printk(KERN_CRIT DEVICE_NAME ": device_create_file() failed\n");
+  device_destroy(control_loop_dev.class, MKDEV(0, 0));
+
+ init_class_fail_1:
+  class_destroy(control_loop_dev.class);
+  return -1;
+}
+
+static void control_loop_destroy_class(void) {
+  device_remove_file(control_loop_dev.device, &dev_attr_callbacks);
+  device_remove_file(control_loop_dev.device, &dev_attr_stats);
+  device_remove_file(control_loop_dev.device, &dev_attr_period_us);
+  device_destroy(control_loop_dev.class, MKDEV(0, 0));
+  class_destroy(control_loop_dev.class);
+}
+
+static int __init control_loop_init(void) {
+  memset(&control_loop_dev, 0, sizeof(control_loop_dev));
+  spin_lock_init(&control_loop_dev.lock);
+  init_waitqueue_head(&control_loop_dev.wait);
+  INIT_LIST_HEAD(&control_loop_dev.callbacks);
+
+  period_us = clamp_t(unsigned int, period_us, CONTROL_LOOP_MIN_PERIOD_US, CONTROL_LOOP_MAX_PERIOD_US);
+  control_loop_dev.period = ns_to_ktime((u64) period_us * NSEC_PER_USEC);
+
+  hrtimer_init(&control_loop_dev.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  control_loop_dev.timer.function = control_loop_tick;
+
+  if (control_loop_init_class() < 0)
+    goto fail_1;
+
+  control_loop_dev.thread = kthread_run(control_loop_thread, NULL, DEVICE_NAME);
+  if (IS_ERR(control_loop_dev.thread)) {
+    printk(KERN_CRIT DEVICE_NAME ": could not start the thread: %ld\n", PTR_ERR(control_loop_dev.thread));
+    goto fail_2;
+  }
+
+  return 0;
+
+ fail_2:
+  control_loop_destroy_class();
+
+ fail_1:
+  return -1;
+}
+module_init(control_loop_init);
+
+/* The users of the loop depend on this module, so no callbacks are left registered */
+static void __exit control_loop_exit(void) {
+  hrtimer_cancel(&control_loop_dev.timer);
+  kthread_stop(control_loop_dev.thread);
+  control_loop_destroy_class();
+}
+module_exit(control_loop_exit);
+
+MODULE_LICENSE("GPL");
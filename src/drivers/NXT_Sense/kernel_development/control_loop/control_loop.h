@@ -0,0 +1,35 @@
+#ifndef __H_control_loop_h_
+#define __H_control_loop_h_
+
+/* ADC channels of the snapshot: the four NXT sensor ports and the battery voltage */
+#define CONTROL_LOOP_ADC_CHANNELS 5
+#define CONTROL_LOOP_ADC_BATTERY 4
+
+/* The sensor readings of one tick, all channels sampled in one ADC transfer.
+ * Only the ADC values: the digital sensors of nxt_sense (e.g. the ultrasonic sensor) take milliseconds on their I2C bus, so a callback reads their cached values itself.
+ */
+struct control_loop_snapshot {
+  unsigned long long tick;
+  ktime_t time; /* When the tick was due */
+  unsigned int period_us;
+  unsigned int adc_mask; /* The channels sampled, the union of the adc_mask of the callbacks */
+  int adc_status; /* Zero when the adc values are valid */
+  int adc[CONTROL_LOOP_ADC_CHANNELS];
+};
+
+/* A control callback run by the loop every tick. Within a tick compute is called for every callback, then commit applies the outputs of every callback, so all outputs change together.
+ * Both run in the SCHED_FIFO thread of the loop and may sleep, but every microsecond they take counts against the period. commit may be NULL.
+ */
+struct control_loop_ops {
+  const char *name;
+  unsigned int adc_mask; /* Bit n samples ADC channel n into the snapshot */
+  void (*compute)(const struct control_loop_snapshot *, void *);
+  void (*commit)(void *);
+  void *data;
+  struct list_head list;
+};
+
+extern int control_loop_register(struct control_loop_ops *);
+extern void control_loop_unregister(struct control_loop_ops *);
+
+#endif
@@ -21,8 +21,10 @@
 /* The level shifter is referenced to as U3 on the gumstixnxt schematic */
 #define GPIO_U3_1OE 10
 #define GPIO_U3_2OE 71
+/* The motor level shifter, its direction is fixed as output in hardware */
+#define GPIO_MOTOR_OE 92
 /* There is a dependency between the number of level shifters and the enum defined in level_shifter.h */
-#define NUMBER_OF_LEVEL_SHIFTERS 2
+#define NUMBER_OF_LEVEL_SHIFTERS 3
 
 DEFINE_MUTEX(ls_mutex);
 
@@ -140,6 +142,10 @@ static int __init level_shifter_init(void) {
   level_shifter[1].activated = false;
   strlcpy(level_shifter[1].label, "LS_U3_2OE", LS_LABEL_SIZE);
 
+  level_shifter[2].gpio_pin = GPIO_MOTOR_OE;
+  level_shifter[2].activated = false;
+  strlcpy(level_shifter[2].label, "LS_MOT_OE", LS_LABEL_SIZE);
+
   /* Leaving the kref / refcount objects uninitialised due to a workaround when using kref for bookkeeping and not actual object reference counting */
 
   return 0;
@@ -0,0 +1,38 @@
+#ifndef __H_motor_h_
+#define __H_motor_h_
+
+#include "motor_ioctl.h"
+
+#define NUMBER_OF_MOTORS 3
+
+/* For other modules, e.g. motor controllers: motor number and speed, see motor_ioctl.h. Return zero on success, else a negative error code. May be called from atomic context */
+extern int motor_set_speed(int, int);
+extern int motor_get_speed(int, int *);
+/* A consistent copy of the tachometer state of the motor, without locking. May be called from atomic context */
+extern int motor_get_tacho(int, struct motor_tacho_state *);
+/* The velocity estimated from the tachometer edges. May be called from atomic context */
+extern int motor_get_velocity(int, struct motor_velocity *);
+/* The closed-loop controllers, run by control_loop. May be called from atomic context, e.g. from another control_loop callback */
+extern int motor_set_control(int, int, s64);
+extern int motor_set_gains(int, const struct motor_pid_gains *);
+extern int motor_get_pid(int, struct motor_pid_status *);
+/* Stops the motor with a stop mode, see motor_ioctl.h. May be called from atomic context */
+extern int motor_stop(int, int);
+
+/* The highest speed the motor may run at, MOTOR_SPEED_MAX without a limit. May be called from atomic context */
+extern int motor_set_limit(int, int);
+
+/* The motion profiles. May be called from atomic context */
+extern int motor_queue_segment(int, const struct motor_segment *);
+extern int motor_flush(int);
+extern int motor_command(int, const struct motor_command *);
+
+/* The drive pair, applied at the next control_loop tick. May be called from atomic context */
+extern int motor_drive(const struct motor_drive *);
+extern void motor_get_drive(struct motor_drive_status *);
+extern int motor_drive_stop(int);
+/* The odometry of the drive pair */
+extern void motor_set_pose(const struct motor_pose *);
+extern void motor_get_pose(struct motor_pose *);
+
+#endif
@@ -0,0 +1,837 @@
+/* Notes:
+ * - Every motor has a PHASE signal (direction, 0 is forward) and an ENABLE signal, ENABLE being active low through the motor level shifter (0 runs the motor).
+ * - The speed is the duty cycle of a PWM signal on ENABLE. With hw_pwm=1 the PWM is generated by the OMAP GP timer whose PWM output shares the pin with the ENABLE GPIO (GPT9, GPT11 and GPT10), which requires u-boot to mux the pins to the timers (mode 2). Otherwise, or if the timer cannot be had, an hrtimer toggles the ENABLE GPIO.
+ * - 0 and full speed are steady levels, without any timer running.
+ * - With nxt_sense loaded first, motor registers the reflex action "motor <motor> <stop mode>", stopping the motor from a sensor condition. nxt_sense is only bound through symbol_get(), so motor also works without it. The gpio action of nxt_sense cannot drive the motor pins, as they are requested by motor.
+ * - The tachometers are decoded in motor_tacho.c, the closed-loop controllers are in motor_pid.c, the motion profiles are in motor_profile.c, the stall protection is in motor_stall.c and the drive pair (/dev/motor_drive, the minor after the motors) is in motor_drive.c.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/clk.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/stat.h>
+#include <linux/kref.h>
+#include <asm/uaccess.h>
+#include <mach/gpio.h>
+#include <plat/dmtimer.h>
+
+#include "../level_shifter/level_shifter.h"
+#include "motor.h"
+#include "motor_tacho.h"
+#include "motor_pid.h"
+#include "motor_profile.h"
+#include "motor_stall.h"
+#include "motor_drive.h"
+#include "../nxt_sense/nxt_sense_core.h"
+
+#define DEVICE_NAME "motor"
+
+/* GPIO pins */
+#define GPIO_PHASE_1 91
+#define GPIO_PHASE_2 83
+#define GPIO_PHASE_3 147
+#define GPIO_ENABLE_1 144
+#define GPIO_ENABLE_2 146
+#define GPIO_ENABLE_3 145
+
+/* The motors and /dev/motor_drive */
+#define NUMBER_OF_MINORS (NUMBER_OF_MOTORS + 1)
+
+#define PHASE_FORWARD 0
+#define PHASE_BACKWARD 1
+#define ENABLE_ON 0
+#define ENABLE_OFF 1
+
+/* Board data: the pins of the motor ports and the GP timer driving the PWM output on the ENABLE pin */
+struct motor_desc {
+  int phase_gpio;
+  int enable_gpio;
+  int pwm_timer_id;
+};
+
+static const struct motor_desc motor_board[NUMBER_OF_MOTORS] = {
+  {GPIO_PHASE_1, GPIO_ENABLE_1, 9},
+  {GPIO_PHASE_2, GPIO_ENABLE_2, 11},
+  {GPIO_PHASE_3, GPIO_ENABLE_3, 10},
+};
+
+struct motor {
+  int number;
+  struct cdev cdev;
+  struct device *device;
+  spinlock_t lock; /* Guards the speed and the PWM state, shared with the hrtimer */
+  int speed;
+  int limit; /* Of the absolute value of the speed, set by the stall protection */
+  unsigned int duty; /* Per mille, the absolute value of the speed */
+  bool on; /* The level of the software PWM */
+  bool pwm_running;
+  struct hrtimer timer; /* Software PWM */
+  struct omap_dm_timer *pwm_timer; /* Hardware PWM, NULL when using the software PWM */
+  u32 pwm_load;
+  u32 pwm_period; /* In timer ticks */
+};
+
+struct motor_dev {
+  dev_t devt;
+  struct class *class;
+  struct motor motor[NUMBER_OF_MOTORS];
+};
+
+static struct motor_dev motor_dev;
+
+static unsigned int pwm_frequency = 1000;
+module_param(pwm_frequency, uint, S_IRUGO);
+MODULE_PARM_DESC(pwm_frequency, "Frequency of the PWM signal in Hz");
+
+static bool hw_pwm = false;
+module_param(hw_pwm, bool, S_IRUGO);
+MODULE_PARM_DESC(hw_pwm, "Generate the PWM with the OMAP GP timers, requires the ENABLE pins to be muxed to the timers");
+
+/***********************************************************************
+ *
+ * Software PWM, toggling the ENABLE pin from an hrtimer
+ *
+ ***********************************************************************/
+static enum hrtimer_restart motor_pwm_tick(struct hrtimer *timer) {
+  struct motor *m = container_of(timer, struct motor, timer);
+  const struct motor_desc *desc = &motor_board[m->number];
+  unsigned long period_ns = NSEC_PER_SEC / pwm_frequency;
+  unsigned long flags;
+  unsigned long len;
+
+  spin_lock_irqsave(&m->lock, flags);
+
+  if (m->duty == 0 || m->duty >= MOTOR_SPEED_MAX) {
+    gpio_set_value(desc->enable_gpio, (m->duty == 0 ? ENABLE_OFF : ENABLE_ON));
+    m->pwm_running = false;
+    spin_unlock_irqrestore(&m->lock, flags);
+    return HRTIMER_NORESTART;
+  }
+
+  m->on = !m->on;
+  gpio_set_value(desc->enable_gpio, (m->on ? ENABLE_ON : ENABLE_OFF));
+  len = (m->on ? m->duty : MOTOR_SPEED_MAX - m->duty) * (period_ns / MOTOR_SPEED_MAX);
+
+  spin_unlock_irqrestore(&m->lock, flags);
+
+  /* From the expiry and not from now, so the latency of a tick does not add up */
+  hrtimer_forward(timer, hrtimer_get_expires(timer), ktime_set(0, len));
+
+  return HRTIMER_RESTART;
+}
+
+/* Requires the lock of the motor */
+static void motor_apply_soft_pwm(struct motor *m) {
+  const struct motor_desc *desc = &motor_board[m->number];
+
+  if (m->duty == 0 || m->duty >= MOTOR_SPEED_MAX) {
+    /* A running timer leaves the pin steady at its next tick */
+    if (!m->pwm_running) {
+      gpio_set_value(desc->enable_gpio, (m->duty == 0 ? ENABLE_OFF : ENABLE_ON));
+    }
+  } else if (!m->pwm_running) {
+    m->on = false;
+    m->pwm_running = true;
+    hrtimer_start(&m->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+  }
+}
+
+/***********************************************************************
+ *
+ * Hardware PWM from the OMAP GP timers. The timer counts up from the
+ * load value and toggles the output on overflow (to on) and on the
+ * match (to off), the output is off while the timer is stopped
+ *
+ ***********************************************************************/
+static int motor_init_hw_pwm(struct motor *m) {
+  unsigned long rate;
+
+  m->pwm_timer = omap_dm_timer_request_specific(motor_board[m->number].pwm_timer_id);
+  if (!m->pwm_timer) {
+    printk(KERN_WARNING DEVICE_NAME ": GP timer %d is taken, motor %d uses the software PWM\n", motor_board[m->number].pwm_timer_id, m->number);
+    return -1;
+  }
+
+  omap_dm_timer_set_source(m->pwm_timer, OMAP_TIMER_SRC_SYS_CLK);
+  rate = clk_get_rate(omap_dm_timer_get_fclk(m->pwm_timer));
+
+  m->pwm_period = rate / pwm_frequency;
+  m->pwm_load = 0xFFFFFFFF - m->pwm_period + 1;
+  omap_dm_timer_set_load(m->pwm_timer, 1, m->pwm_load);
+  omap_dm_timer_set_pwm(m->pwm_timer, ENABLE_OFF, 1, OMAP_TIMER_TRIGGER_OVERFLOW_AND_COMPARE);
+
+  return 0;
+}
+
+/* Requires the lock of the motor */
+static void motor_apply_hw_pwm(struct motor *m) {
+  omap_dm_timer_stop(m->pwm_timer);
+
+  if (m->duty == 0 || m->duty >= MOTOR_SPEED_MAX) {
+    /* The output takes the default level of the PWM while the timer is stopped */
+    omap_dm_timer_set_pwm(m->pwm_timer, (m->duty == 0 ? ENABLE_OFF : ENABLE_ON), 1, OMAP_TIMER_TRIGGER_OVERFLOW_AND_COMPARE);
+    return;
+  }
+
+  omap_dm_timer_set_pwm(m->pwm_timer, ENABLE_OFF, 1, OMAP_TIMER_TRIGGER_OVERFLOW_AND_COMPARE);
+  omap_dm_timer_set_match(m->pwm_timer, 1, m->pwm_load + (u32) (((u64) m->pwm_period * m->duty) / MOTOR_SPEED_MAX));
+  omap_dm_timer_write_counter(m->pwm_timer, 0xFFFFFFFE); /* Overflow right away, starting with the on phase */
+  omap_dm_timer_start(m->pwm_timer);
+}
+
+/***********************************************************************
+ *
+ * Hooks for setting the speed from other modules
+ *
+ ***********************************************************************/
+int motor_set_speed(int motor, int speed) {
+  struct motor *m;
+  unsigned long flags;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS || speed < -MOTOR_SPEED_MAX || speed > MOTOR_SPEED_MAX) {
+    return -EINVAL;
+  }
+
+  m = &motor_dev.motor[motor];
+
+  spin_lock_irqsave(&m->lock, flags);
+
+  m->speed = clamp(speed, -m->limit, m->limit);
+  m->duty = abs(m->speed);
+  gpio_set_value(motor_board[motor].phase_gpio, (speed < 0 ? PHASE_BACKWARD : PHASE_FORWARD));
+
+  if (m->pwm_timer) {
+    motor_apply_hw_pwm(m);
+  } else {
+    motor_apply_soft_pwm(m);
+  }
+
+  spin_unlock_irqrestore(&m->lock, flags);
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_set_speed);
+
+/* Applies at once, clamping the current speed */
+int motor_set_limit(int motor, int limit) {
+  struct motor *m;
+  unsigned long flags;
+  int speed;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS || limit < 0 || limit > MOTOR_SPEED_MAX) {
+    return -EINVAL;
+  }
+
+  m = &motor_dev.motor[motor];
+
+  spin_lock_irqsave(&m->lock, flags);
+  m->limit = limit;
+  speed = m->speed;
+  spin_unlock_irqrestore(&m->lock, flags);
+
+  return motor_set_speed(motor, speed);
+}
+EXPORT_SYMBOL(motor_set_limit);
+
+int motor_get_speed(int motor, int *speed) {
+  struct motor *m;
+  unsigned long flags;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS) {
+    return -EINVAL;
+  }
+
+  m = &motor_dev.motor[motor];
+
+  spin_lock_irqsave(&m->lock, flags);
+  *speed = m->speed;
+  spin_unlock_irqrestore(&m->lock, flags);
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_get_speed);
+
+/* A speed set by the user takes the motor from its controller, its profile and the drive pair */
+static int motor_user_set_speed(int motor, int speed) {
+  if (speed < -MOTOR_SPEED_MAX || speed > MOTOR_SPEED_MAX) {
+    return -EINVAL;
+  }
+
+  motor_drive_release(motor);
+  motor_profile_release(motor);
+  motor_set_control(motor, MOTOR_MODE_OPEN, 0);
+
+  return motor_set_speed(motor, speed);
+}
+
+/* Takes the motor from its profile and the drive pair */
+int motor_stop(int motor, int mode) {
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS) {
+    return -EINVAL;
+  }
+
+  motor_drive_release(motor);
+  motor_profile_release(motor);
+
+  return motor_pid_stop(motor, mode);
+}
+EXPORT_SYMBOL(motor_stop);
+
+/***********************************************************************
+ *
+ * The reflex action of nxt_sense stopping a motor: motor <motor>
+ * <stop mode>, e.g. "0 < 2048 1 motor 0 1" brakes motor 0 when the
+ * touch sensor on port 0 is pressed
+ *
+ ***********************************************************************/
+static int motor_action_check(const int *args) {
+  return (args[0] >= 0 && args[0] < NUMBER_OF_MOTORS && args[1] >= MOTOR_STOP_COAST && args[1] <= MOTOR_STOP_DEFAULT) ? 0 : -EINVAL;
+}
+
+/* Only takes spinlocks, as fired from the sampling path of nxt_sense */
+static void motor_action_fire(const int *args) {
+  motor_stop(args[0], args[1]);
+}
+
+static struct nxt_sense_reflex_action motor_action = {
+  .name = "motor",
+  .check = motor_action_check,
+  .fire = motor_action_fire,
+};
+
+/* NULL while the action is not registered */
+static void (*motor_action_unregister)(struct nxt_sense_reflex_action *);
+
+static void motor_register_action(void) {
+  int (*reg)(struct nxt_sense_reflex_action *);
+
+  reg = symbol_get(nxt_sense_register_reflex_action);
+  if (!reg) {
+    printk(KERN_INFO DEVICE_NAME ": nxt_sense is not loaded, the motor reflex action is not available\n");
+    return;
+  }
+
+  motor_action_unregister = symbol_get(nxt_sense_unregister_reflex_action);
+  if (!motor_action_unregister || reg(&motor_action) != 0) {
+    if (motor_action_unregister) {
+      symbol_put(nxt_sense_unregister_reflex_action);
+      motor_action_unregister = NULL;
+    }
+    printk(KERN_WARNING DEVICE_NAME ": could not register the motor reflex action\n");
+  }
+
+  symbol_put(nxt_sense_register_reflex_action);
+}
+
+/* Once this returns no rule fires the action */
+static void motor_unregister_action(void) {
+  if (!motor_action_unregister) {
+    return;
+  }
+
+  motor_action_unregister(&motor_action);
+  symbol_put(nxt_sense_unregister_reflex_action);
+  motor_action_unregister = NULL;
+}
+
+/***********************************************************************
+ *
+ * File operations for the /dev/motor# files
+ *
+ ***********************************************************************/
+static int motor_open(struct inode *inode, struct file *filp) {
+  filp->private_data = container_of(inode->i_cdev, struct motor, cdev);
+
+  return 0;
+}
+
+/* Takes one int, the new speed */
+static ssize_t motor_write(struct file *filp, const char __user *buff, size_t count, loff_t *offp) {
+  struct motor *m = filp->private_data;
+  int speed;
+  int status;
+
+  if (count != sizeof(speed)) {
+    return -EINVAL;
+  }
+
+  if (copy_from_user(&speed, buff, sizeof(speed))) {
+    return -EFAULT;
+  }
+
+  status = motor_user_set_speed(m->number, speed);
+
+  return (status == 0 ? sizeof(speed) : status);
+}
+
+/* Gives one int, the current speed */
+static ssize_t motor_read(struct file *filp, char __user *buff, size_t count, loff_t *offp) {
+  struct motor *m = filp->private_data;
+  int speed;
+
+  if (count < sizeof(speed)) {
+    return -EINVAL;
+  }
+
+  motor_get_speed(m->number, &speed);
+
+  if (copy_to_user(buff, &speed, sizeof(speed))) {
+    return -EFAULT;
+  }
+
+  return sizeof(speed);
+}
+
+static long motor_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+  struct motor *m = filp->private_data;
+  struct motor_tacho_state tacho;
+  struct motor_velocity velocity;
+  struct motor_pid_gains gains;
+  struct motor_control control;
+  struct motor_pid_status pid;
+  struct motor_segment segment;
+  struct motor_command command;
+  struct motor_event event;
+  int speed;
+  int status;
+
+  switch (cmd) {
+  case MOTOR_IOC_SET_SPEED:
+    if (copy_from_user(&speed, (int __user *) arg, sizeof(speed))) {
+      return -EFAULT;
+    }
+    return motor_user_set_speed(m->number, speed);
+  case MOTOR_IOC_GET_SPEED:
+    motor_get_speed(m->number, &speed);
+    return (copy_to_user((int __user *) arg, &speed, sizeof(speed)) ? -EFAULT : 0);
+  case MOTOR_IOC_GET_TACHO:
+    motor_get_tacho(m->number, &tacho);
+    return (copy_to_user((struct motor_tacho_state __user *) arg, &tacho, sizeof(tacho)) ? -EFAULT : 0);
+  case MOTOR_IOC_GET_VELOCITY:
+    motor_get_velocity(m->number, &velocity);
+    return (copy_to_user((struct motor_velocity __user *) arg, &velocity, sizeof(velocity)) ? -EFAULT : 0);
+  case MOTOR_IOC_SET_GAINS:
+    if (copy_from_user(&gains, (struct motor_pid_gains __user *) arg, sizeof(gains))) {
+      return -EFAULT;
+    }
+    return motor_set_gains(m->number, &gains);
+  case MOTOR_IOC_SET_CONTROL:
+    if (copy_from_user(&control, (struct motor_control __user *) arg, sizeof(control))) {
+      return -EFAULT;
+    }
+    motor_drive_release(m->number);
+    motor_profile_release(m->number);
+    return motor_set_control(m->number, control.mode, control.setpoint);
+  case MOTOR_IOC_GET_PID:
+    motor_get_pid(m->number, &pid);
+    return (copy_to_user((struct motor_pid_status __user *) arg, &pid, sizeof(pid)) ? -EFAULT : 0);
+  case MOTOR_IOC_QUEUE_SEGMENT:
+    if (copy_from_user(&segment, (struct motor_segment __user *) arg, sizeof(segment))) {
+      return -EFAULT;
+    }
+    return motor_queue_segment(m->number, &segment);
+  case MOTOR_IOC_COMMAND:
+    if (copy_from_user(&command, (struct motor_command __user *) arg, sizeof(command))) {
+      return -EFAULT;
+    }
+    return motor_command(m->number, &command);
+  case MOTOR_IOC_STOP:
+    if (copy_from_user(&speed, (int __user *) arg, sizeof(speed))) {
+      return -EFAULT;
+    }
+    return motor_stop(m->number, speed);
+  case MOTOR_IOC_CLEAR_STALL:
+    return motor_clear_stall(m->number);
+  case MOTOR_IOC_FLUSH:
+    return motor_flush(m->number);
+  case MOTOR_IOC_GET_EVENT:
+    status = motor_profile_get_event(m->number, &event, (filp->f_flags & O_NONBLOCK) != 0);
+    if (status < 0) {
+      return status;
+    }
+    return (copy_to_user((struct motor_event __user *) arg, &event, sizeof(event)) ? -EFAULT : 0);
+  default:
+    return -ENOTTY;
+  }
+}
+
+/* Events of the motion profile and room in its queue, see motor_ioctl.h */
+static unsigned int motor_poll(struct file *filp, poll_table *wait) {
+  struct motor *m = filp->private_data;
+
+  return motor_profile_poll(m->number, filp, wait);
+}
+
+/* The tachometers of all the motors, see motor_ioctl.h */
+static int motor_mmap(struct file *filp, struct vm_area_struct *vma) {
+  return motor_tacho_mmap(vma);
+}
+
+static const struct file_operations motor_fops = {
+  .owner = THIS_MODULE,
+  .open = motor_open,
+  .read = motor_read,
+  .write = motor_write,
+  .unlocked_ioctl = motor_ioctl,
+  .poll = motor_poll,
+  .mmap = motor_mmap,
+};
+
+/***********************************************************************
+ *
+ * Sysfs entries for the speed and the tachometer, for scripts
+ *
+ ***********************************************************************/
+static ssize_t speed_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor *m = dev_get_drvdata(dev);
+  int speed;
+
+  motor_get_speed(m->number, &speed);
+
+  return scnprintf(buf, PAGE_SIZE, "%d\n", speed);
+}
+
+static ssize_t speed_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  struct motor *m = dev_get_drvdata(dev);
+  int speed;
+  int status;
+
+  if (sscanf(buf, "%d", &speed) != 1) {
+    return -EINVAL;
+  }
+
+  status = motor_user_set_speed(m->number, speed);
+
+  return (status == 0 ? count : status);
+}
+
+/* "<position> <edge interval in ns> <errors>" */
+static ssize_t tacho_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor *m = dev_get_drvdata(dev);
+  struct motor_tacho_state tacho;
+
+  motor_get_tacho(m->number, &tacho);
+
+  return scnprintf(buf, PAGE_SIZE, "%lld %u %u\n", tacho.position, tacho.edge_interval_ns, tacho.errors);
+}
+
+static const char *velocity_method_name[] = {"none", "period", "count"};
+
+/* "<thousandths of an edge per second> <confidence in per mille> <method>" */
+static ssize_t velocity_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor *m = dev_get_drvdata(dev);
+  struct motor_velocity velocity;
+
+  motor_get_velocity(m->number, &velocity);
+
+  return scnprintf(buf, PAGE_SIZE, "%lld %u %s\n", velocity.velocity, velocity.confidence, velocity_method_name[velocity.method]);
+}
+
+DEVICE_ATTR(speed, (S_IRUGO | S_IWUSR), speed_show, speed_store);
+DEVICE_ATTR(tacho, S_IRUGO, tacho_show, NULL);
+DEVICE_ATTR(velocity, S_IRUGO, velocity_show, NULL);
+
+static struct device_attribute *motor_attrs[] = {
+  &dev_attr_speed,
+  &dev_attr_tacho,
+  &dev_attr_velocity,
+};
+
+static int motor_create_files(struct device *dev) {
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(motor_attrs); ++i) {
+    if (device_create_file(dev, motor_attrs[i])) {
+      printk(KERN_CRIT DEVICE_NAME ": device_create_file(%s) failed\n", motor_attrs[i]->attr.name);
+      goto create_files_fail;
+    }
+  }
+
+  return 0;
+
+ create_files_fail:
+  while (--i >= 0) {
+    device_remove_file(dev, motor_attrs[i]);
+  }
+  return -1;
+}
+
+static void motor_remove_files(struct device *dev) {
+  int i;
+
+  for (i = ARRAY_SIZE(motor_attrs) - 1; i >= 0; --i) {
+    device_remove_file(dev, motor_attrs[i]);
+  }
+}
+
+/***********************************************************************
+ *
+ * Module initialisation and uninitialisation
+ *
+ ***********************************************************************/
+static void motor_free_gpio_pins(int count) {
+  int i;
+
+  for (i = count - 1; i >= 0; --i) {
+    gpio_set_value(motor_board[i].enable_gpio, ENABLE_OFF);
+    gpio_free(motor_board[i].enable_gpio);
+    gpio_free(motor_board[i].phase_gpio);
+  }
+}
+
+/* The motors are off before the level shifter is enabled */
+static int __init motor_init_gpio_pins(void) {
+  int i;
+  const struct motor_desc *desc;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    desc = &motor_board[i];
+
+    if (gpio_request(desc->enable_gpio, "ENABLE")) {
+      printk(KERN_CRIT DEVICE_NAME ": gpio_request for pin %d failed\n", desc->enable_gpio);
+      goto init_gpio_pins_fail_1;
+    }
+
+    if (gpio_request(desc->phase_gpio, "PHASE")) {
+      printk(KERN_CRIT DEVICE_NAME ": gpio_request for pin %d failed\n", desc->phase_gpio);
+      goto init_gpio_pins_fail_2;
+    }
+
+    if (gpio_direction_output(desc->enable_gpio, ENABLE_OFF) || gpio_direction_output(desc->phase_gpio, PHASE_FORWARD)) {
+      printk(KERN_CRIT DEVICE_NAME ": could not set direction output on the pins of motor %d\n", i);
+      goto init_gpio_pins_fail_3;
+    }
+  }
+
+  return 0;
+
+ init_gpio_pins_fail_3:
+  gpio_free(desc->phase_gpio);
+
+ init_gpio_pins_fail_2:
+  gpio_free(desc->enable_gpio);
+
+ init_gpio_pins_fail_1:
+  motor_free_gpio_pins(i);
+  return -1;
+}
+
+static void motor_destroy_devices(int count) {
+  int i;
+  struct motor *m;
+
+  for (i = count - 1; i >= 0; --i) {
+    m = &motor_dev.motor[i];
+    motor_stall_remove_files(m->device);
+    motor_profile_remove_files(m->device);
+    motor_pid_remove_files(m->device);
+    motor_remove_files(m->device);
+    device_destroy(motor_dev.class, MKDEV(MAJOR(motor_dev.devt), i));
+    cdev_del(&m->cdev);
+  }
+}
+
+static int __init motor_init_devices(void) {
+  int i;
+  struct motor *m;
+  dev_t devt;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    m = &motor_dev.motor[i];
+    devt = MKDEV(MAJOR(motor_dev.devt), i);
+
+    cdev_init(&m->cdev, &motor_fops);
+    m->cdev.owner = THIS_MODULE;
+
+    if (cdev_add(&m->cdev, devt, 1)) {
+      printk(KERN_CRIT DEVICE_NAME ": cdev_add() failed for motor %d\n", i);
+      goto init_devices_fail_1;
+    }
+
+    m->device = device_create(motor_dev.class, NULL, devt, m, "%s%d", DEVICE_NAME, i);
+    if (IS_ERR(m->device)) {
+      printk(KERN_CRIT DEVICE_NAME ": device_create() failed for motor %d: %ld\n", i, PTR_ERR(m->device));
+      goto init_devices_fail_2;
+    }
+
+    if (motor_create_files(m->device) < 0)
+      goto init_devices_fail_3;
+
+    if (motor_pid_create_files(m->device) < 0)
+      goto init_devices_fail_4;
+
+    if (motor_profile_create_files(m->device) < 0)
+      goto init_devices_fail_5;
+
+    if (motor_stall_create_files(m->device) < 0)
+      goto init_devices_fail_6;
+  }
+
+  return 0;
+
+ init_devices_fail_6:
+  motor_profile_remove_files(m->device);
+
+ init_devices_fail_5:
+  motor_pid_remove_files(m->device);
+
+ init_devices_fail_4:
+  motor_remove_files(m->device);
+
+ init_devices_fail_3:
+  device_destroy(motor_dev.class, devt);
+
+ init_devices_fail_2:
+  cdev_del(&m->cdev);
+
+ init_devices_fail_1:
+  motor_destroy_devices(i);
+  return -1;
+}
+
+static void motor_init_pwm(void) {
+  int i;
+  struct motor *m;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    m = &motor_dev.motor[i];
+    m->number = i;
+    m->limit = MOTOR_SPEED_MAX;
+    spin_lock_init(&m->lock);
+    hrtimer_init(&m->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    m->timer.function = motor_pwm_tick;
+
+    if (hw_pwm) {
+      motor_init_hw_pwm(m);
+    }
+  }
+}
+
+static void motor_exit_pwm(void) {
+  int i;
+  struct motor *m;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    m = &motor_dev.motor[i];
+    hrtimer_cancel(&m->timer);
+
+    if (m->pwm_timer) {
+      omap_dm_timer_stop(m->pwm_timer);
+      omap_dm_timer_set_pwm(m->pwm_timer, ENABLE_OFF, 1, OMAP_TIMER_TRIGGER_OVERFLOW_AND_COMPARE);
+      omap_dm_timer_free(m->pwm_timer);
+    }
+  }
+}
+
+static int __init motor_init(void) {
+  memset(&motor_dev, 0, sizeof(motor_dev));
+
+  if (pwm_frequency == 0 || pwm_frequency > NSEC_PER_SEC / (10 * MOTOR_SPEED_MAX)) {
+    printk(KERN_WARNING DEVICE_NAME ": pwm_frequency %u is out of range, using 1000 Hz\n", pwm_frequency);
+    pwm_frequency = 1000;
+  }
+
+  if (motor_init_gpio_pins() < 0)
+    goto fail_1;
+
+  if (register_use_of_level_shifter(LS_MOTOR)) {
+    printk(KERN_CRIT DEVICE_NAME ": register_use_of_level_shifter failed for LS_MOTOR\n");
+    goto fail_2;
+  }
+
+  motor_init_pwm();
+
+  if (motor_tacho_init() < 0)
+    goto fail_3;
+
+  /* Before the controllers, which then follow the profiles in the same tick */
+  if (motor_profile_init() < 0)
+    goto fail_4;
+
+  if (motor_pid_init() < 0)
+    goto fail_5;
+
+  if (alloc_chrdev_region(&motor_dev.devt, 0, NUMBER_OF_MINORS, DEVICE_NAME) < 0) {
+    printk(KERN_CRIT DEVICE_NAME ": alloc_chrdev_region() failed\n");
+    goto fail_6;
+  }
+
+  motor_dev.class = class_create(THIS_MODULE, DEVICE_NAME);
+  if (IS_ERR(motor_dev.class)) {
+    printk(KERN_CRIT DEVICE_NAME ": class_create() failed: %ld\n", PTR_ERR(motor_dev.class));
+    goto fail_7;
+  }
+
+  if (motor_init_devices() < 0)
+    goto fail_8;
+
+  if (motor_drive_init(motor_dev.class, MKDEV(MAJOR(motor_dev.devt), NUMBER_OF_MOTORS)) < 0)
+    goto fail_9;
+
+  /* Last, as it uses the devices for sysfs_notify */
+  if (motor_stall_init() < 0)
+    goto fail_10;
+
+  motor_register_action();
+
+  return 0;
+
+ fail_10:
+  motor_drive_exit(motor_dev.class);
+
+ fail_9:
+  motor_destroy_devices(NUMBER_OF_MOTORS);
+
+ fail_8:
+  class_destroy(motor_dev.class);
+
+ fail_7:
+  unregister_chrdev_region(motor_dev.devt, NUMBER_OF_MINORS);
+
+ fail_6:
+  motor_pid_exit();
+
+ fail_5:
+  motor_profile_exit();
+
+ fail_4:
+  motor_tacho_exit();
+
+ fail_3:
+  motor_exit_pwm();
+  unregister_use_of_level_shifter(LS_MOTOR);
+
+ fail_2:
+  motor_free_gpio_pins(NUMBER_OF_MOTORS);
+
+ fail_1:
+  return -1;
+}
+module_init(motor_init);
+
+static void __exit motor_exit(void) {
+  motor_unregister_action();
+  motor_stall_exit();
+  motor_drive_exit(motor_dev.class);
+  motor_destroy_devices(NUMBER_OF_MOTORS);
+  class_destroy(motor_dev.class);
+  unregister_chrdev_region(motor_dev.devt, NUMBER_OF_MINORS);
+
+  motor_pid_exit();
+  motor_profile_exit();
+  motor_tacho_exit();
+  motor_exit_pwm();
+  motor_free_gpio_pins(NUMBER_OF_MOTORS); /* Stops the motors */
+  unregister_use_of_level_shifter(LS_MOTOR);
+}
+module_exit(motor_exit);
+
+MODULE_LICENSE("GPL");
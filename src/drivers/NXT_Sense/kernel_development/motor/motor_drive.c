@@ -0,0 +1,476 @@
+/* Notes:
+ * - The drive pair of a two-wheeled robot, motor 0 the left and motor 1 the right wheel by default (left_motor and right_motor). A command is latched by compute of the control_loop callback and commit sets both wheels, so they change in the same tick instead of one echo after the other.
+ * - The sync mode is the one of the NXT firmware: the wheels should travel in the ratio of the turn, i.e. left * right_factor == right * left_factor counting from the command. The difference is fed back proportionally (sync_kp), each wheel moving by its share of the gradient, which also works for the reversed inner wheel of a sharp turn.
+ * - The odometry of the pair is in motor_odometry.c, its page is mapped through /dev/motor_drive.
+ * - The drive takes the wheels in open mode, so the motor PIDs and profiles leave them alone. Setting the speed or the control of a wheel from the user (motor_drive_release) stops the drive.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/stat.h>
+#include <asm/uaccess.h>
+
+#include "../control_loop/control_loop.h"
+#include "motor.h"
+#include "motor_drive.h"
+#include "motor_profile.h"
+#include "motor_odometry.h"
+
+#define DEVICE_NAME "motor_drive"
+
+static int left_motor = 0;
+module_param(left_motor, int, S_IRUGO);
+MODULE_PARM_DESC(left_motor, "Motor of the left wheel of the drive pair");
+
+static int right_motor = 1;
+module_param(right_motor, int, S_IRUGO);
+MODULE_PARM_DESC(right_motor, "Motor of the right wheel of the drive pair");
+
+static unsigned int sync_kp = 5000;
+module_param(sync_kp, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(sync_kp, "Gain of the sync mode in thousandths of a per mille speed per tachometer edge");
+
+struct motor_drive_pair {
+  spinlock_t lock; /* Also held by commit while setting the wheels, so a released drive does not set them again */
+  struct motor_drive command;
+  bool pending; /* command is not latched yet */
+  struct motor_drive active;
+  bool take; /* The wheels have to be switched to open mode */
+  int left_factor; /* Per cent of the speed for each wheel */
+  int right_factor;
+  s64 left_origin; /* Tachometer positions when the command was latched */
+  s64 right_origin;
+  int left_output;
+  int right_output;
+  s64 sync_error;
+  struct cdev cdev;
+  struct device *device;
+  dev_t devt;
+};
+
+static struct motor_drive_pair drive;
+
+static const char *drive_mode_name[] = {"idle", "wheels", "steer", "sync"};
+
+/***********************************************************************
+ *
+ * The drive, run by control_loop
+ *
+ ***********************************************************************/
+/* Positive turns right, slowing the right wheel down */
+static void drive_factors(int turn, int *left, int *right) {
+  *left = (turn < 0 ? MOTOR_DRIVE_TURN_MAX + 2 * turn : MOTOR_DRIVE_TURN_MAX);
+  *right = (turn > 0 ? MOTOR_DRIVE_TURN_MAX - 2 * turn : MOTOR_DRIVE_TURN_MAX);
+}
+
+/* True when the commands drive the same, the fields not used by the mode are ignored */
+static bool drive_same(const struct motor_drive *a, const struct motor_drive *b) {
+  if (a->mode != b->mode) {
+    return false;
+  }
+
+  switch (a->mode) {
+  case MOTOR_DRIVE_WHEELS:
+    return a->left == b->left && a->right == b->right;
+  case MOTOR_DRIVE_STEER:
+  case MOTOR_DRIVE_SYNC:
+    return a->speed == b->speed && a->turn == b->turn;
+  default:
+    return true;
+  }
+}
+
+/* Requires the lock of the drive */
+static void drive_latch(struct motor_tacho_state *left, struct motor_tacho_state *right) {
+  drive.pending = false;
+
+  /* A repeated command, e.g. resent by a remote control to keep its watchdog happy, keeps the origins and the sync error, or the sync mode would never correct anything */
+  if (drive_same(&drive.command, &drive.active)) {
+    return;
+  }
+
+  drive.active = drive.command;
+  drive.take = (drive.active.mode != MOTOR_DRIVE_IDLE);
+  drive.left_origin = left->position;
+  drive.right_origin = right->position;
+  drive.sync_error = 0;
+
+  if (drive.active.mode == MOTOR_DRIVE_WHEELS) {
+    drive.left_output = drive.active.left;
+    drive.right_output = drive.active.right;
+  } else {
+    drive_factors(drive.active.turn, &drive.left_factor, &drive.right_factor);
+    drive.left_output = drive.active.speed * drive.left_factor / MOTOR_DRIVE_TURN_MAX;
+    drive.right_output = drive.active.speed * drive.right_factor / MOTOR_DRIVE_TURN_MAX;
+  }
+}
+
+/* Requires the lock of the drive */
+static void drive_sync(struct motor_tacho_state *left, struct motor_tacho_state *right) {
+  s64 left_travel = left->position - drive.left_origin;
+  s64 right_travel = right->position - drive.right_origin;
+  s64 correction;
+  s64 output;
+
+  drive.sync_error = div_s64(left_travel * drive.right_factor - right_travel * drive.left_factor, MOTOR_DRIVE_TURN_MAX);
+  correction = div_s64(drive.sync_error * sync_kp, 1000);
+
+  output = div_s64((s64) drive.active.speed * drive.left_factor - correction * drive.right_factor, MOTOR_DRIVE_TURN_MAX);
+  drive.left_output = (int) clamp_t(s64, output, -MOTOR_SPEED_MAX, MOTOR_SPEED_MAX);
+
+  output = div_s64((s64) drive.active.speed * drive.right_factor + correction * drive.left_factor, MOTOR_DRIVE_TURN_MAX);
+  drive.right_output = (int) clamp_t(s64, output, -MOTOR_SPEED_MAX, MOTOR_SPEED_MAX);
+}
+
+static void motor_drive_compute(const struct control_loop_snapshot *snapshot, void *data) {
+  struct motor_tacho_state left;
+  struct motor_tacho_state right;
+  unsigned long flags;
+
+  motor_get_tacho(left_motor, &left);
+  motor_get_tacho(right_motor, &right);
+
+  spin_lock_irqsave(&drive.lock, flags);
+  if (drive.pending) {
+    drive_latch(&left, &right);
+  } else if (drive.active.mode == MOTOR_DRIVE_SYNC) {
+    drive_sync(&left, &right);
+  }
+  spin_unlock_irqrestore(&drive.lock, flags);
+}
+
+static void motor_drive_commit(void *data) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&drive.lock, flags);
+
+  if (drive.active.mode != MOTOR_DRIVE_IDLE) {
+    if (drive.take) {
+      motor_profile_release(left_motor);
+      motor_profile_release(right_motor);
+      motor_set_control(left_motor, MOTOR_MODE_OPEN, 0);
+      motor_set_control(right_motor, MOTOR_MODE_OPEN, 0);
+      drive.take = false;
+    }
+
+    motor_set_speed(left_motor, drive.left_output);
+    motor_set_speed(right_motor, drive.right_output);
+  }
+
+  spin_unlock_irqrestore(&drive.lock, flags);
+}
+
+static struct control_loop_ops motor_drive_ops = {
+  .name = DEVICE_NAME,
+  .adc_mask = 0,
+  .compute = motor_drive_compute,
+  .commit = motor_drive_commit,
+};
+
+/***********************************************************************
+ *
+ * Hooks for driving from other modules and motor_core
+ *
+ ***********************************************************************/
+int motor_drive(const struct motor_drive *command) {
+  unsigned long flags;
+
+  switch (command->mode) {
+  case MOTOR_DRIVE_IDLE:
+    break;
+  case MOTOR_DRIVE_WHEELS:
+    if (abs(command->left) > MOTOR_SPEED_MAX || abs(command->right) > MOTOR_SPEED_MAX) {
+      return -EINVAL;
+    }
+    break;
+  case MOTOR_DRIVE_STEER:
+  case MOTOR_DRIVE_SYNC:
+    if (abs(command->speed) > MOTOR_SPEED_MAX || abs(command->turn) > MOTOR_DRIVE_TURN_MAX) {
+      return -EINVAL;
+    }
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  spin_lock_irqsave(&drive.lock, flags);
+  drive.command = *command;
+  drive.pending = true;
+  spin_unlock_irqrestore(&drive.lock, flags);
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_drive);
+
+void motor_get_drive(struct motor_drive_status *status) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&drive.lock, flags);
+  status->command = (drive.pending ? drive.command : drive.active);
+  status->left_output = (drive.active.mode != MOTOR_DRIVE_IDLE ? drive.left_output : 0);
+  status->right_output = (drive.active.mode != MOTOR_DRIVE_IDLE ? drive.right_output : 0);
+  status->reserved = 0;
+  status->sync_error = drive.sync_error;
+  spin_unlock_irqrestore(&drive.lock, flags);
+}
+EXPORT_SYMBOL(motor_get_drive);
+
+/* The user takes one of the wheels. The motor keeps running until the user sets it */
+void motor_drive_release(int motor) {
+  unsigned long flags;
+
+  if (motor != left_motor && motor != right_motor) {
+    return;
+  }
+
+  spin_lock_irqsave(&drive.lock, flags);
+  memset(&drive.command, 0, sizeof(drive.command));
+  memset(&drive.active, 0, sizeof(drive.active));
+  drive.pending = false;
+  spin_unlock_irqrestore(&drive.lock, flags);
+}
+
+/* Stops both wheels with a stop mode, see motor_ioctl.h */
+int motor_drive_stop(int mode) {
+  int res;
+
+  if (mode < MOTOR_STOP_COAST || mode > MOTOR_STOP_DEFAULT) {
+    return -EINVAL;
+  }
+
+  res = motor_stop(left_motor, mode);
+  if (res == 0) {
+    res = motor_stop(right_motor, mode);
+  }
+
+  return res;
+}
+EXPORT_SYMBOL(motor_drive_stop);
+
+/***********************************************************************
+ *
+ * File operations for /dev/motor_drive
+ *
+ ***********************************************************************/
+static int motor_drive_open(struct inode *inode, struct file *filp) {
+  return 0;
+}
+
+/* Takes one struct motor_drive */
+static ssize_t motor_drive_write(struct file *filp, const char __user *buff, size_t count, loff_t *offp) {
+  struct motor_drive command;
+  int status;
+
+  if (count != sizeof(command)) {
+    return -EINVAL;
+  }
+
+  if (copy_from_user(&command, buff, sizeof(command))) {
+    return -EFAULT;
+  }
+
+  status = motor_drive(&command);
+
+  return (status == 0 ? sizeof(command) : status);
+}
+
+static long motor_drive_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+  struct motor_drive command;
+  struct motor_drive_status status;
+  struct motor_pose pose;
+  int mode;
+
+  switch (cmd) {
+  case MOTOR_IOC_DRIVE:
+    if (copy_from_user(&command, (struct motor_drive __user *) arg, sizeof(command))) {
+      return -EFAULT;
+    }
+    return motor_drive(&command);
+  case MOTOR_IOC_GET_DRIVE:
+    motor_get_drive(&status);
+    return (copy_to_user((struct motor_drive_status __user *) arg, &status, sizeof(status)) ? -EFAULT : 0);
+  case MOTOR_IOC_DRIVE_STOP:
+    if (copy_from_user(&mode, (int __user *) arg, sizeof(mode))) {
+      return -EFAULT;
+    }
+    return motor_drive_stop(mode);
+  case MOTOR_IOC_SET_POSE:
+    if (copy_from_user(&pose, (struct motor_pose __user *) arg, sizeof(pose))) {
+      return -EFAULT;
+    }
+    motor_set_pose(&pose);
+    return 0;
+  case MOTOR_IOC_GET_POSE:
+    motor_get_pose(&pose);
+    return (copy_to_user((struct motor_pose __user *) arg, &pose, sizeof(pose)) ? -EFAULT : 0);
+  default:
+    return -ENOTTY;
+  }
+}
+
+/* The odometry, see motor_ioctl.h */
+static int motor_drive_mmap(struct file *filp, struct vm_area_struct *vma) {
+  return motor_odometry_mmap(vma);
+}
+
+static const struct file_operations motor_drive_fops = {
+  .owner = THIS_MODULE,
+  .open = motor_drive_open,
+  .write = motor_drive_write,
+  .unlocked_ioctl = motor_drive_ioctl,
+  .mmap = motor_drive_mmap,
+};
+
+/***********************************************************************
+ *
+ * Sysfs entry of the drive, for scripts
+ *
+ ***********************************************************************/
+/* "<mode> <left|speed> <right|turn> <left output> <right output> <sync error>" */
+static ssize_t drive_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor_drive_status status;
+  const struct motor_drive *c = &status.command;
+
+  motor_get_drive(&status);
+
+  return scnprintf(buf, PAGE_SIZE, "%s %d %d %d %d %lld\n", drive_mode_name[c->mode],
+                   (c->mode == MOTOR_DRIVE_WHEELS ? c->left : c->speed), (c->mode == MOTOR_DRIVE_WHEELS ? c->right : c->turn),
+                   status.left_output, status.right_output, status.sync_error);
+}
+
+static const char *drive_stop_name[] = {"coast", "brake", "hold"};
+
+/* Takes "stop [coast|brake|hold]", "idle", "wheels <left> <right>", "steer <speed> <turn>" or "sync <speed> <turn>". Stop without a mode uses the stop mode of each wheel */
+static ssize_t drive_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  struct motor_drive command;
+  char mode[10];
+  char stop[10];
+  int a = 0;
+  int b = 0;
+  int res;
+  int i;
+
+  res = sscanf(buf, "%9s %d %d", mode, &a, &b);
+  if (res < 1) {
+    return -EINVAL;
+  }
+
+  if (strcmp(mode, "stop") == 0) {
+    i = MOTOR_STOP_DEFAULT;
+    if (sscanf(buf, "%9s %9s", mode, stop) == 2) {
+      for (i = MOTOR_STOP_COAST; i < MOTOR_STOP_DEFAULT; ++i) {
+        if (strcmp(stop, drive_stop_name[i]) == 0) {
+          break;
+        }
+      }
+
+      if (i == MOTOR_STOP_DEFAULT) {
+        return -EINVAL;
+      }
+    }
+
+    res = motor_drive_stop(i);
+    return (res == 0 ? count : res);
+  }
+
+  for (i = MOTOR_DRIVE_IDLE; i <= MOTOR_DRIVE_SYNC; ++i) {
+    if (strcmp(mode, drive_mode_name[i]) == 0) {
+      break;
+    }
+  }
+
+  if (i > MOTOR_DRIVE_SYNC || (i != MOTOR_DRIVE_IDLE && res != 3)) {
+    return -EINVAL;
+  }
+
+  memset(&command, 0, sizeof(command));
+  command.mode = i;
+  if (i == MOTOR_DRIVE_WHEELS) {
+    command.left = a;
+    command.right = b;
+  } else {
+    command.speed = a;
+    command.turn = b;
+  }
+
+  res = motor_drive(&command);
+
+  return (res == 0 ? count : res);
+}
+
+DEVICE_ATTR(drive, (S_IRUGO | S_IWUSR), drive_show, drive_store);
+
+/***********************************************************************
+ *
+ * Initialisation and uninitialisation, called by motor_core with the
+ * class and the device number of /dev/motor_drive
+ *
+ ***********************************************************************/
+int motor_drive_init(struct class *class, dev_t devt) {
+  if (left_motor < 0 || left_motor >= NUMBER_OF_MOTORS || right_motor < 0 || right_motor >= NUMBER_OF_MOTORS || left_motor == right_motor) {
+    printk(KERN_ERR DEVICE_NAME ": left_motor %d and right_motor %d are not two motors\n", left_motor, right_motor);
+    goto init_fail_1;
+  }
+
+  spin_lock_init(&drive.lock);
+  drive.devt = devt;
+
+  cdev_init(&drive.cdev, &motor_drive_fops);
+  drive.cdev.owner = THIS_MODULE;
+
+  if (cdev_add(&drive.cdev, devt, 1)) {
+    printk(KERN_CRIT DEVICE_NAME ": cdev_add() failed\n");
+    goto init_fail_1;
+  }
+
+  drive.device = device_create(class, NULL, devt, NULL, DEVICE_NAME);
+  if (IS_ERR(drive.device)) {
+    printk(KERN_CRIT DEVICE_NAME ": device_create() failed: %ld\n", PTR_ERR(drive.device));
+    goto init_fail_2;
+  }
+
+  if (device_create_file(drive.device, &dev_attr_drive)) {
+    printk(KERN_CRIT DEVICE_NAME ": device_create_file() failed\n");
+    goto init_fail_3;
+  }
+
+  if (control_loop_register(&motor_drive_ops) != 0) {
+    printk(KERN_ERR DEVICE_NAME ": control_loop_register failed\n");
+    goto init_fail_4;
+  }
+
+  if (motor_odometry_init(left_motor, right_motor, drive.device) < 0)
+    goto init_fail_5;
+
+  return 0;
+
+ init_fail_5:
+  control_loop_unregister(&motor_drive_ops);
+
+ init_fail_4:
+  device_remove_file(drive.device, &dev_attr_drive);
+
+ init_fail_3:
+  device_destroy(class, devt);
+
+ init_fail_2:
+  cdev_del(&drive.cdev);
+
+ init_fail_1:
+  return -1;
+}
+
+void motor_drive_exit(struct class *class) {
+  motor_odometry_exit(drive.device);
+  control_loop_unregister(&motor_drive_ops);
+  device_remove_file(drive.device, &dev_attr_drive);
+  device_destroy(class, drive.devt);
+  cdev_del(&drive.cdev);
+}
@@ -0,0 +1,9 @@
+#ifndef __H_motor_drive_h_
+#define __H_motor_drive_h_
+
+/* The drive pair, only used from within motor_core and motor_pid */
+extern int motor_drive_init(struct class *, dev_t);
+extern void motor_drive_exit(struct class *);
+extern void motor_drive_release(int);
+
+#endif
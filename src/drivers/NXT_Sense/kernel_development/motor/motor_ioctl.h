@@ -0,0 +1,208 @@
+#ifndef __H_motor_ioctl_h_
+#define __H_motor_ioctl_h_
+
+/* The interface of the /dev/motor# files, shared with the applications.
+ * A speed is an int from -MOTOR_SPEED_MAX (full speed backward) to MOTOR_SPEED_MAX (full speed forward), the duty cycle of the PWM in per mille.
+ * write() and read() take and give one such int, or use the ioctls. Setting the speed switches the motor to MOTOR_MODE_OPEN.
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MOTOR_SPEED_MAX 1000
+
+/* The tachometer of a motor, counting every edge of both TACHO signals (quadrature decoding).
+ * mmap() of PAGE_SIZE at offset 0 of any /dev/motor# gives a read-only struct motor_tacho_page, updated from the interrupts without locking. A reader copies the state of a motor and retries while seq is odd or has changed meanwhile:
+ *   do { seq = s->seq; __sync_synchronize(); copy = *s; __sync_synchronize(); } while ((seq & 1) || seq != s->seq);
+ */
+struct motor_tacho_state {
+  __u32 seq; /* Odd while the state is being updated */
+  __u32 errors; /* Transitions where both signals changed, i.e. a missed edge */
+  __s64 position; /* Edges counted, positive forward */
+  __s64 last_edge_ns; /* CLOCK_MONOTONIC time of the last edge */
+  __u32 edge_interval_ns; /* Time between the last two edges, 0 when unknown */
+  __s32 direction; /* Of the last edge, 1 or -1 */
+};
+
+struct motor_tacho_page {
+  struct motor_tacho_state motor[3];
+};
+
+/* The velocity of a motor estimated from the times of the tachometer edges. With several edges within velocity_window_us it is the edges over the time they span (MOTOR_VELOCITY_COUNT), with fewer it is one edge over the time since the edge before, or since the last edge if that is longer (MOTOR_VELOCITY_PERIOD). Without an edge for velocity_timeout_ms the motor stands still (MOTOR_VELOCITY_NONE).
+ * The confidence is in per mille: 1000 - 1000 / edges counted for MOTOR_VELOCITY_COUNT, at most 500 for MOTOR_VELOCITY_PERIOD, falling while the next edge is late, and 0 for MOTOR_VELOCITY_NONE.
+ */
+#define MOTOR_VELOCITY_NONE 0
+#define MOTOR_VELOCITY_PERIOD 1
+#define MOTOR_VELOCITY_COUNT 2
+
+struct motor_velocity {
+  __s64 velocity; /* In thousandths of an edge per second */
+  __u32 confidence;
+  __s32 method;
+};
+
+/* Closed-loop control of a motor, the controllers output the speed of the motor.
+ * The gains are in thousandths, the output being (kp * error + ki * integral of the error over seconds + kd * derivative per second) / 1000.
+ */
+#define MOTOR_MODE_OPEN 0 /* No controller, the speed is set directly */
+#define MOTOR_MODE_SPEED 1 /* The setpoint is a speed in tachometer edges per second */
+#define MOTOR_MODE_POSITION 2 /* The setpoint is a tachometer position */
+#define MOTOR_MODE_BRAKE 3 /* The speed controller brakes to a standstill, then the motor coasts (MOTOR_MODE_OPEN) */
+
+struct motor_pid_gains {
+  __s32 mode; /* The controller the gains are for, MOTOR_MODE_SPEED or MOTOR_MODE_POSITION */
+  __s32 kp;
+  __s32 ki;
+  __s32 kd;
+};
+
+struct motor_control {
+  __s32 mode;
+  __s32 reserved;
+  __s64 setpoint;
+};
+
+struct motor_pid_status {
+  __s32 mode;
+  __s32 output; /* The speed set by the controller */
+  __s64 setpoint;
+  __s64 measured;
+  __s64 error;
+};
+
+/* Motion profiles: every motor runs a queue of segments in the kernel, each tick of control_loop moving the setpoint of the position controller along a trapezoidal velocity profile (accelerating at accel, cruising at velocity, decelerating at accel).
+ * MOTOR_SEGMENT_POSITION moves to the tachometer position target, MOTOR_SEGMENT_ROTATE by target from where the segment starts. MOTOR_SEGMENT_VELOCITY changes to the speed velocity (signed) and runs for duration_ms from its start, or until the next segment is queued when duration_ms is 0. Velocities are in tachometer edges per second, accelerations in edges per second squared.
+ * When the queue runs empty the profile keeps its last velocity, holding the position after a position segment. The end of a segment may instead hold, stopping at once and holding the position, or brake or coast when no segment follows (see the stop modes), or stop with the default stop mode of the motor.
+ * Every segment reports a struct motor_event with its id when it is done or aborted. MOTOR_IOC_GET_EVENT takes the oldest event, blocking unless the file is O_NONBLOCK, and poll() gives POLLIN while there are events and POLLOUT while the queue has room.
+ * MOTOR_IOC_FLUSH aborts the segments and stops the motor, as does setting its speed or control.
+ */
+#define MOTOR_SEGMENT_POSITION 0
+#define MOTOR_SEGMENT_VELOCITY 1
+#define MOTOR_SEGMENT_ROTATE 2
+
+#define MOTOR_END_CONTINUE 0
+#define MOTOR_END_BRAKE 1
+#define MOTOR_END_COAST 2
+#define MOTOR_END_HOLD 3
+#define MOTOR_END_STOP 4
+
+#define MOTOR_PROFILE_QUEUE 16
+
+struct motor_segment {
+  __u32 id; /* Reported by the events of the segment */
+  __s32 type;
+  __s64 target; /* MOTOR_SEGMENT_POSITION and MOTOR_SEGMENT_ROTATE, at most about 4.6e12 edges either way */
+  __s32 velocity; /* The cruise velocity of a position segment (positive), the velocity of a velocity segment */
+  __s32 accel; /* Positive */
+  __u32 duration_ms; /* MOTOR_SEGMENT_VELOCITY */
+  __u32 end; /* MOTOR_END_... */
+};
+
+/* Stop modes: MOTOR_STOP_COAST turns the motor off, MOTOR_STOP_BRAKE brakes actively with the speed controller until the motor stands still and then coasts, and MOTOR_STOP_HOLD holds the position with the position controller.
+ * MOTOR_IOC_STOP takes one of them or MOTOR_STOP_DEFAULT, the stop mode of the motor set in its stop_mode attribute. Stopping aborts the profile of the motor and stops the drive pair.
+ */
+#define MOTOR_STOP_COAST 0
+#define MOTOR_STOP_BRAKE 1
+#define MOTOR_STOP_HOLD 2
+#define MOTOR_STOP_DEFAULT 3
+
+/* Stall protection: a motor driven at stall_speed or more which moves less than stall_edges within stall_window_ms is stalled. Its speed is then limited to stall_limit (0 cuts it), it is released from its controller, profile and drive pair, and a MOTOR_EVENT_STALLED is raised.
+ * The limit stays until MOTOR_IOC_CLEAR_STALL, or writing 0 to the stall attribute of the motor, which poll() on sysfs watches.
+ */
+
+/* Commands in degrees of the output shaft, run as one segment with the acceleration of the command_accel parameter.
+ * MOTOR_COMMAND_ROTATE rotates by degrees (signed) at speed degrees per second. MOTOR_COMMAND_RUN runs at speed (signed) for duration_ms.
+ */
+#define MOTOR_COMMAND_ROTATE 0
+#define MOTOR_COMMAND_RUN 1
+
+struct motor_command {
+  __u32 id;
+  __s32 type;
+  __s32 degrees; /* MOTOR_COMMAND_ROTATE */
+  __u32 duration_ms; /* MOTOR_COMMAND_RUN */
+  __s32 speed;
+  __u32 end; /* MOTOR_END_... */
+};
+
+#define MOTOR_EVENT_DONE 0
+#define MOTOR_EVENT_ABORTED 1
+#define MOTOR_EVENT_STALLED 2 /* With the id of the running segment, or 0 */
+
+struct motor_event {
+  __u32 id;
+  __s32 type;
+  __s64 position; /* Tachometer position when it happened */
+  __s64 time_ns; /* CLOCK_MONOTONIC */
+};
+
+/* The drive pair of a two-wheeled robot, /dev/motor_drive. Both wheels change in the same control_loop tick.
+ * MOTOR_DRIVE_WHEELS takes the speed of each wheel. MOTOR_DRIVE_STEER takes a speed and a turn from -100 (spinning left) over 0 (straight) to 100 (spinning right), turning slowing the inner wheel down and reversing it beyond 50.
+ * MOTOR_DRIVE_SYNC steers like MOTOR_DRIVE_STEER, correcting the speeds from the tachometers so that the wheels keep the ratio of the turn, e.g. drive straight.
+ * write() takes a struct motor_drive, or use the ioctls. Setting the speed or the control of one of the wheels stops the drive (MOTOR_DRIVE_IDLE).
+ */
+#define MOTOR_DRIVE_IDLE 0 /* The drive leaves the motors alone */
+#define MOTOR_DRIVE_WHEELS 1
+#define MOTOR_DRIVE_STEER 2
+#define MOTOR_DRIVE_SYNC 3
+
+#define MOTOR_DRIVE_TURN_MAX 100
+
+struct motor_drive {
+  __s32 mode;
+  __s32 left; /* MOTOR_DRIVE_WHEELS */
+  __s32 right;
+  __s32 speed; /* MOTOR_DRIVE_STEER and MOTOR_DRIVE_SYNC */
+  __s32 turn;
+};
+
+struct motor_drive_status {
+  struct motor_drive command;
+  __s32 left_output; /* The speeds last set */
+  __s32 right_output;
+  __s32 reserved;
+  __s64 sync_error; /* Of MOTOR_DRIVE_SYNC, in tachometer edges the left wheel is ahead */
+};
+
+/* Odometry of the drive pair: the pose of the robot, dead-reckoned from the tachometers of both wheels every control_loop tick with the wheel_radius_um and wheel_base_um parameters.
+ * mmap() of PAGE_SIZE at offset 0 of /dev/motor_drive gives a read-only struct motor_odometry_page, the current pose and a history of poses every history_ticks ticks. It is updated under seq like the tachometer page, a reader copying what it needs and retrying while seq is odd or has changed.
+ */
+struct motor_pose {
+  __s64 time_ns; /* CLOCK_MONOTONIC of the tick */
+  __s64 x; /* In micrometres */
+  __s64 y;
+  __u32 heading; /* Counterclockwise from the x axis, 2^32 being a full turn */
+  __s32 reserved;
+};
+
+#define MOTOR_ODOMETRY_HISTORY 64
+
+struct motor_odometry_page {
+  __u32 seq;
+  __u32 head; /* history[head] is the newest pose of the history */
+  __u32 count; /* Poses in the history */
+  __u32 reserved;
+  struct motor_pose pose;
+  struct motor_pose history[MOTOR_ODOMETRY_HISTORY];
+};
+
+#define MOTOR_IOC_MAGIC 'M'
+#define MOTOR_IOC_SET_SPEED _IOW(MOTOR_IOC_MAGIC, 1, int)
+#define MOTOR_IOC_GET_SPEED _IOR(MOTOR_IOC_MAGIC, 2, int)
+#define MOTOR_IOC_GET_TACHO _IOR(MOTOR_IOC_MAGIC, 3, struct motor_tacho_state)
+#define MOTOR_IOC_SET_GAINS _IOW(MOTOR_IOC_MAGIC, 4, struct motor_pid_gains)
+#define MOTOR_IOC_SET_CONTROL _IOW(MOTOR_IOC_MAGIC, 5, struct motor_control)
+#define MOTOR_IOC_GET_PID _IOR(MOTOR_IOC_MAGIC, 6, struct motor_pid_status)
+#define MOTOR_IOC_DRIVE _IOW(MOTOR_IOC_MAGIC, 7, struct motor_drive) /* /dev/motor_drive only */
+#define MOTOR_IOC_GET_DRIVE _IOR(MOTOR_IOC_MAGIC, 8, struct motor_drive_status) /* /dev/motor_drive only */
+#define MOTOR_IOC_QUEUE_SEGMENT _IOW(MOTOR_IOC_MAGIC, 9, struct motor_segment) /* -EAGAIN when the queue is full */
+#define MOTOR_IOC_FLUSH _IO(MOTOR_IOC_MAGIC, 10)
+#define MOTOR_IOC_GET_EVENT _IOR(MOTOR_IOC_MAGIC, 11, struct motor_event)
+#define MOTOR_IOC_COMMAND _IOW(MOTOR_IOC_MAGIC, 12, struct motor_command) /* -EAGAIN when the queue is full */
+#define MOTOR_IOC_CLEAR_STALL _IO(MOTOR_IOC_MAGIC, 13)
+#define MOTOR_IOC_STOP _IOW(MOTOR_IOC_MAGIC, 14, int)
+#define MOTOR_IOC_DRIVE_STOP _IOW(MOTOR_IOC_MAGIC, 15, int) /* /dev/motor_drive only, stops both wheels */
+#define MOTOR_IOC_GET_VELOCITY _IOR(MOTOR_IOC_MAGIC, 16, struct motor_velocity)
+#define MOTOR_IOC_SET_POSE _IOW(MOTOR_IOC_MAGIC, 17, struct motor_pose) /* /dev/motor_drive only, the time is ignored */
+#define MOTOR_IOC_GET_POSE _IOR(MOTOR_IOC_MAGIC, 18, struct motor_pose) /* /dev/motor_drive only */
+
+#endif
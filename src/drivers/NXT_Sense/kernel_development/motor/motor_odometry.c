@@ -0,0 +1,310 @@
+/* Notes:
+ * - Dead reckoning of the drive pair, run as a control_loop callback: the distance of each wheel is computed from its total tachometer count (so no remainders add up), and the pose is advanced along the mean of both by the heading in the middle of the tick.
+ * - Fixed point: positions in micrometres, the heading as a binary angle (2^32 a full turn, so it wraps by itself), sine and cosine from a quarter-wave table with linear interpolation.
+ * - The pose and its history are published in one page mapped read-only through /dev/motor_drive, written under a sequence count like the tachometer page, so the readers never take a lock or make a syscall.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/device.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/stat.h>
+
+#include "../control_loop/control_loop.h"
+#include "motor.h"
+#include "motor_odometry.h"
+#include "motor_profile.h"
+
+#define DEVICE_NAME "motor_odometry"
+
+static unsigned int wheel_radius_um = 28000;
+module_param(wheel_radius_um, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(wheel_radius_um, "Radius of the wheels of the drive pair in micrometres");
+
+static unsigned int wheel_base_um = 112000;
+module_param(wheel_base_um, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(wheel_base_um, "Distance between the wheels of the drive pair in micrometres");
+
+static unsigned int history_ticks = 10;
+module_param(history_ticks, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(history_ticks, "Control loop ticks between the poses of the odometry history");
+
+#define ANGLE_PER_RADIAN 683565276LL /* 2^32 / (2 * pi) */
+#define QUARTER_TURN 0x40000000U
+
+/* sin(i * pi / 128) * 32767 */
+static const s32 quarter_sin[65] = {
+  0, 804, 1608, 2410, 3212, 4011, 4808, 5602,
+  6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+  12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+  18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+  23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+  27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+  30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+  32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+  32767,
+};
+
+struct motor_odometry {
+  spinlock_t lock; /* Serialises the writers of the page, the loop and motor_set_pose */
+  int left;
+  int right;
+  bool primed; /* left_um and right_um are valid */
+  s64 left_um; /* Distance of each wheel at the last tick */
+  s64 right_um;
+  unsigned int ticks;
+  struct motor_odometry_page *page; /* Mapped by the applications */
+};
+
+static struct motor_odometry odometry;
+
+/***********************************************************************
+ *
+ * Fixed point trigonometry of binary angles, in units of 1 / 32767
+ *
+ ***********************************************************************/
+static s32 fixed_sin(u32 angle) {
+  u32 quadrant = angle >> 30;
+  u32 within = angle & (QUARTER_TURN - 1);
+  u32 i;
+  u32 frac;
+  s32 value;
+
+  if (quadrant & 1) {
+    within = QUARTER_TURN - within;
+  }
+
+  i = within >> 24;
+  frac = within & 0xFFFFFF;
+  if (i >= 64) {
+    value = quarter_sin[64];
+  } else {
+    value = quarter_sin[i] + (s32) (((s64) (quarter_sin[i + 1] - quarter_sin[i]) * frac) >> 24);
+  }
+
+  return (quadrant & 2 ? -value : value);
+}
+
+static s32 fixed_cos(u32 angle) {
+  return fixed_sin(angle + QUARTER_TURN);
+}
+
+/***********************************************************************
+ *
+ * The dead reckoning, run by control_loop
+ *
+ ***********************************************************************/
+/* Total distance of a wheel in micrometres */
+static s64 wheel_distance(s64 edges) {
+  s64 circumference = div_s64((s64) wheel_radius_um * 6283185, 1000000);
+
+  return div64_s64(edges * circumference, motor_edges_per_rev());
+}
+
+/* Requires the lock of the odometry */
+static void odometry_publish(ktime_t time) {
+  struct motor_odometry_page *page = odometry.page;
+
+  page->pose.time_ns = ktime_to_ns(time);
+
+  if (++odometry.ticks >= history_ticks) {
+    odometry.ticks = 0;
+    page->head = (page->head + 1) % MOTOR_ODOMETRY_HISTORY;
+    page->history[page->head] = page->pose;
+    if (page->count < MOTOR_ODOMETRY_HISTORY) {
+      ++page->count;
+    }
+  }
+}
+
+static void motor_odometry_compute(const struct control_loop_snapshot *snapshot, void *data) {
+  struct motor_odometry_page *page = odometry.page;
+  struct motor_tacho_state left;
+  struct motor_tacho_state right;
+  unsigned long flags;
+  s64 left_um;
+  s64 right_um;
+  s64 distance;
+  s64 turn;
+  u32 middle;
+
+  motor_get_tacho(odometry.left, &left);
+  motor_get_tacho(odometry.right, &right);
+  left_um = wheel_distance(left.position);
+  right_um = wheel_distance(right.position);
+
+  spin_lock_irqsave(&odometry.lock, flags);
+
+  ++page->seq;
+  smp_wmb();
+
+  if (odometry.primed) {
+    distance = ((left_um - odometry.left_um) + (right_um - odometry.right_um)) / 2;
+    turn = div64_s64(((right_um - odometry.right_um) - (left_um - odometry.left_um)) * ANGLE_PER_RADIAN, max_t(s64, wheel_base_um, 1));
+    middle = page->pose.heading + (u32) (s32) (turn / 2);
+
+    page->pose.x += div_s64(distance * fixed_cos(middle), 32767);
+    page->pose.y += div_s64(distance * fixed_sin(middle), 32767);
+    page->pose.heading += (u32) (s32) turn;
+  }
+
+  odometry.left_um = left_um;
+  odometry.right_um = right_um;
+  odometry.primed = true;
+  odometry_publish(snapshot->time);
+
+  smp_wmb();
+  ++page->seq;
+
+  spin_unlock_irqrestore(&odometry.lock, flags);
+}
+
+static struct control_loop_ops motor_odometry_ops = {
+  .name = DEVICE_NAME,
+  .adc_mask = 0,
+  .compute = motor_odometry_compute,
+  .commit = NULL,
+};
+
+/***********************************************************************
+ *
+ * Hooks for the pose from other modules, motor_drive and the
+ * applications
+ *
+ ***********************************************************************/
+void motor_set_pose(const struct motor_pose *pose) {
+  struct motor_odometry_page *page = odometry.page;
+  unsigned long flags;
+
+  spin_lock_irqsave(&odometry.lock, flags);
+
+  ++page->seq;
+  smp_wmb();
+
+  page->pose.x = pose->x;
+  page->pose.y = pose->y;
+  page->pose.heading = pose->heading;
+  page->count = 0;
+  odometry.ticks = 0;
+
+  smp_wmb();
+  ++page->seq;
+
+  spin_unlock_irqrestore(&odometry.lock, flags);
+}
+EXPORT_SYMBOL(motor_set_pose);
+
+void motor_get_pose(struct motor_pose *pose) {
+  struct motor_odometry_page *page = odometry.page;
+  u32 seq;
+
+  do {
+    seq = ACCESS_ONCE(page->seq);
+    smp_rmb();
+    *pose = page->pose;
+    smp_rmb();
+  } while ((seq & 1) || seq != ACCESS_ONCE(page->seq));
+}
+EXPORT_SYMBOL(motor_get_pose);
+
+/* The page is only mapped read-only */
+int motor_odometry_mmap(struct vm_area_struct *vma) {
+  if ((vma->vm_flags & VM_WRITE) || vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+    return -EINVAL;
+  }
+
+  /* Nor can it be made writable by mprotect() later */
+  vma->vm_flags &= ~VM_MAYWRITE;
+
+  return vm_insert_page(vma, vma->vm_start, virt_to_page(odometry.page));
+}
+
+/***********************************************************************
+ *
+ * Sysfs entry of the odometry, added to the motor_drive device
+ *
+ ***********************************************************************/
+/* "<x in um> <y in um> <heading in millidegrees>" */
+static ssize_t odometry_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor_pose pose;
+
+  motor_get_pose(&pose);
+
+  return scnprintf(buf, PAGE_SIZE, "%lld %lld %u\n", pose.x, pose.y, (u32) (((u64) pose.heading * 360000) >> 32));
+}
+
+/* Takes "<x in um> <y in um> <heading in millidegrees>", or "reset" for the origin */
+static ssize_t odometry_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  struct motor_pose pose;
+  long long x;
+  long long y;
+  int heading;
+
+  memset(&pose, 0, sizeof(pose));
+
+  if (strncmp(buf, "reset", 5) != 0) {
+    if (sscanf(buf, "%lld %lld %d", &x, &y, &heading) != 3) {
+      return -EINVAL;
+    }
+
+    pose.x = x;
+    pose.y = y;
+    pose.heading = (u32) div_s64((s64) heading << 32, 360000);
+  }
+
+  motor_set_pose(&pose);
+
+  return count;
+}
+
+DEVICE_ATTR(odometry, (S_IRUGO | S_IWUSR), odometry_show, odometry_store);
+
+/***********************************************************************
+ *
+ * Initialisation and uninitialisation, called by motor_drive with the
+ * motors of the drive pair and its device
+ *
+ ***********************************************************************/
+int motor_odometry_init(int left, int right, struct device *dev) {
+  odometry.page = (struct motor_odometry_page *) get_zeroed_page(GFP_KERNEL);
+  if (!odometry.page) {
+    goto init_fail_1;
+  }
+
+  spin_lock_init(&odometry.lock);
+  odometry.left = left;
+  odometry.right = right;
+  odometry.primed = false;
+
+  if (device_create_file(dev, &dev_attr_odometry)) {
+    printk(KERN_ERR DEVICE_NAME ": device_create_file(odometry) failed\n");
+    goto init_fail_2;
+  }
+
+  if (control_loop_register(&motor_odometry_ops) != 0) {
+    printk(KERN_ERR DEVICE_NAME ": control_loop_register failed\n");
+    goto init_fail_3;
+  }
+
+  return 0;
+
+ init_fail_3:
+  device_remove_file(dev, &dev_attr_odometry);
+
+ init_fail_2:
+  free_page((unsigned long) odometry.page);
+
+ init_fail_1:
+  return -1;
+}
+
+/* A mapping still existing keeps its own reference on the page */
+void motor_odometry_exit(struct device *dev) {
+  control_loop_unregister(&motor_odometry_ops);
+  device_remove_file(dev, &dev_attr_odometry);
+  free_page((unsigned long) odometry.page);
+}
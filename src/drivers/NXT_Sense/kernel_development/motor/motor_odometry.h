@@ -0,0 +1,9 @@
+#ifndef __H_motor_odometry_h_
+#define __H_motor_odometry_h_
+
+/* The odometry of the drive pair, only used from within motor_drive */
+extern int motor_odometry_init(int, int, struct device *);
+extern void motor_odometry_exit(struct device *);
+extern int motor_odometry_mmap(struct vm_area_struct *);
+
+#endif
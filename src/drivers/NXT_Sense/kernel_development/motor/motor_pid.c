@@ -0,0 +1,495 @@
+/* Notes:
+ * - Every motor has a speed and a position PID controller, the mode of the motor selecting which one (if any) sets its speed. The controllers run as one callback of control_loop: compute reads the tachometers and computes the outputs, commit sets the speeds of all the controlled motors together.
+ * - The speed is the velocity estimated by motor_tacho.c from the edge times, not the edges counted per tick, so slow speeds are controlled smoothly at the same tick rate.
+ * - Fixed point: the gains are in thousandths, the integral is kept in error * milliseconds and the derivative is taken of the measurement (not the error), so a new setpoint does not kick the output.
+ * - Anti-windup by conditional integration: the error is not integrated while the output is saturated in the direction of the error.
+ * - Braking (MOTOR_MODE_BRAKE) runs the speed controller to 0 until the measured speed is at most brake_speed, then releases the motor, so it brakes with the reverse torque of the bridge whatever ENABLE off does. Holding is the position controller at the position where the motor stopped.
+ * - The setters only take a spinlock, so other control_loop callbacks (and atomic context) can steer the motors.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/stat.h>
+
+#include "../control_loop/control_loop.h"
+#include "motor.h"
+#include "motor_pid.h"
+#include "motor_profile.h"
+#include "motor_drive.h"
+
+#define DEVICE_NAME "motor_pid"
+
+#define PID_SPEED 0
+#define PID_POSITION 1
+#define NUMBER_OF_PIDS 2
+
+static unsigned int brake_speed = 20;
+module_param(brake_speed, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(brake_speed, "Speed in tachometer edges per second below which a braking motor is stopped");
+
+/* Gains for a NXT motor counting about 720 edges per revolution */
+static const struct motor_pid_gains default_gains[NUMBER_OF_PIDS] = {
+  {MOTOR_MODE_SPEED, 500, 2000, 0},
+  {MOTOR_MODE_POSITION, 5000, 0, 50},
+};
+
+struct motor_pid {
+  spinlock_t lock;
+  int mode;
+  s64 setpoint;
+  struct motor_pid_gains gains[NUMBER_OF_PIDS];
+  bool primed; /* last_time is valid */
+  bool measured_valid; /* last_measured is valid */
+  s64 last_measured;
+  ktime_t last_time;
+  s64 integral; /* Of the error over milliseconds */
+  s64 measured;
+  s64 error;
+  int output;
+  bool stopped; /* Braking is done, commit stops the motor */
+  int stop_mode; /* Of MOTOR_STOP_DEFAULT */
+};
+
+static struct motor_pid motor_pid[NUMBER_OF_MOTORS];
+
+static const char *mode_name[] = {"open", "speed", "position", "brake"};
+static const char *stop_mode_name[] = {"coast", "brake", "hold", "default"};
+
+/***********************************************************************
+ *
+ * The controllers, run by control_loop
+ *
+ ***********************************************************************/
+static s64 pid_output(const struct motor_pid_gains *gains, s64 error, s64 integral, s64 derivative) {
+  return div_s64(gains->kp * error + div_s64(gains->ki * integral, MSEC_PER_SEC) + gains->kd * derivative, 1000);
+}
+
+/* Requires the lock of the controller. The speed is in edges per second */
+static void pid_step(struct motor_pid *pid, s64 position, s64 speed, ktime_t now) {
+  const struct motor_pid_gains *gains = &pid->gains[pid->mode == MOTOR_MODE_POSITION ? PID_POSITION : PID_SPEED];
+  s64 dt_us = ktime_us_delta(now, pid->last_time);
+  s64 derivative;
+  s64 integral;
+  s64 output;
+
+  if (!pid->primed || dt_us <= 0) {
+    pid->last_time = now;
+    pid->primed = true;
+    pid->measured_valid = false;
+    return;
+  }
+
+  pid->measured = (pid->mode == MOTOR_MODE_POSITION ? position : speed);
+  pid->error = pid->setpoint - pid->measured;
+  /* The derivative of the position is the estimated speed */
+  if (pid->mode == MOTOR_MODE_POSITION) {
+    derivative = -speed;
+  } else {
+    derivative = (pid->measured_valid ? -div_s64((pid->measured - pid->last_measured) * USEC_PER_SEC, dt_us) : 0);
+  }
+
+  integral = pid->integral + div_s64(pid->error * dt_us, USEC_PER_MSEC);
+  output = pid_output(gains, pid->error, integral, derivative);
+
+  if ((output > MOTOR_SPEED_MAX && pid->error > 0) || (output < -MOTOR_SPEED_MAX && pid->error < 0)) {
+    output = pid_output(gains, pid->error, pid->integral, derivative);
+  } else {
+    pid->integral = integral;
+  }
+
+  pid->output = (int) clamp_t(s64, output, -MOTOR_SPEED_MAX, MOTOR_SPEED_MAX);
+  pid->last_measured = pid->measured;
+  pid->measured_valid = true;
+  pid->last_time = now;
+}
+
+static void motor_pid_compute(const struct control_loop_snapshot *snapshot, void *data) {
+  struct motor_tacho_state tacho;
+  struct motor_velocity velocity;
+  struct motor_pid *pid;
+  unsigned long flags;
+  int i;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    pid = &motor_pid[i];
+
+    motor_get_tacho(i, &tacho);
+    motor_get_velocity(i, &velocity);
+
+    spin_lock_irqsave(&pid->lock, flags);
+    if (pid->mode != MOTOR_MODE_OPEN) {
+      pid_step(pid, tacho.position, div_s64(velocity.velocity, 1000), snapshot->time);
+    }
+    if (pid->mode == MOTOR_MODE_BRAKE && pid->measured_valid && abs64(pid->measured) <= brake_speed) {
+      pid->mode = MOTOR_MODE_OPEN;
+      pid->output = 0;
+      pid->stopped = true;
+    }
+    spin_unlock_irqrestore(&pid->lock, flags);
+  }
+}
+
+/* The speed is set under the lock of the controller, so a motor released in between (e.g. by motor_stop()) is not driven with the stale output */
+static void motor_pid_commit(void *data) {
+  struct motor_pid *pid;
+  unsigned long flags;
+  int i;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    pid = &motor_pid[i];
+
+    spin_lock_irqsave(&pid->lock, flags);
+    if ((pid->mode != MOTOR_MODE_OPEN && pid->primed) || pid->stopped) {
+      motor_set_speed(i, pid->output);
+    }
+    pid->stopped = false;
+    spin_unlock_irqrestore(&pid->lock, flags);
+  }
+}
+
+static struct control_loop_ops motor_pid_ops = {
+  .name = DEVICE_NAME,
+  .adc_mask = 0,
+  .compute = motor_pid_compute,
+  .commit = motor_pid_commit,
+};
+
+/***********************************************************************
+ *
+ * Hooks for setting the controllers from other modules and motor_core
+ *
+ ***********************************************************************/
+int motor_set_control(int motor, int mode, s64 setpoint) {
+  struct motor_pid *pid;
+  unsigned long flags;
+  bool release;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS || mode < MOTOR_MODE_OPEN || mode > MOTOR_MODE_BRAKE) {
+    return -EINVAL;
+  }
+
+  pid = &motor_pid[motor];
+
+  spin_lock_irqsave(&pid->lock, flags);
+  release = (mode == MOTOR_MODE_OPEN && pid->mode != MOTOR_MODE_OPEN);
+  pid->stopped = false;
+  if (mode != pid->mode) {
+    pid->mode = mode;
+    pid->primed = false;
+    pid->integral = 0;
+    pid->output = 0;
+  }
+  pid->setpoint = setpoint;
+  spin_unlock_irqrestore(&pid->lock, flags);
+
+  /* A motor released by its controller stops */
+  if (release) {
+    motor_set_speed(motor, 0);
+  }
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_set_control);
+
+/* Applies a stop mode, leaving the profile and the drive pair to the caller. Requires no locks of the controllers */
+int motor_pid_stop(int motor, int mode) {
+  struct motor_tacho_state tacho;
+  unsigned long flags;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS || mode < MOTOR_STOP_COAST || mode > MOTOR_STOP_DEFAULT) {
+    return -EINVAL;
+  }
+
+  if (mode == MOTOR_STOP_DEFAULT) {
+    spin_lock_irqsave(&motor_pid[motor].lock, flags);
+    mode = motor_pid[motor].stop_mode;
+    spin_unlock_irqrestore(&motor_pid[motor].lock, flags);
+  }
+
+  switch (mode) {
+  case MOTOR_STOP_BRAKE:
+    return motor_set_control(motor, MOTOR_MODE_BRAKE, 0);
+  case MOTOR_STOP_HOLD:
+    motor_get_tacho(motor, &tacho);
+    return motor_set_control(motor, MOTOR_MODE_POSITION, tacho.position);
+  default:
+    motor_set_control(motor, MOTOR_MODE_OPEN, 0);
+    return motor_set_speed(motor, 0);
+  }
+}
+
+int motor_pid_get_stop_mode(int motor) {
+  struct motor_pid *pid = &motor_pid[motor];
+  unsigned long flags;
+  int mode;
+
+  spin_lock_irqsave(&pid->lock, flags);
+  mode = pid->stop_mode;
+  spin_unlock_irqrestore(&pid->lock, flags);
+
+  return mode;
+}
+
+int motor_set_gains(int motor, const struct motor_pid_gains *gains) {
+  struct motor_pid *pid;
+  unsigned long flags;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS || (gains->mode != MOTOR_MODE_SPEED && gains->mode != MOTOR_MODE_POSITION)) {
+    return -EINVAL;
+  }
+
+  pid = &motor_pid[motor];
+
+  spin_lock_irqsave(&pid->lock, flags);
+  pid->gains[gains->mode == MOTOR_MODE_SPEED ? PID_SPEED : PID_POSITION] = *gains;
+  spin_unlock_irqrestore(&pid->lock, flags);
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_set_gains);
+
+int motor_get_pid(int motor, struct motor_pid_status *status) {
+  struct motor_pid *pid;
+  unsigned long flags;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS) {
+    return -EINVAL;
+  }
+
+  pid = &motor_pid[motor];
+
+  spin_lock_irqsave(&pid->lock, flags);
+  status->mode = pid->mode;
+  status->output = pid->output;
+  status->setpoint = pid->setpoint;
+  status->measured = pid->measured;
+  status->error = pid->error;
+  spin_unlock_irqrestore(&pid->lock, flags);
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_get_pid);
+
+/***********************************************************************
+ *
+ * Sysfs entries of the controllers, added to the motor devices. The
+ * minor number of a motor device is the number of the motor
+ *
+ ***********************************************************************/
+static ssize_t control_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor_pid_status status;
+
+  motor_get_pid(MINOR(dev->devt), &status);
+
+  return scnprintf(buf, PAGE_SIZE, "%s %lld\n", mode_name[status.mode], status.setpoint);
+}
+
+/* Takes "open", "speed <edges per second>", "position <edges>" or "brake" */
+static ssize_t control_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  char mode[10];
+  long long setpoint = 0;
+  int res;
+  int i;
+
+  res = sscanf(buf, "%9s %lld", mode, &setpoint);
+  if (res < 1) {
+    return -EINVAL;
+  }
+
+  for (i = MOTOR_MODE_OPEN; i <= MOTOR_MODE_BRAKE; ++i) {
+    if (strcmp(mode, mode_name[i]) == 0) {
+      break;
+    }
+  }
+
+  if (i > MOTOR_MODE_BRAKE || ((i == MOTOR_MODE_SPEED || i == MOTOR_MODE_POSITION) && res != 2)) {
+    return -EINVAL;
+  }
+
+  motor_drive_release(MINOR(dev->devt));
+  motor_profile_release(MINOR(dev->devt));
+  res = motor_set_control(MINOR(dev->devt), i, setpoint);
+
+  return (res == 0 ? count : res);
+}
+
+static ssize_t gains_show(struct device *dev, char *buf, int which) {
+  struct motor_pid *pid = &motor_pid[MINOR(dev->devt)];
+  struct motor_pid_gains gains;
+  unsigned long flags;
+
+  spin_lock_irqsave(&pid->lock, flags);
+  gains = pid->gains[which];
+  spin_unlock_irqrestore(&pid->lock, flags);
+
+  return scnprintf(buf, PAGE_SIZE, "%d %d %d\n", gains.kp, gains.ki, gains.kd);
+}
+
+/* Takes "<kp> <ki> <kd>" in thousandths */
+static ssize_t gains_store(struct device *dev, const char *buf, size_t count, int which) {
+  struct motor_pid_gains gains;
+  int res;
+
+  if (sscanf(buf, "%d %d %d", &gains.kp, &gains.ki, &gains.kd) != 3) {
+    return -EINVAL;
+  }
+
+  gains.mode = (which == PID_SPEED ? MOTOR_MODE_SPEED : MOTOR_MODE_POSITION);
+  res = motor_set_gains(MINOR(dev->devt), &gains);
+
+  return (res == 0 ? count : res);
+}
+
+static ssize_t gains_speed_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  return gains_show(dev, buf, PID_SPEED);
+}
+
+static ssize_t gains_speed_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  return gains_store(dev, buf, count, PID_SPEED);
+}
+
+static ssize_t gains_position_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  return gains_show(dev, buf, PID_POSITION);
+}
+
+static ssize_t gains_position_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  return gains_store(dev, buf, count, PID_POSITION);
+}
+
+/* "<mode> <setpoint> <measured> <error> <output>" */
+static ssize_t pid_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor_pid_status status;
+
+  motor_get_pid(MINOR(dev->devt), &status);
+
+  return scnprintf(buf, PAGE_SIZE, "%s %lld %lld %lld %d\n", mode_name[status.mode], status.setpoint, status.measured, status.error, status.output);
+}
+
+static int stop_mode_parse(const char *buf) {
+  char mode[10];
+  int i;
+
+  if (sscanf(buf, "%9s", mode) != 1) {
+    return MOTOR_STOP_DEFAULT;
+  }
+
+  for (i = MOTOR_STOP_COAST; i <= MOTOR_STOP_DEFAULT; ++i) {
+    if (strcmp(mode, stop_mode_name[i]) == 0) {
+      return i;
+    }
+  }
+
+  return -EINVAL;
+}
+
+static ssize_t stop_mode_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  return scnprintf(buf, PAGE_SIZE, "%s\n", stop_mode_name[motor_pid_get_stop_mode(MINOR(dev->devt))]);
+}
+
+/* Takes "coast", "brake" or "hold" */
+static ssize_t stop_mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  struct motor_pid *pid = &motor_pid[MINOR(dev->devt)];
+  unsigned long flags;
+  int mode = stop_mode_parse(buf);
+
+  if (mode < 0 || mode == MOTOR_STOP_DEFAULT) {
+    return -EINVAL;
+  }
+
+  spin_lock_irqsave(&pid->lock, flags);
+  pid->stop_mode = mode;
+  spin_unlock_irqrestore(&pid->lock, flags);
+
+  return count;
+}
+
+/* Takes "coast", "brake", "hold" or nothing for the stop mode of the motor */
+static ssize_t stop_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  int mode = stop_mode_parse(buf);
+  int res;
+
+  if (mode < 0) {
+    return mode;
+  }
+
+  res = motor_stop(MINOR(dev->devt), mode);
+
+  return (res == 0 ? count : res);
+}
+
+DEVICE_ATTR(control, (S_IRUGO | S_IWUSR), control_show, control_store);
+DEVICE_ATTR(gains_speed, (S_IRUGO | S_IWUSR), gains_speed_show, gains_speed_store);
+DEVICE_ATTR(gains_position, (S_IRUGO | S_IWUSR), gains_position_show, gains_position_store);
+DEVICE_ATTR(pid, S_IRUGO, pid_show, NULL);
+DEVICE_ATTR(stop_mode, (S_IRUGO | S_IWUSR), stop_mode_show, stop_mode_store);
+DEVICE_ATTR(stop, S_IWUSR, NULL, stop_store);
+
+static struct device_attribute *motor_pid_attrs[] = {
+  &dev_attr_control,
+  &dev_attr_gains_speed,
+  &dev_attr_gains_position,
+  &dev_attr_pid,
+  &dev_attr_stop_mode,
+  &dev_attr_stop,
+};
+
+int motor_pid_create_files(struct device *dev) {
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(motor_pid_attrs); ++i) {
+    if (device_create_file(dev, motor_pid_attrs[i])) {
+      printk(KERN_ERR DEVICE_NAME ": device_create_file(%s) failed\n", motor_pid_attrs[i]->attr.name);
+      goto create_files_fail;
+    }
+  }
+
+  return 0;
+
+ create_files_fail:
+  while (--i >= 0) {
+    device_remove_file(dev, motor_pid_attrs[i]);
+  }
+  return -1;
+}
+
+void motor_pid_remove_files(struct device *dev) {
+  int i;
+
+  for (i = ARRAY_SIZE(motor_pid_attrs) - 1; i >= 0; --i) {
+    device_remove_file(dev, motor_pid_attrs[i]);
+  }
+}
+
+/***********************************************************************
+ *
+ * Initialisation and uninitialisation, called by motor_core
+ *
+ ***********************************************************************/
+/* The callback stays registered, compute skipping the motors without a controller, so the setters never have to (un)register it */
+int motor_pid_init(void) {
+  int i;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    spin_lock_init(&motor_pid[i].lock);
+    motor_pid[i].mode = MOTOR_MODE_OPEN;
+    motor_pid[i].stop_mode = MOTOR_STOP_COAST;
+    memcpy(motor_pid[i].gains, default_gains, sizeof(default_gains));
+  }
+
+  if (control_loop_register(&motor_pid_ops) != 0) {
+    printk(KERN_ERR DEVICE_NAME ": control_loop_register failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void motor_pid_exit(void) {
+  control_loop_unregister(&motor_pid_ops);
+}
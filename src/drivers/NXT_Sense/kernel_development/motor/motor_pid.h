@@ -0,0 +1,12 @@
+#ifndef __H_motor_pid_h_
+#define __H_motor_pid_h_
+
+/* The closed-loop controllers of the motors, only used from within motor_core and motor_profile */
+extern int motor_pid_init(void);
+extern void motor_pid_exit(void);
+extern int motor_pid_create_files(struct device *);
+extern void motor_pid_remove_files(struct device *);
+extern int motor_pid_stop(int, int);
+extern int motor_pid_get_stop_mode(int);
+
+#endif
@@ -0,0 +1,597 @@
+/* Notes:
+ * - Every motor has a queue of motion segments, run by a control_loop callback which moves the setpoint of the position controller (motor_pid.c) every tick, so the applications queue whole trajectories instead of streaming setpoints.
+ * - The profile is generated online: the velocity goes towards the cruise velocity, limited to the velocity from which the motor can still stop at the target (sqrt(2 * accel * distance)), changing by at most accel per tick. This gives the trapezoid, or the triangle of a short move, and also works when a segment starts while moving.
+ * - A rotate segment is turned into a position segment when it starts, the commands into segments when they are queued, using edges_per_rev.
+ * - Fixed point: the position of the profile is in millionths of an edge, the velocity in thousandths of an edge per second.
+ * - The callback is registered before the one of the controllers, so the controllers use the setpoint of the same tick.
+ * - Lock order: the drive pair, then a profile, then a controller, then a motor (motor_set_speed()). Releasing a motor (motor_profile_release) aborts its segments.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/stat.h>
+
+#include "../control_loop/control_loop.h"
+#include "motor.h"
+#include "motor_profile.h"
+#include "motor_pid.h"
+#include "motor_drive.h"
+
+#define DEVICE_NAME "motor_profile"
+
+#define MICRO_EDGES 1000000LL
+/* Largest target of a segment, so target * MICRO_EDGES fits into an s64 also after a rotate segment added the position it starts from */
+#define MOTOR_TARGET_MAX (LLONG_MAX / MICRO_EDGES / 2)
+#define MOTOR_EVENT_RING 32
+
+static unsigned int edges_per_rev = 720;
+module_param(edges_per_rev, uint, S_IRUGO);
+MODULE_PARM_DESC(edges_per_rev, "Tachometer edges per revolution of the output shaft, for the commands in degrees");
+
+static unsigned int command_accel = 8000;
+module_param(command_accel, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(command_accel, "Acceleration of the commands in edges per second squared");
+
+struct motor_profile {
+  spinlock_t lock;
+  wait_queue_head_t wait;
+  struct motor_segment queue[MOTOR_PROFILE_QUEUE];
+  unsigned int head;
+  unsigned int count;
+  bool active; /* The profile has the motor */
+  int stop; /* The stop mode applied when the profile ends */
+  bool started; /* The segment at the head started at start_time */
+  ktime_t start_time;
+  s64 position; /* Of the profile, in millionths of an edge */
+  s64 velocity; /* In thousandths of an edge per second */
+  ktime_t last_time;
+  struct motor_event events[MOTOR_EVENT_RING];
+  unsigned int event_head;
+  unsigned int event_count;
+};
+
+static struct motor_profile motor_profile[NUMBER_OF_MOTORS];
+
+/***********************************************************************
+ *
+ * Events
+ *
+ ***********************************************************************/
+/* Requires the lock of the profile. A full ring drops the oldest event */
+static void profile_event(struct motor_profile *p, int motor, u32 id, int type, ktime_t time) {
+  struct motor_tacho_state tacho;
+  struct motor_event *e;
+
+  if (p->event_count == MOTOR_EVENT_RING) {
+    p->event_head = (p->event_head + 1) % MOTOR_EVENT_RING;
+    --p->event_count;
+  }
+
+  motor_get_tacho(motor, &tacho);
+
+  e = &p->events[(p->event_head + p->event_count) % MOTOR_EVENT_RING];
+  e->id = id;
+  e->type = type;
+  e->position = tacho.position;
+  e->time_ns = ktime_to_ns(time);
+  ++p->event_count;
+}
+
+/* Requires the lock of the profile */
+static void profile_abort(struct motor_profile *p, int motor) {
+  ktime_t now = ktime_get();
+
+  while (p->count > 0) {
+    profile_event(p, motor, p->queue[p->head].id, MOTOR_EVENT_ABORTED, now);
+    p->head = (p->head + 1) % MOTOR_PROFILE_QUEUE;
+    --p->count;
+  }
+
+  p->active = false;
+  p->started = false;
+}
+
+/***********************************************************************
+ *
+ * The profiles, run by control_loop
+ *
+ ***********************************************************************/
+static s64 ramp(s64 velocity, s64 target, s64 step) {
+  if (velocity < target) {
+    return min(velocity + step, target);
+  }
+  return max(velocity - step, target);
+}
+
+/* Returns true when the segment is done */
+static bool profile_step_position(struct motor_profile *p, const struct motor_segment *seg, s64 dt_us) {
+  s64 distance = seg->target * MICRO_EDGES - p->position;
+  s64 dv = div_s64((s64) seg->accel * dt_us, 1000);
+  u64 stop_sq = 2 * (u64) seg->accel * div_u64(abs64(distance), MICRO_EDGES);
+  s64 limit = (s64) seg->velocity * 1000;
+  s64 stop;
+  s64 step;
+
+  stop = (s64) int_sqrt((unsigned long) min_t(u64, stop_sq, ULONG_MAX)) * 1000;
+  limit = min(limit, stop);
+
+  p->velocity = ramp(p->velocity, (distance < 0 ? -limit : limit), dv);
+  step = div_s64(p->velocity * dt_us, 1000);
+
+  /* Reaching (or passing) the target within this tick, or creeping within the last edge */
+  if ((step != 0 && (step < 0) == (distance < 0) && abs64(step) >= abs64(distance)) || (abs64(distance) < MICRO_EDGES && abs64(p->velocity) <= dv)) {
+    p->position = seg->target * MICRO_EDGES;
+    p->velocity = 0;
+    return true;
+  }
+
+  p->position += step;
+  return false;
+}
+
+/* Returns true when the segment is done */
+static bool profile_step_velocity(struct motor_profile *p, const struct motor_segment *seg, s64 dt_us, ktime_t now) {
+  s64 target = (s64) seg->velocity * 1000;
+
+  p->velocity = ramp(p->velocity, target, div_s64((s64) seg->accel * dt_us, 1000));
+  p->position += div_s64(p->velocity * dt_us, 1000);
+
+  if (seg->duration_ms == 0) {
+    return (p->velocity == target && p->count > 1);
+  }
+
+  return (ktime_us_delta(now, p->start_time) >= (s64) seg->duration_ms * USEC_PER_MSEC);
+}
+
+/* The end of a segment, MOTOR_END_STOP taking the stop mode of the motor */
+static int profile_end(int motor, const struct motor_segment *seg) {
+  if (seg->end != MOTOR_END_STOP) {
+    return seg->end;
+  }
+
+  switch (motor_pid_get_stop_mode(motor)) {
+  case MOTOR_STOP_BRAKE:
+    return MOTOR_END_BRAKE;
+  case MOTOR_STOP_HOLD:
+    return MOTOR_END_HOLD;
+  default:
+    return MOTOR_END_COAST;
+  }
+}
+
+/* Requires the lock of the profile. Returns true when a segment is done */
+static bool profile_step(struct motor_profile *p, int motor, const struct control_loop_snapshot *snapshot) {
+  struct motor_segment *seg;
+  s64 dt_us = ktime_us_delta(snapshot->time, p->last_time);
+  bool done;
+  int end;
+
+  /* A late tick does not jump the setpoint */
+  dt_us = clamp_t(s64, dt_us, 0, 2 * (s64) snapshot->period_us);
+  p->last_time = snapshot->time;
+
+  if (p->count == 0) {
+    p->position += div_s64(p->velocity * dt_us, 1000);
+    return false;
+  }
+
+  seg = &p->queue[p->head];
+  if (!p->started) {
+    p->started = true;
+    p->start_time = snapshot->time;
+    if (seg->type == MOTOR_SEGMENT_ROTATE) {
+      seg->type = MOTOR_SEGMENT_POSITION;
+      seg->target += div_s64(p->position + (p->position < 0 ? -MICRO_EDGES : MICRO_EDGES) / 2, MICRO_EDGES);
+    }
+  }
+
+  if (seg->type == MOTOR_SEGMENT_POSITION) {
+    done = profile_step_position(p, seg, dt_us);
+  } else {
+    done = profile_step_velocity(p, seg, dt_us, snapshot->time);
+  }
+
+  if (done) {
+    profile_event(p, motor, seg->id, MOTOR_EVENT_DONE, snapshot->time);
+    p->head = (p->head + 1) % MOTOR_PROFILE_QUEUE;
+    --p->count;
+    p->started = false;
+
+    end = profile_end(motor, seg);
+    if (end == MOTOR_END_HOLD || end == MOTOR_END_BRAKE) {
+      p->velocity = 0;
+    }
+    if ((end == MOTOR_END_BRAKE || end == MOTOR_END_COAST) && p->count == 0) {
+      p->active = false;
+      p->stop = (end == MOTOR_END_BRAKE ? MOTOR_STOP_BRAKE : MOTOR_STOP_COAST);
+    }
+  }
+
+  return done;
+}
+
+/* The setpoint is set with the lock held, so a motor released meanwhile is not taken again. A profile ending in brake or coast stops the motor with it */
+static void motor_profile_compute(const struct control_loop_snapshot *snapshot, void *data) {
+  struct motor_profile *p;
+  unsigned long flags;
+  bool wake;
+  int i;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    p = &motor_profile[i];
+
+    spin_lock_irqsave(&p->lock, flags);
+    wake = false;
+    if (p->active) {
+      wake = profile_step(p, i, snapshot);
+      if (p->active) {
+        motor_set_control(i, MOTOR_MODE_POSITION, div_s64(p->position, MICRO_EDGES));
+      } else {
+        motor_pid_stop(i, p->stop);
+      }
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+
+    if (wake) {
+      wake_up_interruptible(&p->wait);
+    }
+  }
+}
+
+static struct control_loop_ops motor_profile_ops = {
+  .name = DEVICE_NAME,
+  .adc_mask = 0,
+  .compute = motor_profile_compute,
+  .commit = NULL,
+};
+
+/***********************************************************************
+ *
+ * Hooks for queueing segments from other modules and motor_core
+ *
+ ***********************************************************************/
+int motor_queue_segment(int motor, const struct motor_segment *segment) {
+  struct motor_tacho_state tacho;
+  struct motor_profile *p;
+  unsigned long flags;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS || segment->accel <= 0 || segment->end > MOTOR_END_STOP) {
+    return -EINVAL;
+  }
+
+  if ((segment->type == MOTOR_SEGMENT_POSITION || segment->type == MOTOR_SEGMENT_ROTATE) ? segment->velocity <= 0 : segment->type != MOTOR_SEGMENT_VELOCITY) {
+    return -EINVAL;
+  }
+
+  if (segment->target > MOTOR_TARGET_MAX || segment->target < -MOTOR_TARGET_MAX) {
+    return -EINVAL;
+  }
+
+  p = &motor_profile[motor];
+
+  /* Before taking the lock of the profile, see the lock order */
+  motor_drive_release(motor);
+  motor_get_tacho(motor, &tacho);
+
+  spin_lock_irqsave(&p->lock, flags);
+
+  if (p->count == MOTOR_PROFILE_QUEUE) {
+    spin_unlock_irqrestore(&p->lock, flags);
+    return -EAGAIN;
+  }
+
+  if (!p->active) {
+    p->active = true;
+    p->started = false;
+    p->position = tacho.position * MICRO_EDGES;
+    p->velocity = 0;
+    p->last_time = ktime_get();
+  }
+
+  p->queue[(p->head + p->count) % MOTOR_PROFILE_QUEUE] = *segment;
+  ++p->count;
+
+  spin_unlock_irqrestore(&p->lock, flags);
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_queue_segment);
+
+/* At least 1, as the odometry divides by it */
+unsigned int motor_edges_per_rev(void) {
+  return max(edges_per_rev, 1U);
+}
+
+/* Degrees of the output shaft to edges */
+static s64 degrees_to_edges(s64 degrees) {
+  return div_s64(degrees * edges_per_rev, 360);
+}
+
+int motor_command(int motor, const struct motor_command *command) {
+  struct motor_segment segment;
+
+  memset(&segment, 0, sizeof(segment));
+  segment.id = command->id;
+  segment.accel = command_accel;
+  segment.end = command->end;
+
+  switch (command->type) {
+  case MOTOR_COMMAND_ROTATE:
+    segment.type = MOTOR_SEGMENT_ROTATE;
+    segment.target = degrees_to_edges(command->degrees);
+    segment.velocity = (s32) degrees_to_edges(abs(command->speed));
+    break;
+  case MOTOR_COMMAND_RUN:
+    if (command->duration_ms == 0) {
+      return -EINVAL;
+    }
+    segment.type = MOTOR_SEGMENT_VELOCITY;
+    segment.velocity = (s32) degrees_to_edges(command->speed);
+    segment.duration_ms = command->duration_ms;
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  return motor_queue_segment(motor, &segment);
+}
+EXPORT_SYMBOL(motor_command);
+
+int motor_flush(int motor) {
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS) {
+    return -EINVAL;
+  }
+
+  motor_profile_release(motor);
+
+  return motor_set_control(motor, MOTOR_MODE_OPEN, 0);
+}
+EXPORT_SYMBOL(motor_flush);
+
+/* Aborts the segments, the motor is left as it is */
+void motor_profile_release(int motor) {
+  struct motor_profile *p = &motor_profile[motor];
+  unsigned long flags;
+  bool wake;
+
+  spin_lock_irqsave(&p->lock, flags);
+  wake = p->active;
+  if (p->active) {
+    profile_abort(p, motor);
+  }
+  spin_unlock_irqrestore(&p->lock, flags);
+
+  if (wake) {
+    wake_up_interruptible(&p->wait);
+  }
+}
+
+/* Reports a stall of the motor with the id of the running segment (0 without one), then aborts the segments */
+void motor_profile_stall(int motor) {
+  struct motor_profile *p = &motor_profile[motor];
+  unsigned long flags;
+
+  spin_lock_irqsave(&p->lock, flags);
+  profile_event(p, motor, (p->active && p->count > 0 ? p->queue[p->head].id : 0), MOTOR_EVENT_STALLED, ktime_get());
+  if (p->active) {
+    profile_abort(p, motor);
+  }
+  spin_unlock_irqrestore(&p->lock, flags);
+
+  wake_up_interruptible(&p->wait);
+}
+
+/* Takes the oldest event, waiting for one unless nonblock */
+int motor_profile_get_event(int motor, struct motor_event *event, bool nonblock) {
+  struct motor_profile *p = &motor_profile[motor];
+  unsigned long flags;
+
+  for (;;) {
+    spin_lock_irqsave(&p->lock, flags);
+    if (p->event_count > 0) {
+      *event = p->events[p->event_head];
+      p->event_head = (p->event_head + 1) % MOTOR_EVENT_RING;
+      --p->event_count;
+      spin_unlock_irqrestore(&p->lock, flags);
+      return 0;
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+
+    if (nonblock) {
+      return -EAGAIN;
+    }
+
+    if (wait_event_interruptible(p->wait, ACCESS_ONCE(p->event_count) > 0)) {
+      return -ERESTARTSYS;
+    }
+  }
+}
+
+unsigned int motor_profile_poll(int motor, struct file *filp, poll_table *wait) {
+  struct motor_profile *p = &motor_profile[motor];
+  unsigned int mask = 0;
+  unsigned long flags;
+
+  poll_wait(filp, &p->wait, wait);
+
+  spin_lock_irqsave(&p->lock, flags);
+  if (p->event_count > 0) {
+    mask |= POLLIN | POLLRDNORM;
+  }
+  if (p->count < MOTOR_PROFILE_QUEUE) {
+    mask |= POLLOUT | POLLWRNORM;
+  }
+  spin_unlock_irqrestore(&p->lock, flags);
+
+  return mask;
+}
+
+/***********************************************************************
+ *
+ * Sysfs entry of the profile, added to the motor devices. The minor
+ * number of a motor device is the number of the motor
+ *
+ ***********************************************************************/
+/* "<queued segments> <id of the running segment or -1> <position> <velocity> <events>" */
+static ssize_t profile_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor_profile *p = &motor_profile[MINOR(dev->devt)];
+  unsigned long flags;
+  unsigned int count;
+  long long id;
+  s64 position;
+  s64 velocity;
+  unsigned int events;
+
+  spin_lock_irqsave(&p->lock, flags);
+  count = p->count;
+  id = (p->count > 0 ? (long long) p->queue[p->head].id : -1);
+  position = div_s64(p->position, MICRO_EDGES);
+  velocity = div_s64(p->velocity, 1000);
+  events = p->event_count;
+  spin_unlock_irqrestore(&p->lock, flags);
+
+  return scnprintf(buf, PAGE_SIZE, "%u %lld %lld %lld %u\n", count, id, position, velocity, events);
+}
+
+/* Takes "position <target> <velocity> <accel> [<id>]", "velocity <velocity> <accel> <duration in ms> [<id>]" or "flush" */
+static ssize_t profile_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  struct motor_segment segment;
+  char type[10];
+  long long a = 0;
+  int b = 0;
+  int c = 0;
+  int res;
+
+  memset(&segment, 0, sizeof(segment));
+
+  res = sscanf(buf, "%9s %lld %d %d %u", type, &a, &b, &c, &segment.id);
+  if (res < 1) {
+    return -EINVAL;
+  }
+
+  if (strcmp(type, "flush") == 0) {
+    res = motor_flush(MINOR(dev->devt));
+    return (res == 0 ? count : res);
+  }
+
+  if (res < 4) {
+    return -EINVAL;
+  }
+
+  if (strcmp(type, "position") == 0) {
+    segment.type = MOTOR_SEGMENT_POSITION;
+    segment.target = a;
+    segment.velocity = b;
+    segment.accel = c;
+  } else if (strcmp(type, "velocity") == 0) {
+    segment.type = MOTOR_SEGMENT_VELOCITY;
+    segment.velocity = (int) a;
+    segment.accel = b;
+    segment.duration_ms = c;
+  } else {
+    return -EINVAL;
+  }
+
+  res = motor_queue_segment(MINOR(dev->devt), &segment);
+
+  return (res == 0 ? count : res);
+}
+
+static const char *end_name[] = {"continue", "brake", "coast", "hold", "stop"};
+
+/* Takes "rotate <degrees> <speed> <end> [<id>]" or "run <ms> <speed> <end> [<id>]", the end being brake, coast, hold, stop or continue */
+static ssize_t command_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  struct motor_command command;
+  char type[10];
+  char end[10];
+  int a;
+  int res;
+  int i;
+
+  memset(&command, 0, sizeof(command));
+
+  if (sscanf(buf, "%9s %d %d %9s %u", type, &a, &command.speed, end, &command.id) < 4) {
+    return -EINVAL;
+  }
+
+  if (strcmp(type, "rotate") == 0) {
+    command.type = MOTOR_COMMAND_ROTATE;
+    command.degrees = a;
+  } else if (strcmp(type, "run") == 0) {
+    command.type = MOTOR_COMMAND_RUN;
+    command.duration_ms = a;
+  } else {
+    return -EINVAL;
+  }
+
+  for (i = MOTOR_END_CONTINUE; i <= MOTOR_END_STOP; ++i) {
+    if (strcmp(end, end_name[i]) == 0) {
+      break;
+    }
+  }
+
+  if (i > MOTOR_END_STOP) {
+    return -EINVAL;
+  }
+
+  command.end = i;
+  res = motor_command(MINOR(dev->devt), &command);
+
+  return (res == 0 ? count : res);
+}
+
+DEVICE_ATTR(profile, (S_IRUGO | S_IWUSR), profile_show, profile_store);
+DEVICE_ATTR(command, S_IWUSR, NULL, command_store);
+
+int motor_profile_create_files(struct device *dev) {
+  if (device_create_file(dev, &dev_attr_profile)) {
+    printk(KERN_ERR DEVICE_NAME ": device_create_file(profile) failed\n");
+    return -1;
+  }
+
+  if (device_create_file(dev, &dev_attr_command)) {
+    printk(KERN_ERR DEVICE_NAME ": device_create_file(command) failed\n");
+    device_remove_file(dev, &dev_attr_profile);
+    return -1;
+  }
+
+  return 0;
+}
+
+void motor_profile_remove_files(struct device *dev) {
+  device_remove_file(dev, &dev_attr_command);
+  device_remove_file(dev, &dev_attr_profile);
+}
+
+/***********************************************************************
+ *
+ * Initialisation and uninitialisation, called by motor_core
+ *
+ ***********************************************************************/
+int motor_profile_init(void) {
+  int i;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    spin_lock_init(&motor_profile[i].lock);
+    init_waitqueue_head(&motor_profile[i].wait);
+  }
+
+  if (control_loop_register(&motor_profile_ops) != 0) {
+    printk(KERN_ERR DEVICE_NAME ": control_loop_register failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void motor_profile_exit(void) {
+  control_loop_unregister(&motor_profile_ops);
+}
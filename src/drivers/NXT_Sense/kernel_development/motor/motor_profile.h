@@ -0,0 +1,17 @@
+#ifndef __H_motor_profile_h_
+#define __H_motor_profile_h_
+
+/* The motion profiles of the motors, only used from within motor_core and motor_drive */
+extern int motor_profile_init(void);
+extern void motor_profile_exit(void);
+extern int motor_profile_create_files(struct device *);
+extern void motor_profile_remove_files(struct device *);
+extern void motor_profile_release(int);
+extern void motor_profile_stall(int);
+extern int motor_profile_get_event(int, struct motor_event *, bool);
+extern unsigned int motor_profile_poll(int, struct file *, poll_table *);
+
+/* The edges_per_rev parameter of motor.ko, tachometer edges per revolution of the output shaft */
+extern unsigned int motor_edges_per_rev(void);
+
+#endif
@@ -0,0 +1,191 @@
+/* Notes:
+ * - A control_loop callback watches every motor: while it is driven at stall_speed or more, the tachometer has to move stall_edges within stall_window_ms, else the motor is stalled. This costs two lock-free reads per motor and tick.
+ * - A stalled motor is limited to stall_limit (motor_set_limit in motor_core, so the controllers, profiles and the drive pair cannot drive it harder either) and released from them, a MOTOR_EVENT_STALLED is raised on /dev/motor# and the stall attribute is notified for poll() on sysfs.
+ * - The limit stays until the user clears the stall, a stalled motor being left alone by the watch.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/poll.h>
+#include <linux/sysfs.h>
+#include <linux/ktime.h>
+#include <linux/stat.h>
+
+#include "../control_loop/control_loop.h"
+#include "motor.h"
+#include "motor_stall.h"
+#include "motor_profile.h"
+#include "motor_drive.h"
+
+#define DEVICE_NAME "motor_stall"
+
+static unsigned int stall_speed = 300;
+module_param(stall_speed, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(stall_speed, "Per mille speed from which a motor that does not move is stalled");
+
+static unsigned int stall_edges = 3;
+module_param(stall_edges, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(stall_edges, "Tachometer edges a driven motor has to move within stall_window_ms");
+
+static unsigned int stall_window_ms = 500;
+module_param(stall_window_ms, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(stall_window_ms, "Time a motor may not move while driven before it is stalled");
+
+static unsigned int stall_limit = 0;
+module_param(stall_limit, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(stall_limit, "Per mille speed a stalled motor is limited to, 0 cuts it");
+
+struct motor_stall {
+  struct device *device; /* For sysfs_notify */
+  bool watching; /* The motor is driven, origin and since are valid */
+  s64 origin; /* Tachometer position since the last move */
+  ktime_t since;
+  bool stalled; /* Written by the loop, cleared by the user */
+  unsigned int count;
+};
+
+static struct motor_stall motor_stall[NUMBER_OF_MOTORS];
+
+/***********************************************************************
+ *
+ * The watch, run by control_loop
+ *
+ ***********************************************************************/
+static void motor_stall_trip(int motor) {
+  struct motor_stall *s = &motor_stall[motor];
+
+  s->stalled = true;
+  ++s->count;
+  printk(KERN_WARNING DEVICE_NAME ": motor %d is stalled, limiting it to %u\n", motor, stall_limit);
+
+  motor_set_limit(motor, min_t(unsigned int, stall_limit, MOTOR_SPEED_MAX));
+  motor_drive_release(motor);
+  motor_profile_stall(motor);
+  motor_set_control(motor, MOTOR_MODE_OPEN, 0);
+
+  if (s->device) {
+    sysfs_notify(&s->device->kobj, NULL, "stall");
+  }
+}
+
+static void motor_stall_compute(const struct control_loop_snapshot *snapshot, void *data) {
+  struct motor_tacho_state tacho;
+  struct motor_stall *s;
+  int speed;
+  int i;
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    s = &motor_stall[i];
+
+    motor_get_speed(i, &speed);
+    if (ACCESS_ONCE(s->stalled) || abs(speed) < (int) stall_speed) {
+      s->watching = false;
+      continue;
+    }
+
+    motor_get_tacho(i, &tacho);
+
+    if (!s->watching || abs64(tacho.position - s->origin) >= stall_edges) {
+      s->watching = true;
+      s->origin = tacho.position;
+      s->since = snapshot->time;
+    } else if (ktime_us_delta(snapshot->time, s->since) >= (s64) stall_window_ms * USEC_PER_MSEC) {
+      s->watching = false;
+      motor_stall_trip(i);
+    }
+  }
+}
+
+static struct control_loop_ops motor_stall_ops = {
+  .name = DEVICE_NAME,
+  .adc_mask = 0,
+  .compute = motor_stall_compute,
+  .commit = NULL,
+};
+
+/***********************************************************************
+ *
+ * Clearing a stall, from motor_core and sysfs
+ *
+ ***********************************************************************/
+int motor_clear_stall(int motor) {
+  struct motor_stall *s;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS) {
+    return -EINVAL;
+  }
+
+  s = &motor_stall[motor];
+  motor_set_limit(motor, MOTOR_SPEED_MAX);
+  ACCESS_ONCE(s->stalled) = false;
+
+  if (s->device) {
+    sysfs_notify(&s->device->kobj, NULL, "stall");
+  }
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * Sysfs entry of the stall protection, added to the motor devices. The
+ * minor number of a motor device is the number of the motor
+ *
+ ***********************************************************************/
+/* "<stalled> <stalls since loading>" */
+static ssize_t stall_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct motor_stall *s = &motor_stall[MINOR(dev->devt)];
+
+  return scnprintf(buf, PAGE_SIZE, "%d %u\n", (ACCESS_ONCE(s->stalled) ? 1 : 0), ACCESS_ONCE(s->count));
+}
+
+/* Takes 0, clearing the stall */
+static ssize_t stall_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  int value;
+  int res;
+
+  if (sscanf(buf, "%d", &value) != 1 || value != 0) {
+    return -EINVAL;
+  }
+
+  res = motor_clear_stall(MINOR(dev->devt));
+
+  return (res == 0 ? count : res);
+}
+
+DEVICE_ATTR(stall, (S_IRUGO | S_IWUSR), stall_show, stall_store);
+
+int motor_stall_create_files(struct device *dev) {
+  if (device_create_file(dev, &dev_attr_stall)) {
+    printk(KERN_ERR DEVICE_NAME ": device_create_file(stall) failed\n");
+    return -1;
+  }
+
+  motor_stall[MINOR(dev->devt)].device = dev;
+
+  return 0;
+}
+
+void motor_stall_remove_files(struct device *dev) {
+  motor_stall[MINOR(dev->devt)].device = NULL;
+  device_remove_file(dev, &dev_attr_stall);
+}
+
+/***********************************************************************
+ *
+ * Initialisation and uninitialisation, called by motor_core
+ *
+ ***********************************************************************/
+int motor_stall_init(void) {
+  if (control_loop_register(&motor_stall_ops) != 0) {
+    printk(KERN_ERR DEVICE_NAME ": control_loop_register failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void motor_stall_exit(void) {
+  control_loop_unregister(&motor_stall_ops);
+}
@@ -0,0 +1,11 @@
+#ifndef __H_motor_stall_h_
+#define __H_motor_stall_h_
+
+/* The stall protection of the motors, only used from within motor_core */
+extern int motor_stall_init(void);
+extern void motor_stall_exit(void);
+extern int motor_stall_create_files(struct device *);
+extern void motor_stall_remove_files(struct device *);
+extern int motor_clear_stall(int);
+
+#endif
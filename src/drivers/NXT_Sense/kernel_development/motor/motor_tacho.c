@@ -0,0 +1,336 @@
+/* Notes:
+ * - Every motor has two tachometer signals, TACHOxA and TACHOxB, in quadrature. Both edges of both signals raise an interrupt, which reads both signals and steps the position by the transition from the previous state, so no edge is lost as long as the interrupts keep up.
+ * - A transition where both signals changed means an edge was missed, it is counted as an error and leaves the position as it is.
+ * - The state of every motor is kept in one page, which the applications map read-only. It is updated under a sequence count like a seqcount_t, so the readers (in the kernel as well) never take a lock.
+ * - Every counted edge is also kept with its time in a short history, from which the velocity is estimated: over several edges at speed, from the period of the last edge when the edges are sparse, so a slow motor does not read as 0 or 1 edge per tick.
+ * - GPIO 31 (TACHO1B) has to be muxed as a GPIO with input enabled by u-boot, see doc/installGuide.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/stat.h>
+#include <mach/gpio.h>
+
+#include "../level_shifter/level_shifter.h"
+#include "motor.h"
+#include "motor_tacho.h"
+
+#define DEVICE_NAME "motor_tacho"
+
+/* GPIO pins */
+#define GPIO_TACHO_1A 70
+#define GPIO_TACHO_1B 31
+#define GPIO_TACHO_2A 185
+#define GPIO_TACHO_2B 81
+#define GPIO_TACHO_3A 184
+#define GPIO_TACHO_3B 186
+
+struct motor_tacho_desc {
+  int a_gpio;
+  int b_gpio;
+};
+
+static const struct motor_tacho_desc motor_tacho_board[NUMBER_OF_MOTORS] = {
+  {GPIO_TACHO_1A, GPIO_TACHO_1B},
+  {GPIO_TACHO_2A, GPIO_TACHO_2B},
+  {GPIO_TACHO_3A, GPIO_TACHO_3B},
+};
+
+static unsigned int velocity_window_us = 20000;
+module_param(velocity_window_us, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(velocity_window_us, "Time over which the edges are counted for the velocity");
+
+static unsigned int velocity_timeout_ms = 250;
+module_param(velocity_timeout_ms, uint, (S_IRUGO | S_IWUSR));
+MODULE_PARM_DESC(velocity_timeout_ms, "Time without an edge after which a motor stands still");
+
+#define QUADRATURE_ERROR 2
+#define TACHO_HISTORY 16 /* Edges kept for the velocity */
+
+/* Position step of a transition, indexed by the previous and the new state (A << 1 | B). 00 -> 01 -> 11 -> 10 -> 00 is forward */
+static const s8 quadrature_step[16] = {
+  0, 1, -1, QUADRATURE_ERROR,
+  -1, 0, QUADRATURE_ERROR, 1,
+  1, QUADRATURE_ERROR, 0, -1,
+  QUADRATURE_ERROR, -1, 1, 0,
+};
+
+struct motor_tacho {
+  int number;
+  spinlock_t lock; /* Serialises the writers, the interrupts of the A and B signals */
+  unsigned int state;
+  struct motor_tacho_state *shared;
+  s64 edge_ns[TACHO_HISTORY]; /* The last edges, under the lock */
+  s64 edge_position[TACHO_HISTORY];
+  unsigned int edge_head; /* The newest edge */
+  unsigned int edge_count;
+};
+
+static struct motor_tacho motor_tacho[NUMBER_OF_MOTORS];
+static struct motor_tacho_page *tacho_page; /* Mapped by the applications */
+
+static unsigned int tacho_read_state(const struct motor_tacho_desc *desc) {
+  return (gpio_get_value(desc->a_gpio) ? 2 : 0) | (gpio_get_value(desc->b_gpio) ? 1 : 0);
+}
+
+static irqreturn_t motor_tacho_irq(int irq, void *dev_id) {
+  struct motor_tacho *t = dev_id;
+  struct motor_tacho_state *shared = t->shared;
+  unsigned int state;
+  s64 now;
+  s64 interval;
+  int step;
+
+  spin_lock(&t->lock);
+
+  now = ktime_to_ns(ktime_get());
+  state = tacho_read_state(&motor_tacho_board[t->number]);
+  step = quadrature_step[(t->state << 2) | state];
+  t->state = state;
+
+  /* The other signal's interrupt read this edge already */
+  if (step == 0) {
+    spin_unlock(&t->lock);
+    return IRQ_HANDLED;
+  }
+
+  ++shared->seq;
+  smp_wmb();
+
+  if (step == QUADRATURE_ERROR) {
+    ++shared->errors;
+  } else {
+    shared->position += step;
+    if (shared->last_edge_ns != 0) {
+      interval = now - shared->last_edge_ns;
+      shared->edge_interval_ns = (u32) min_t(s64, interval, UINT_MAX);
+    }
+    shared->last_edge_ns = now;
+    shared->direction = step;
+
+    t->edge_head = (t->edge_head + 1) % TACHO_HISTORY;
+    t->edge_ns[t->edge_head] = now;
+    t->edge_position[t->edge_head] = shared->position;
+    if (t->edge_count < TACHO_HISTORY) {
+      ++t->edge_count;
+    }
+  }
+
+  smp_wmb();
+  ++shared->seq;
+
+  spin_unlock(&t->lock);
+
+  return IRQ_HANDLED;
+}
+
+/***********************************************************************
+ *
+ * Hooks for reading the tachometers from other modules and the
+ * applications
+ *
+ ***********************************************************************/
+int motor_get_tacho(int motor, struct motor_tacho_state *state) {
+  struct motor_tacho_state *shared;
+  u32 seq;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS) {
+    return -EINVAL;
+  }
+
+  shared = motor_tacho[motor].shared;
+
+  do {
+    seq = ACCESS_ONCE(shared->seq);
+    smp_rmb();
+    *state = *shared;
+    smp_rmb();
+  } while ((seq & 1) || seq != ACCESS_ONCE(shared->seq));
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_get_tacho);
+
+int motor_get_velocity(int motor, struct motor_velocity *velocity) {
+  struct motor_tacho *t;
+  unsigned long flags;
+  s64 now = ktime_to_ns(ktime_get());
+  s64 last_ns;
+  s64 last_position;
+  s64 since;
+  s64 span;
+  s64 period;
+  unsigned int i;
+  unsigned int n;
+
+  if (motor < 0 || motor >= NUMBER_OF_MOTORS) {
+    return -EINVAL;
+  }
+
+  t = &motor_tacho[motor];
+  velocity->velocity = 0;
+  velocity->confidence = 0;
+  velocity->method = MOTOR_VELOCITY_NONE;
+
+  spin_lock_irqsave(&t->lock, flags);
+
+  last_ns = t->edge_ns[t->edge_head];
+  last_position = t->edge_position[t->edge_head];
+  since = now - last_ns;
+
+  if (t->edge_count < 2 || since > (s64) velocity_timeout_ms * NSEC_PER_MSEC) {
+    spin_unlock_irqrestore(&t->lock, flags);
+    return 0;
+  }
+
+  /* The oldest edge within the window */
+  for (n = 1; n < t->edge_count; ++n) {
+    i = (t->edge_head + TACHO_HISTORY - n) % TACHO_HISTORY;
+    if (last_ns - t->edge_ns[i] > (s64) velocity_window_us * NSEC_PER_USEC) {
+      break;
+    }
+  }
+  --n;
+
+  if (n >= 2) {
+    i = (t->edge_head + TACHO_HISTORY - n) % TACHO_HISTORY;
+    span = last_ns - t->edge_ns[i];
+    velocity->velocity = div64_s64((last_position - t->edge_position[i]) * 1000 * NSEC_PER_SEC, max_t(s64, span, 1));
+    velocity->confidence = 1000 - 1000 / n;
+    velocity->method = MOTOR_VELOCITY_COUNT;
+  } else {
+    i = (t->edge_head + TACHO_HISTORY - 1) % TACHO_HISTORY;
+    span = last_ns - t->edge_ns[i];
+    period = max_t(s64, max(span, since), 1);
+    velocity->velocity = div64_s64((last_position - t->edge_position[i]) * 1000 * NSEC_PER_SEC, period);
+    velocity->confidence = (u32) div64_s64(500 * span, period);
+    velocity->method = MOTOR_VELOCITY_PERIOD;
+  }
+
+  spin_unlock_irqrestore(&t->lock, flags);
+
+  return 0;
+}
+EXPORT_SYMBOL(motor_get_velocity);
+
+/* The page is only mapped read-only */
+int motor_tacho_mmap(struct vm_area_struct *vma) {
+  if ((vma->vm_flags & VM_WRITE) || vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+    return -EINVAL;
+  }
+
+  /* Nor can it be made writable by mprotect() later */
+  vma->vm_flags &= ~VM_MAYWRITE;
+
+  return vm_insert_page(vma, vma->vm_start, virt_to_page(tacho_page));
+}
+
+/***********************************************************************
+ *
+ * Initialisation and uninitialisation, called by motor_core
+ *
+ ***********************************************************************/
+static void motor_tacho_free(int count) {
+  int i;
+  const struct motor_tacho_desc *desc;
+
+  for (i = count - 1; i >= 0; --i) {
+    desc = &motor_tacho_board[i];
+    free_irq(gpio_to_irq(desc->b_gpio), &motor_tacho[i]);
+    free_irq(gpio_to_irq(desc->a_gpio), &motor_tacho[i]);
+    gpio_free(desc->b_gpio);
+    gpio_free(desc->a_gpio);
+  }
+}
+
+static int motor_tacho_init_motor(int motor) {
+  const struct motor_tacho_desc *desc = &motor_tacho_board[motor];
+  struct motor_tacho *t = &motor_tacho[motor];
+
+  t->number = motor;
+  spin_lock_init(&t->lock);
+  t->shared = &tacho_page->motor[motor];
+
+  if (gpio_request(desc->a_gpio, "TACHO_A")) {
+    printk(KERN_CRIT DEVICE_NAME ": gpio_request for pin %d failed\n", desc->a_gpio);
+    goto init_motor_fail_1;
+  }
+
+  if (gpio_request(desc->b_gpio, "TACHO_B")) {
+    printk(KERN_CRIT DEVICE_NAME ": gpio_request for pin %d failed\n", desc->b_gpio);
+    goto init_motor_fail_2;
+  }
+
+  if (gpio_direction_input(desc->a_gpio) || gpio_direction_input(desc->b_gpio)) {
+    printk(KERN_CRIT DEVICE_NAME ": could not set direction input on the tacho pins of motor %d\n", motor);
+    goto init_motor_fail_3;
+  }
+
+  t->state = tacho_read_state(desc);
+
+  if (request_irq(gpio_to_irq(desc->a_gpio), motor_tacho_irq, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "tacho_a", t)) {
+    printk(KERN_CRIT DEVICE_NAME ": request_irq failed for pin %d\n", desc->a_gpio);
+    goto init_motor_fail_3;
+  }
+
+  if (request_irq(gpio_to_irq(desc->b_gpio), motor_tacho_irq, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "tacho_b", t)) {
+    printk(KERN_CRIT DEVICE_NAME ": request_irq failed for pin %d\n", desc->b_gpio);
+    goto init_motor_fail_4;
+  }
+
+  return 0;
+
+ init_motor_fail_4:
+  free_irq(gpio_to_irq(desc->a_gpio), t);
+
+ init_motor_fail_3:
+  gpio_free(desc->b_gpio);
+
+ init_motor_fail_2:
+  gpio_free(desc->a_gpio);
+
+ init_motor_fail_1:
+  return -1;
+}
+
+int motor_tacho_init(void) {
+  int i;
+
+  tacho_page = (struct motor_tacho_page *) get_zeroed_page(GFP_KERNEL);
+  if (!tacho_page) {
+    return -1;
+  }
+
+  if (register_use_of_level_shifter(LS_U3_2)) {
+    printk(KERN_CRIT DEVICE_NAME ": register_use_of_level_shifter failed for LS_U3_2\n");
+    goto init_fail_1;
+  }
+
+  for (i = 0; i < NUMBER_OF_MOTORS; ++i) {
+    if (motor_tacho_init_motor(i) < 0) {
+      goto init_fail_2;
+    }
+  }
+
+  return 0;
+
+ init_fail_2:
+  motor_tacho_free(i);
+  unregister_use_of_level_shifter(LS_U3_2);
+
+ init_fail_1:
+  free_page((unsigned long) tacho_page);
+  return -1;
+}
+
+/* A mapping still existing keeps its own reference on the page */
+void motor_tacho_exit(void) {
+  motor_tacho_free(NUMBER_OF_MOTORS);
+  unregister_use_of_level_shifter(LS_U3_2);
+  free_page((unsigned long) tacho_page);
+}
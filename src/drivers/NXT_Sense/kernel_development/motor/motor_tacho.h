@@ -0,0 +1,9 @@
+#ifndef __H_motor_tacho_h_
+#define __H_motor_tacho_h_
+
+/* The tachometer decoding of the motors, only used from within motor_core */
+extern int motor_tacho_init(void);
+extern void motor_tacho_exit(void);
+extern int motor_tacho_mmap(struct vm_area_struct *);
+
+#endif
@@ -1,9 +1,3 @@
-/* TODO:
- * - Remove the knowledge of which port an instance of this light_data / light sensor is using:
- *     - Maybe make use of a linked list instead of a static defined array with 4 light_data objects.
- *     - Create the light_data objects dynamically and free them again to avoid wasting memory.
- */
-
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <asm/uaccess.h>
@@ -11,8 +5,8 @@
 #include <linux/cdev.h>
 #include <linux/kernel.h>
 #include <linux/mutex.h>
-
-#include "light.h"
+#include <linux/slab.h>
+#include <linux/kref.h>
 
 #include "nxt_sense_core.h"
 
@@ -23,12 +17,20 @@
 struct light_data {
   struct nxt_sense_device_data nxt_sense_device_data; /* Has to be placed at the beginning, see comment above! */
   struct device_attribute dev_attr_led;
-  int port;
   int led;
   struct mutex mutex;
 };
 
-static struct light_data light_data[4];
+/* The light_data instances are allocated when a port is configured as a light sensor */
+static struct kmem_cache *light_cache;
+
+/* The instance is freed when the port is reconfigured and the device is no longer open */
+static void free_light_data(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct light_data *ld = container_of(nxt_sense_device_data, struct light_data, nxt_sense_device_data);
+
+  mutex_destroy(&ld->mutex);
+  kmem_cache_free(light_cache, ld);
+}
 
 /***********************************************************************
  *
@@ -36,11 +38,17 @@ static struct light_data light_data[4];
  *
  ***********************************************************************/
 static int light_open(struct inode *inode, struct file *filp) {
+  struct nxt_sense_device_data *nxt_sense_device_data;
   struct light_data *ld;
 
-  ld = (struct light_data *) container_of(inode->i_cdev, struct nxt_sense_device_data, cdev);
+  nxt_sense_device_data = nxt_sense_get_device_data(inode);
+  if (!nxt_sense_device_data) {
+    return -ENODEV;
+  }
+  ld = container_of(nxt_sense_device_data, struct light_data, nxt_sense_device_data);
 
   if (!mutex_trylock(&ld->mutex)) {
+    nxt_sense_put_device_data(nxt_sense_device_data);
     return -EBUSY;
   }
 
@@ -50,10 +58,10 @@ static int light_open(struct inode *inode, struct file *filp) {
 }
 
 static int light_release(struct inode *inode, struct file *filp) {
-  struct light_data *ld;
-  ld = (struct light_data *) container_of(inode->i_cdev, struct nxt_sense_device_data, cdev);
+  struct light_data *ld = filp->private_data;
 
   mutex_unlock(&ld->mutex);
+  nxt_sense_put_device_data(&ld->nxt_sense_device_data);
 
   return 0;
 }
@@ -68,7 +76,14 @@ static ssize_t light_read(struct file *filp, char __user *buff, size_t count, lo
   int status_sampling;
   struct light_data *ld = filp->private_data;
 
-  status_sampling = ld->nxt_sense_device_data.get_sample(&data);
+  if (ld->nxt_sense_device_data.removed) {
+    return -ENODEV;
+  }
+
+  status_sampling = ld->nxt_sense_device_data.get_sample(&ld->nxt_sense_device_data, &data);
+  if (status_sampling == -ENODEV) {
+    return -ENODEV; /* Removed while sampling */
+  }
 
   snprintf(output, 6, "%4.d\n", data);
 
@@ -132,9 +147,9 @@ static ssize_t led_store(struct device *dev, struct device_attribute *attr, cons
   res = sscanf(buf, "%d", &new_led);
 
   if (res != 1) {
-    printk(KERN_WARNING DEVICE_NAME "%d: wrong sysfs input for led, only takes a value for the led\n", MINOR(ld->nxt_sense_device_data.devt));
+    printk(KERN_WARNING DEVICE_NAME "%d: wrong sysfs input for led, only takes a value for the led\n", ld->nxt_sense_device_data.port);
   } else if (new_led != 0 && new_led != 1) {
-    printk(KERN_WARNING DEVICE_NAME "%d: the sysfs input for led is supposed to be 0 or 1, but was: %d\n", MINOR(ld->nxt_sense_device_data.devt), new_led);
+    printk(KERN_WARNING DEVICE_NAME "%d: the sysfs input for led is supposed to be 0 or 1, but was: %d\n", ld->nxt_sense_device_data.port, new_led);
   } else {
     /* See comments in touch.c for why to use mutex_lock instead of mutex_trylock and return -EBUSY */
     mutex_lock(&ld->mutex);
@@ -142,7 +157,7 @@ static ssize_t led_store(struct device *dev, struct device_attribute *attr, cons
     ld->led = new_led;
 
     /* Call the function to activate the led or deactivate it */
-    ld->nxt_sense_device_data.scl((new_led == 0 ? SCL_LOW : SCL_HIGH));
+    ld->nxt_sense_device_data.scl(&ld->nxt_sense_device_data, (new_led == 0 ? SCL_LOW : SCL_HIGH));
     
     mutex_unlock(&ld->mutex);
   }
@@ -167,7 +182,7 @@ static int init_sysfs(struct light_data *ld) {
 
   error = device_create_file(ld->nxt_sense_device_data.device, &ld->dev_attr_led);
   if (error != 0) {
-    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(led) error: %d\n", MINOR(ld->nxt_sense_device_data.devt), error);
+    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(led) error: %d\n", ld->nxt_sense_device_data.port, error);
     return -1;
   }
 
@@ -183,55 +198,100 @@ static int destroy_sysfs(struct light_data *ld) {
 /***********************************************************************
  *
  * Hooks for adding and removing devices for the light sensor submodule,
- * called from nxt_sense_core.c
+ * called from nxt_sense_core.c through the registered nxt_sense_type_ops
  *
  ***********************************************************************/
-int add_light_sensor(int port, dev_t devt) {
+static struct nxt_sense_device_data *add_light_sensor(int port, dev_t devt) {
   int res;
   int error;
+  struct light_data *ld;
   printk(KERN_DEBUG DEVICE_NAME ": Adding light sensor on port %d\n", port);
 
-  mutex_init(&light_data[port].mutex);
-  mutex_lock(&light_data[port].mutex); /* void, so sleeps until the lock is acquired? mutex_lock_interruptible returns an error indicating it was interrupted... */
+  ld = kmem_cache_zalloc(light_cache, GFP_KERNEL);
+  if (!ld) {
+    return NULL;
+  }
+
+  mutex_init(&ld->mutex);
+  nxt_sense_init_device_data(&ld->nxt_sense_device_data, free_light_data);
+  mutex_lock(&ld->mutex); /* void, so sleeps until the lock is acquired? mutex_lock_interruptible returns an error indicating it was interrupted... */
 
-  light_data[port].nxt_sense_device_data.devt = devt;
+  ld->nxt_sense_device_data.devt = devt;
 
-  res = nxt_setup_sensor_chrdev(&light_fops, &light_data[port].nxt_sense_device_data, DEVICE_NAME);
+  res = nxt_setup_sensor_chrdev(&light_fops, &ld->nxt_sense_device_data, DEVICE_NAME);
 
   printk(KERN_DEBUG DEVICE_NAME ": return value for nxt_setup_sensor_chrdev: %d\n", res);
 
-  light_data[port].port = port;
-  light_data[port].led = DEFAULT_LED_VALUE;
+  if (res != 0) {
+    mutex_unlock(&ld->mutex);
+    nxt_sense_put_device_data(&ld->nxt_sense_device_data);
+    return NULL;
+  }
 
-  error = init_sysfs(&light_data[port]);
-  mutex_unlock(&light_data[port].mutex);
+  ld->led = DEFAULT_LED_VALUE;
+
+  error = init_sysfs(ld);
+  mutex_unlock(&ld->mutex);
   if (error != 0) {
-    /* error .... handle this if you want */
-    return -1;
+    nxt_teardown_sensor_chrdev(&ld->nxt_sense_device_data);
+    nxt_sense_put_device_data(&ld->nxt_sense_device_data);
+    return NULL;
   }
 
-  return res;
+  return &ld->nxt_sense_device_data;
 }
 
-static int uninitialise_light_data(struct light_data *ld) {
-  mutex_destroy(&ld->mutex);
-  ld->port = 0;
-  ld->led = DEFAULT_LED_VALUE;
+static int remove_light_sensor(struct nxt_sense_device_data *nxt_sense_device_data) {
+  int res;
+  struct light_data *ld = container_of(nxt_sense_device_data, struct light_data, nxt_sense_device_data);
+  printk(KERN_DEBUG DEVICE_NAME ": Removing light sensor on port %d\n", nxt_sense_device_data->port);
 
-  return 0;
+  destroy_sysfs(ld);
+
+  res = nxt_teardown_sensor_chrdev(nxt_sense_device_data);
+
+  nxt_sense_put_device_data(&ld->nxt_sense_device_data);
+
+  return res;
 }
 
-int remove_light_sensor(int port) {
-  int res;
-  printk(KERN_DEBUG DEVICE_NAME ": Removing light sensor on port %d\n", port);
+static struct nxt_sense_type_ops light_type_ops = {
+  .code = LIGHT_CODE,
+  .name = DEVICE_NAME,
+  .owner = THIS_MODULE,
+  .add = add_light_sensor,
+  .remove = remove_light_sensor,
+};
 
-  destroy_sysfs(&light_data[port]);
+/***********************************************************************
+ *
+ * Module initialisation and exit, registering the light sensor type
+ * with nxt_sense
+ *
+ ***********************************************************************/
+static int __init light_init(void) {
+  int error;
 
-  res = nxt_teardown_sensor_chrdev(&light_data[port].nxt_sense_device_data);
+  light_cache = kmem_cache_create("nxt_light_data", sizeof(struct light_data), 0, 0, NULL);
+  if (!light_cache) {
+    printk(KERN_CRIT DEVICE_NAME ": kmem_cache_create() failed\n");
+    return -ENOMEM;
+  }
 
-  uninitialise_light_data(&light_data[port]);
+  error = nxt_sense_register_type(&light_type_ops);
+  if (error) {
+    kmem_cache_destroy(light_cache);
+  }
 
-  return res;
+  return error;
+}
+module_init(light_init);
+
+static void __exit light_exit(void) {
+  nxt_sense_unregister_type(&light_type_ops);
+  kmem_cache_destroy(light_cache);
 }
+module_exit(light_exit);
 
+MODULE_ALIAS_NXT_SENSE_TYPE(LIGHT_CODE);
 MODULE_LICENSE("GPL");
@@ -1,8 +0,0 @@
-#ifndef __H_light_h_
-#define __H_light_h_
-/* should include header file for dev_t type */
-
-extern int add_light_sensor(int, dev_t);
-extern int remove_light_sensor(int);
-
-#endif
@@ -8,217 +8,1098 @@
 #include <linux/spi/spi.h>
 #include <linux/string.h>
 #include <linux/stat.h>
+#include <linux/kmod.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
+#include <linux/i2c.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/rcupdate.h>
+#include <linux/bitops.h>
+#include <linux/firmware.h>
+#include <linux/kref.h>
 #include <asm/uaccess.h>
 #include <mach/gpio.h>
 
 #include "../level_shifter/level_shifter.h"
 #include "../adc/adc.h"
 #include "nxt_sense_core.h"
-/* Include the add and remove functions of the submodules that are supported */
-#include "touch.h"
-#include "light.h"
+#include "nxt_sense_i2c.h"
+#include "nxt_sense_reflex.h"
 
 #define DEVICE_NAME "nxt_sense"
 
-#define NUMBER_OF_DEVICES 5
-
-#define PORT_MIN 0
-#define NUMBER_OF_PORTS 4
-/* This requires the port_min to start from 0 unless the number_of_ports is incremented accordingly */
-#define NXT_SENSE_MINOR 4
-
-/* sensor types */
-#define NONWORKING_PORT_CODE -1
-#define NONE_CODE 0
-#define TOUCH_CODE 1
-#define LIGHT_CODE 2
-#define MAX_SENSOR_CODE LIGHT_CODE
-
 /* GPIO pins */
 #define GPIO_SCL_1 73
 #define GPIO_SCL_2 75
 #define GPIO_SCL_3 72
 #define GPIO_SCL_4 74
+#define GPIO_SDA_1 21
+#define GPIO_SDA_2 20
+#define GPIO_SDA_3 23
+#define GPIO_SDA_4 19
+#define GPIO_SDA_DIR_1 13
+#define GPIO_SDA_DIR_2 18
+#define GPIO_SDA_DIR_3 14
+#define GPIO_SDA_DIR_4 22
+
+/* Board data: the NXT ports of the GumstixNXT board, other boards (or sensor multiplexers) only need another table */
+struct nxt_sense_port_desc {
+  int scl_gpio;
+  int sda_gpio;
+  int sda_dir_gpio;
+  int adc_channel;
+};
+
+static const struct nxt_sense_port_desc nxt_sense_board_ports[] = {
+  {GPIO_SCL_1, GPIO_SDA_1, GPIO_SDA_DIR_1, 0},
+  {GPIO_SCL_2, GPIO_SDA_2, GPIO_SDA_DIR_2, 1},
+  {GPIO_SCL_3, GPIO_SDA_3, GPIO_SDA_DIR_3, 2},
+  {GPIO_SCL_4, GPIO_SDA_4, GPIO_SDA_DIR_4, 3},
+};
+
+#define NUMBER_OF_PORTS ARRAY_SIZE(nxt_sense_board_ports)
+#define NXT_SENSE_MINOR 0
+/* The sensor devices take their minor numbers from a pool, as the old and the new sensor of a port both exist while the port is reconfigured */
+#define SENSOR_MINOR_MIN 1
+#define NUMBER_OF_SENSOR_MINORS (2 * NUMBER_OF_PORTS)
+/* The sensor minor numbers and one for nxt_sense itself */
+#define NUMBER_OF_DEVICES (NUMBER_OF_SENSOR_MINORS + 1)
 
 DEFINE_MUTEX(nxt_sense_core_mutex);
+/* Guards the sensor type table only, it must not be the core mutex as the submodules register themselves while nxt_sense waits in request_module() */
+DEFINE_MUTEX(nxt_sense_types_mutex);
+
+/* Statistics over a tumbling window of the samples of a port, the last complete window is the one shown */
+#define STATS_DEFAULT_WINDOW_MS 1000
+
+struct nxt_sense_stats_window {
+  unsigned int count;
+  int min;
+  int max;
+  s64 sum;
+  u64 sum_of_squares;
+  unsigned long start; /* jiffies */
+};
+
+struct nxt_sense_stats {
+  spinlock_t lock;
+  unsigned int window_ms;
+  struct nxt_sense_stats_window current_window;
+  struct nxt_sense_stats_window last_window;
+  unsigned int last_window_ms; /* The length of last_window, 0 before the first window is complete */
+};
+
+/* The sensor configured on a port, replaced as a whole when the port is reconfigured and read under rcu_read_lock() */
+struct nxt_sense_port_cfg {
+  int cfg;
+  struct nxt_sense_type_ops *type; /* The submodule loaded on the port, holding a reference on its module */
+  struct nxt_sense_device_data *instance; /* Allocated by the submodule when the port is configured */
+  dev_t devt;
+};
+
+struct nxt_sense_port {
+  struct nxt_sense_port_cfg *active; /* NULL when nothing is configured on the port */
+  dev_t pending_devt; /* The sensor being built for the port, its SCL level is only applied when it replaces the active one */
+  int scl_value; /* The SCL level set by the active sensor */
+  int pending_scl_value;
+  struct nxt_i2c_port *i2c; /* The I2C bus of the port, only while a digital sensor uses it */
+  int i2c_users;
+  struct nxt_sense_stats stats;
+};
 
 struct nxt_sense_dev {
   dev_t devt;
   struct cdev cdev;
   struct class *class;
   struct device *device;
-  int port_cfg[NUMBER_OF_PORTS];
+  struct nxt_sense_port port[NUMBER_OF_PORTS];
+  DECLARE_BITMAP(sensor_minors, NUMBER_OF_SENSOR_MINORS); /* Guarded by the nxt_sense_core_mutex */
+  int sensor_minor_port[NUMBER_OF_SENSOR_MINORS];
+  spinlock_t sensor_data_lock; /* Guards sensor_minor_data, taken by the open of the sensor devices */
+  struct nxt_sense_device_data *sensor_minor_data[NUMBER_OF_SENSOR_MINORS]; /* The instance behind a sensor minor number, while its device is set up */
 };
 
 static struct nxt_sense_dev nxt_sense_dev;
 
-/***********************************************************************
- *
- * Macros for generating the functions for sampling the corresponding
- * ADC channels
- *
- ***********************************************************************/
-#define SAMPLE_FUNCTION(_port, _adc_channel)				\
-  static int get_sample_##_port (int *data) {				\
-    int status = 0;							\
-    status = adc_sample_channel(_adc_channel, data);			\
-									\
-    if (status != 0) {							\
-      printk(KERN_ERR DEVICE_NAME ": Some error happened while communicating with the ADC: %d\n", status); \
-    }									\
-									\
-    return status;							\
-  }
-
-/* applying the macro above - sample_function(port, corresponding adc_channel) */
-SAMPLE_FUNCTION(0, 0)
-SAMPLE_FUNCTION(1, 1)
-SAMPLE_FUNCTION(2, 2)
-SAMPLE_FUNCTION(3, 3)
+/* Registered sensor types indexed by their code, NONE_CODE is never registered */
+static struct nxt_sense_type_ops *nxt_sense_types[NXT_SENSE_MAX_TYPES];
+
+/* Sensor type auto-detection, see detect_port() */
+static bool autodetect = false;
+module_param(autodetect, bool, S_IRUGO);
+MODULE_PARM_DESC(autodetect, "Probe the unconfigured ports for sensors when loading the module");
+
+static unsigned int autodetect_interval = 0;
+module_param(autodetect_interval, uint, S_IRUGO);
+MODULE_PARM_DESC(autodetect_interval, "Seconds between background probes of the unconfigured ports, 0 disables the background probing");
+
+static struct delayed_work autodetect_work;
+
+/* Boot-time configuration, see apply_boot_cfg() */
+static int ports[NUMBER_OF_PORTS];
+static int ports_count = 0;
+module_param_array(ports, int, &ports_count, S_IRUGO);
+MODULE_PARM_DESC(ports, "Sensor code of every port, configured while loading the module");
+
+static char *config_file = NULL;
+module_param(config_file, charp, S_IRUGO);
+MODULE_PARM_DESC(config_file, "Firmware file holding the sensor code of every port, used when ports is not given");
+
+static struct work_struct boot_cfg_work;
+/* Sensor codes still waiting for their submodule, guarded by the nxt_sense_core_mutex */
+static int boot_cfg[NUMBER_OF_PORTS];
+
+static void boot_cfg_type_registered(int code);
 
 /***********************************************************************
  *
- * Macros for generating the functions for operating the SCL pins
+ * Statistics of the samples of the ports, updated in constant time for
+ * every sample
  *
  ***********************************************************************/
-#define SCL_FUNCTION(_port, _pin)					\
-  static int scl_##_port (enum scl_bit_flags bit_flag) {		\
-    int status = 0;							\
-    static int current_value = 0;					\
-									\
-    switch (bit_flag) {							\
-    case SCL_LOW:							\
-      gpio_set_value(_pin, 0);						\
-      current_value = 0;						\
-      break;								\
-    case SCL_HIGH:							\
-      gpio_set_value(_pin, 1);						\
-      current_value = 1;						\
-      break;								\
-    case SCL_TOGGLE:							\
-      gpio_set_value(_pin, (current_value == 0 ? 1 : 0));		\
-      break;								\
-    default:								\
-      printk(KERN_WARNING DEVICE_NAME ": The given bit flag is invalid: %d\n", bit_flag); \
-    }									\
-    									\
-    return status;							\
-  }
-
-/* applying the macro above - scl_function(port, corresponding SCL pin) */
-SCL_FUNCTION(0, GPIO_SCL_1);
-SCL_FUNCTION(1, GPIO_SCL_2);
-SCL_FUNCTION(2, GPIO_SCL_3);
-SCL_FUNCTION(3, GPIO_SCL_4);
+static void stats_start_window(struct nxt_sense_stats_window *window, unsigned long now) {
+  window->count = 0;
+  window->min = INT_MAX;
+  window->max = INT_MIN;
+  window->sum = 0;
+  window->sum_of_squares = 0;
+  window->start = now;
+}
+
+/* Requires the lock of the stats */
+static void stats_reset(struct nxt_sense_stats *stats) {
+  stats_start_window(&stats->current_window, jiffies);
+  stats->last_window.count = 0;
+  stats->last_window_ms = 0;
+}
+
+/* Rotates the windows ended by now, from stats_add() as well as from the readers, so a port that stopped sampling shows an empty window instead of its old samples. Requires the lock of the stats */
+static void stats_expire(struct nxt_sense_stats *stats, unsigned long now) {
+  struct nxt_sense_stats_window *window = &stats->current_window;
+  unsigned long length = msecs_to_jiffies(stats->window_ms);
+
+  if (time_before(now, window->start + length)) {
+    return;
+  }
+
+  if (time_before(now, window->start + 2 * length)) {
+    stats->last_window = *window;
+    stats_start_window(window, window->start + length);
+  } else {
+    /* A whole window passed without any sample */
+    stats_start_window(&stats->last_window, now);
+    stats_start_window(window, now);
+  }
+  stats->last_window_ms = stats->window_ms;
+}
+
+static void stats_add(int port, int value) {
+  struct nxt_sense_stats *stats = &nxt_sense_dev.port[port].stats;
+  struct nxt_sense_stats_window *window = &stats->current_window;
+  unsigned long flags;
+
+  spin_lock_irqsave(&stats->lock, flags);
+
+  stats_expire(stats, jiffies);
+
+  ++window->count;
+  window->min = min(window->min, value);
+  window->max = max(window->max, value);
+  window->sum += value;
+  window->sum_of_squares += (s64) value * value;
+
+  spin_unlock_irqrestore(&stats->lock, flags);
+
+  nxt_reflex_sample(port, value);
+}
+
+/* For the sensor types not sampling through get_sample(), e.g. the digital sensors, to have their readings counted in the stats of the port */
+void nxt_sense_add_stats_sample(struct nxt_sense_device_data *nxt_sense_device_data, int value) {
+  stats_add(nxt_sense_device_data->port, value);
+}
+EXPORT_SYMBOL(nxt_sense_add_stats_sample);
 
 /***********************************************************************
  *
- * Functions for managing the loading and unloading of the submodules
- * Comments: Requires knowledge of the available submodules
+ * Functions for sampling the ADC channel and operating the SCL pin of
+ * a port, handed to the submodules through nxt_sense_device_data
  *
  ***********************************************************************/
-static int load_nxt_sensor(int sensor_code, int port) {
-  int status = 0;
-  dev_t devt;
+static int get_sample(struct nxt_sense_device_data *nxt_sense_device_data, int *data) {
+  int status;
 
-  /* If the port is not available then exit */
-  if (nxt_sense_dev.port_cfg[port] != NONE_CODE) {
-    return -3;
+  if (nxt_sense_device_data->removed) {
+    return -ENODEV;
   }
 
-  devt = MKDEV(MAJOR(nxt_sense_dev.devt), port); /* NOTE: Hardcoded port to match minor number here! */
+  status = adc_sample_channel(nxt_sense_board_ports[nxt_sense_device_data->port].adc_channel, data);
 
-  nxt_sense_dev.port_cfg[port] = sensor_code;
+  if (status != 0) {
+    printk(KERN_ERR DEVICE_NAME ": Some error happened while communicating with the ADC: %d\n", status);
+  } else {
+    stats_add(nxt_sense_device_data->port, *data);
+  }
 
-  switch (sensor_code) {
-  case NONE_CODE:
-    /* Do nothing */
-    break;
-  case TOUCH_CODE:
-    status = add_touch_sensor(port, devt);
-    break;
-  case LIGHT_CODE:
-    status = add_light_sensor(port, devt);
-    break;
-  case NONWORKING_PORT_CODE:
-    printk(KERN_ERR DEVICE_NAME ": internal error: Trying to load a nxt_sensor with NONWORKING_PORT_CODE (%d)\n", sensor_code);
-    status = -1;
-    break;
-  default:
-    /* Error... */
-    printk(KERN_ERR DEVICE_NAME ": Loading unknown sensor port code!: %d\n", sensor_code);
-    status = -1;
+  return status;
+}
+
+static int get_samples(struct nxt_sense_device_data *nxt_sense_device_data, int *data, int count, unsigned int rate) {
+  int status;
+  int i;
+
+  if (nxt_sense_device_data->removed) {
+    return -ENODEV;
   }
 
-  if(status < 0){
-    nxt_sense_dev.port_cfg[port] = NONWORKING_PORT_CODE;
+  status = adc_sample_channel_burst(nxt_sense_board_ports[nxt_sense_device_data->port].adc_channel, data, count, rate);
+
+  if (status != 0) {
+    printk(KERN_ERR DEVICE_NAME ": Some error happened while communicating with the ADC: %d\n", status);
+  } else {
+    for (i = 0; i < count; ++i) {
+      stats_add(nxt_sense_device_data->port, data[i]);
+    }
   }
 
   return status;
 }
 
-static int unload_nxt_sensor(int port) {
-  int status = 0;
+enum pins_owner {PINS_NOT_OWNED = 0, PINS_ACTIVE, PINS_PENDING};
 
-  switch (nxt_sense_dev.port_cfg[port]) {
-  case NONE_CODE:
-    /* Do nothing */
-    break;
-  case TOUCH_CODE:
-    status = remove_touch_sensor(port);
+/* The active sensor of the port owns its pins. A sensor being built for the port only has its SCL level recorded, so the active sensor keeps working undisturbed */
+static enum pins_owner pins_owner(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct nxt_sense_port *port = &nxt_sense_dev.port[nxt_sense_device_data->port];
+  struct nxt_sense_port_cfg *active;
+  dev_t devt = nxt_sense_device_data->devt;
+  enum pins_owner owner = PINS_NOT_OWNED;
+
+  if (devt == MKDEV(0, 0)) {
+    return PINS_NOT_OWNED;
+  }
+
+  rcu_read_lock();
+  active = rcu_dereference(port->active);
+  if (active && active->devt == devt) {
+    owner = PINS_ACTIVE;
+  } else if (devt == port->pending_devt) {
+    owner = PINS_PENDING;
+  }
+  rcu_read_unlock();
+
+  return owner;
+}
+
+static int scl(struct nxt_sense_device_data *nxt_sense_device_data, enum scl_bit_flags bit_flag) {
+  struct nxt_sense_port *port = &nxt_sense_dev.port[nxt_sense_device_data->port];
+  int pin = nxt_sense_board_ports[nxt_sense_device_data->port].scl_gpio;
+  enum pins_owner owner = pins_owner(nxt_sense_device_data);
+  int *value;
+
+  /* A sensor replaced by a reconfiguration leaves the pin to its successor */
+  if (owner == PINS_NOT_OWNED) {
+    return -EBUSY;
+  }
+
+  value = (owner == PINS_ACTIVE ? &port->scl_value : &port->pending_scl_value);
+
+  switch (bit_flag) {
+  case SCL_LOW:
+    *value = 0;
     break;
-  case LIGHT_CODE:
-    status = remove_light_sensor(port);
+  case SCL_HIGH:
+    *value = 1;
     break;
-  case NONWORKING_PORT_CODE:
-    printk(KERN_ERR DEVICE_NAME ": internal error: Trying to unload a nxt_sensor with NONWORKING_PORT_CODE (%d)\n", nxt_sense_dev.port_cfg[port]);
-    return -4;
+  case SCL_TOGGLE:
+    *value = !*value;
     break;
   default:
-    /* Error... */
-    printk(KERN_ERR DEVICE_NAME ": Unloading unknown sensor port code!: %d\n", nxt_sense_dev.port_cfg[port]);
-    status = -1;
+    printk(KERN_WARNING DEVICE_NAME ": The given bit flag is invalid: %d\n", bit_flag);
+    return -1;
+  }
+
+  if (owner == PINS_ACTIVE) {
+    gpio_set_value(pin, *value);
+  }
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * The I2C bus of a port for the digital sensors, the adapter is only
+ * registered while a sensor on the port uses it, as it takes over SCL
+ *
+ ***********************************************************************/
+/* Called from the start hook of a digital sensor type, i.e. with the nxt_sense_core_mutex held and the pins owned by the sensor. Returns NULL on failure */
+struct i2c_adapter *nxt_sense_get_i2c_adapter(struct nxt_sense_device_data *nxt_sense_device_data) {
+  int port = nxt_sense_device_data->port;
+  struct nxt_sense_port *p = &nxt_sense_dev.port[port];
+
+  if (!p->i2c) {
+    p->i2c = nxt_i2c_create(port, nxt_sense_board_ports[port].scl_gpio, nxt_sense_board_ports[port].sda_gpio, nxt_sense_board_ports[port].sda_dir_gpio, nxt_sense_dev.device);
+    if (!p->i2c) {
+      printk(KERN_ERR DEVICE_NAME ": could not create the I2C bus of port %d\n", port);
+      return NULL;
+    }
+  }
+
+  ++p->i2c_users;
+
+  return nxt_i2c_adapter(p->i2c);
+}
+EXPORT_SYMBOL(nxt_sense_get_i2c_adapter);
+
+/* Called from the remove hook of a digital sensor type, the bus is removed with its last user */
+void nxt_sense_put_i2c_adapter(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct nxt_sense_port *p = &nxt_sense_dev.port[nxt_sense_device_data->port];
+
+  if (!p->i2c || --p->i2c_users > 0) {
+    return;
+  }
+
+  nxt_i2c_destroy(p->i2c);
+  p->i2c = NULL;
+}
+EXPORT_SYMBOL(nxt_sense_put_i2c_adapter);
+
+/* The built-in "i2c" sensor type only exposes the bus of the port, for i2c-dev and the in-kernel I2C drivers */
+struct i2c_port_data {
+  struct nxt_sense_device_data nxt_sense_device_data;
+  struct i2c_adapter *adapter; /* NULL until started */
+};
+
+static struct nxt_sense_device_data *add_i2c_port(int port, dev_t devt) {
+  struct i2c_port_data *ipd;
+
+  ipd = kzalloc(sizeof(*ipd), GFP_KERNEL);
+  if (!ipd) {
+    return NULL;
+  }
+
+  ipd->nxt_sense_device_data.devt = devt;
+  ipd->nxt_sense_device_data.port = port;
+  ipd->nxt_sense_device_data.get_sample = get_sample;
+  ipd->nxt_sense_device_data.get_samples = get_samples;
+  ipd->nxt_sense_device_data.scl = scl;
+
+  return &ipd->nxt_sense_device_data;
+}
+
+static int start_i2c_port(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct i2c_port_data *ipd = container_of(nxt_sense_device_data, struct i2c_port_data, nxt_sense_device_data);
+
+  ipd->adapter = nxt_sense_get_i2c_adapter(nxt_sense_device_data);
+  if (!ipd->adapter) {
+    return -ENODEV;
+  }
+
+  printk(KERN_INFO DEVICE_NAME ": port %d is I2C bus %d\n", nxt_sense_device_data->port, i2c_adapter_id(ipd->adapter));
+
+  return 0;
+}
+
+static int remove_i2c_port(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct i2c_port_data *ipd = container_of(nxt_sense_device_data, struct i2c_port_data, nxt_sense_device_data);
+
+  if (ipd->adapter) {
+    nxt_sense_put_i2c_adapter(nxt_sense_device_data);
   }
+  kfree(ipd);
 
-  if(status < 0){
-    nxt_sense_dev.port_cfg[port] = NONWORKING_PORT_CODE;
+  return 0;
+}
+
+static struct nxt_sense_type_ops i2c_type_ops = {
+  .code = I2C_CODE,
+  .name = "i2c",
+  .owner = NULL, /* Built into nxt_sense */
+  .add = add_i2c_port,
+  .start = start_i2c_port,
+  .remove = remove_i2c_port,
+};
+
+/***********************************************************************
+ *
+ * Registration of the sensor type submodules
+ *
+ ***********************************************************************/
+static bool valid_type_code(int code) {
+  return code > NONE_CODE && code < NXT_SENSE_MAX_TYPES;
+}
+
+int nxt_sense_register_type(struct nxt_sense_type_ops *ops) {
+  int status = 0;
+
+  if (!ops || !valid_type_code(ops->code) || !ops->add || !ops->remove) {
+    printk(KERN_ERR DEVICE_NAME ": refusing to register an invalid sensor type\n");
+    return -EINVAL;
+  }
+
+  mutex_lock(&nxt_sense_types_mutex);
+
+  if (nxt_sense_types[ops->code]) {
+    printk(KERN_ERR DEVICE_NAME ": sensor type code %d is already registered by %s\n", ops->code, nxt_sense_types[ops->code]->name);
+    status = -EBUSY;
+  } else {
+    nxt_sense_types[ops->code] = ops;
+    printk(KERN_DEBUG DEVICE_NAME ": registered sensor type %s (%d)\n", ops->name, ops->code);
+  }
+
+  mutex_unlock(&nxt_sense_types_mutex);
+
+  if (status == 0) {
+    boot_cfg_type_registered(ops->code);
+  }
+
+  return status;
+}
+EXPORT_SYMBOL(nxt_sense_register_type);
+
+/* A submodule can only be unloaded when no port is using it, as every port holds a reference on the module of its sensor type */
+int nxt_sense_unregister_type(struct nxt_sense_type_ops *ops) {
+  int status = 0;
+
+  mutex_lock(&nxt_sense_types_mutex);
+
+  if (!ops || !valid_type_code(ops->code) || nxt_sense_types[ops->code] != ops) {
+    status = -EINVAL;
   } else {
-    nxt_sense_dev.port_cfg[port] = NONE_CODE;
+    nxt_sense_types[ops->code] = NULL;
   }
 
+  mutex_unlock(&nxt_sense_types_mutex);
+
   return status;
 }
+EXPORT_SYMBOL(nxt_sense_unregister_type);
+
+/* Returns the type with a reference taken on its module, or NULL */
+static struct nxt_sense_type_ops *get_type(int code) {
+  struct nxt_sense_type_ops *ops;
+
+  mutex_lock(&nxt_sense_types_mutex);
+
+  ops = nxt_sense_types[code];
+  if (ops && !try_module_get(ops->owner)) {
+    ops = NULL;
+  }
+
+  mutex_unlock(&nxt_sense_types_mutex);
+
+  return ops;
+}
+
+/* Looks up the type and loads its submodule on demand */
+static struct nxt_sense_type_ops *find_type(int code) {
+  struct nxt_sense_type_ops *ops;
+
+  ops = get_type(code);
+  if (!ops) {
+    request_module(NXT_SENSE_TYPE_ALIAS_PREFIX "%d", code);
+    ops = get_type(code);
+  }
+
+  return ops;
+}
+
+/***********************************************************************
+ *
+ * Functions for managing the loading and unloading of the submodules.
+ * A reconfiguration first builds the new sensors of all the changed
+ * ports next to the old ones, and only when every one of them is built
+ * they replace the old ones, which are then removed. A failure removes
+ * the new sensors again, leaving every port as it was.
+ *
+ ***********************************************************************/
+static int port_code(int port) {
+  struct nxt_sense_port_cfg *active;
+  int code;
+
+  rcu_read_lock();
+  active = rcu_dereference(nxt_sense_dev.port[port].active);
+  code = active ? active->cfg : NONE_CODE;
+  rcu_read_unlock();
+
+  return code;
+}
+
+/* The touch and light sensors are only sampled when read, the reflex thread samples them. The other sensors feed the reflexes from their own sampling */
+static int reflex_sample_port(int port, int *value) {
+  int code = port_code(port);
+
+  if (code != TOUCH_CODE && code != LIGHT_CODE) {
+    return -ENODEV;
+  }
+
+  return adc_sample_channel(nxt_sense_board_ports[port].adc_channel, value);
+}
+
+/* Requires the nxt_sense_core_mutex */
+static int alloc_sensor_minor(int port) {
+  int i = find_first_zero_bit(nxt_sense_dev.sensor_minors, NUMBER_OF_SENSOR_MINORS);
+
+  if (i >= NUMBER_OF_SENSOR_MINORS) {
+    return -1;
+  }
+
+  set_bit(i, nxt_sense_dev.sensor_minors);
+  nxt_sense_dev.sensor_minor_port[i] = port;
+
+  return SENSOR_MINOR_MIN + i;
+}
+
+static void free_sensor_minor(dev_t devt) {
+  clear_bit(MINOR(devt) - SENSOR_MINOR_MIN, nxt_sense_dev.sensor_minors);
+}
+
+/* Loads the submodule and lets it build its instance for the port, without touching the active sensor of the port. Returns NULL on failure */
+static struct nxt_sense_port_cfg *build_port_cfg(int sensor_code, int port) {
+  int minor;
+  struct nxt_sense_port_cfg *new_cfg;
 
+  if (!valid_type_code(sensor_code)) {
+    printk(KERN_ERR DEVICE_NAME ": Loading unknown sensor port code!: %d\n", sensor_code);
+    return NULL;
+  }
+
+  new_cfg = kzalloc(sizeof(*new_cfg), GFP_KERNEL);
+  if (!new_cfg) {
+    return NULL;
+  }
+
+  new_cfg->cfg = sensor_code;
+
+  new_cfg->type = find_type(sensor_code);
+  if (!new_cfg->type) {
+    printk(KERN_ERR DEVICE_NAME ": no submodule is registered for sensor code %d\n", sensor_code);
+    goto build_fail_1;
+  }
+
+  minor = alloc_sensor_minor(port);
+  if (minor < 0) {
+    printk(KERN_ERR DEVICE_NAME ": no free minor number for port %d\n", port);
+    goto build_fail_2;
+  }
+  new_cfg->devt = MKDEV(MAJOR(nxt_sense_dev.devt), minor);
+
+  nxt_sense_dev.port[port].pending_devt = new_cfg->devt;
+  nxt_sense_dev.port[port].pending_scl_value = 0;
+  new_cfg->instance = new_cfg->type->add(port, new_cfg->devt);
+  if (!new_cfg->instance) {
+    nxt_sense_dev.port[port].pending_devt = MKDEV(0, 0);
+    goto build_fail_3;
+  }
+
+  return new_cfg;
+
+ build_fail_3:
+  free_sensor_minor(new_cfg->devt);
+ build_fail_2:
+  module_put(new_cfg->type->owner);
+ build_fail_1:
+  kfree(new_cfg);
+  return NULL;
+}
+
+/* Removes a sensor that is no longer (or never was) the active one of its port */
+static void destroy_port_cfg(struct nxt_sense_port_cfg *old_cfg) {
+  int status;
+
+  /* The instance belongs to the submodule from here on, it is freed by the submodule */
+  status = old_cfg->type->remove(old_cfg->instance);
+  if (status < 0) {
+    printk(KERN_ERR DEVICE_NAME ": removing the sensor with code %d failed: %d\n", old_cfg->cfg, status);
+  }
+
+  module_put(old_cfg->type->owner);
+  free_sensor_minor(old_cfg->devt);
+  kfree(old_cfg);
+}
+
+/* Requires the nxt_sense_core_mutex. Returns 0 on success, else a negative code with every port left as it was, except for a sensor failing to start, whose port is left unconfigured */
 static int update_port_cfg(int cfg[]) {
-  int res;
   int i;
-  int error_occurred = 0;
+  int status;
+  int res = 0;
+  unsigned long flags;
+  bool changed[NUMBER_OF_PORTS];
+  struct nxt_sense_port_cfg *new_cfg[NUMBER_OF_PORTS];
+  struct nxt_sense_port_cfg *old_cfg[NUMBER_OF_PORTS];
+  struct nxt_sense_port *p;
+
   for (i = 0; i < NUMBER_OF_PORTS; ++i) {
-    if (cfg[i] < NONE_CODE || cfg[i] > MAX_SENSOR_CODE) {
+    if (cfg[i] < NONE_CODE || cfg[i] >= NXT_SENSE_MAX_TYPES) {
       return -1;
     }
   }
 
+  /* Phase 1: build the new sensors next to the old ones */
   for (i = 0; i < NUMBER_OF_PORTS; ++i) {
-    if (nxt_sense_dev.port_cfg[i] != cfg[i] && nxt_sense_dev.port_cfg[i] != NONWORKING_PORT_CODE) {
-      res = unload_nxt_sensor(i);
-      if (res != 0) {
-        error_occurred = -2;
-	continue;
+    p = &nxt_sense_dev.port[i];
+    changed[i] = port_code(i) != cfg[i];
+    new_cfg[i] = NULL;
+
+    if (!changed[i] || cfg[i] == NONE_CODE) {
+      continue;
+    }
+
+    new_cfg[i] = build_port_cfg(cfg[i], i);
+    if (!new_cfg[i]) {
+      goto update_rollback;
+    }
+  }
+
+  /* Phase 2: replace the old sensors, the readers of the unchanged ports are not disturbed */
+  for (i = 0; i < NUMBER_OF_PORTS; ++i) {
+    p = &nxt_sense_dev.port[i];
+    old_cfg[i] = NULL;
+
+    if (!changed[i]) {
+      continue;
+    }
+
+    old_cfg[i] = p->active;
+    p->scl_value = (new_cfg[i] ? p->pending_scl_value : 0);
+    rcu_assign_pointer(p->active, new_cfg[i]);
+    p->pending_devt = MKDEV(0, 0);
+  }
+
+  synchronize_rcu();
+
+  /* Phase 3: remove the old sensors, give the pins the state wanted by the new ones and start them. Only now a digital sensor creates the I2C bus, which drives SCL */
+  for (i = 0; i < NUMBER_OF_PORTS; ++i) {
+    p = &nxt_sense_dev.port[i];
+
+    if (!changed[i]) {
+      continue;
+    }
+
+    if (old_cfg[i]) {
+      destroy_port_cfg(old_cfg[i]);
+    }
+
+    /* The samples of the old sensor type say nothing about the new one */
+    spin_lock_irqsave(&p->stats.lock, flags);
+    stats_reset(&p->stats);
+    spin_unlock_irqrestore(&p->stats.lock, flags);
+
+    if (!p->i2c) {
+      gpio_set_value(nxt_sense_board_ports[i].scl_gpio, p->scl_value);
+    }
+
+    if (!new_cfg[i] || !new_cfg[i]->type->start) {
+      continue;
+    }
+
+    status = new_cfg[i]->type->start(new_cfg[i]->instance);
+    if (status != 0) {
+      printk(KERN_ERR DEVICE_NAME ": the sensor with code %d on port %d failed to start: %d\n", new_cfg[i]->cfg, i, status);
+
+      rcu_assign_pointer(p->active, NULL);
+      synchronize_rcu();
+      destroy_port_cfg(new_cfg[i]);
+
+      p->scl_value = 0;
+      if (!p->i2c) {
+        gpio_set_value(nxt_sense_board_ports[i].scl_gpio, 0);
       }
+      res = -4;
+    }
+  }
 
-      res = load_nxt_sensor(cfg[i], i);
-      if (res != 0) {
-	error_occurred = -3;
-	continue;
+  return res;
+
+ update_rollback:
+  for (--i; i >= 0; --i) {
+    p = &nxt_sense_dev.port[i];
+
+    if (!new_cfg[i]) {
+      continue;
+    }
+
+    destroy_port_cfg(new_cfg[i]);
+    p->pending_devt = MKDEV(0, 0);
+    if (!p->i2c) {
+      gpio_set_value(nxt_sense_board_ports[i].scl_gpio, p->scl_value);
+    }
+  }
+
+  return -3;
+}
+
+/***********************************************************************
+ *
+ * Sensor type auto-detection, probing the analog signature of the
+ * unconfigured ports
+ *
+ ***********************************************************************/
+/* Number of ADC samples taken for each SCL level */
+#define DETECT_SAMPLES 8
+/* Time for the LED of a light sensor to settle after switching SCL */
+#define DETECT_SETTLE_MS 10
+/* Thresholds for the 12 bit ADC readings */
+#define DETECT_OPEN_MIN 3900 /* An empty port (or a released touch sensor) is pulled up to the rail */
+#define DETECT_PRESSED_MAX 300 /* A pressed touch sensor shorts the input */
+#define DETECT_LED_DELTA 80 /* A light sensor sees the reflection of its own LED, which is switched by SCL */
+#define DETECT_NOISE_MIN 40 /* A sound sensor picks up ambient noise */
+
+/* Samples the ADC channel of the port with the SCL pin at the given level, giving the mean and the spread of the samples */
+static int detect_sample(int port, int scl_value, int *mean, int *spread) {
+  int i;
+  int sample;
+  int sum = 0;
+  int low = INT_MAX;
+  int high = 0;
+
+  gpio_set_value(nxt_sense_board_ports[port].scl_gpio, scl_value);
+  msleep(DETECT_SETTLE_MS);
+
+  for (i = 0; i < DETECT_SAMPLES; ++i) {
+    if (adc_sample_channel(nxt_sense_board_ports[port].adc_channel, &sample) != 0) {
+      return -1;
+    }
+    sum += sample;
+    low = min(low, sample);
+    high = max(high, sample);
+  }
+
+  *mean = sum / DETECT_SAMPLES;
+  *spread = high - low;
+
+  return 0;
+}
+
+/* Classifies the analog signature of an unconfigured port, returns the sensor code or NONE_CODE when nothing is recognised.
+ * Comments: An unpressed touch sensor cannot be told apart from an empty port, it is found by a later probe while pressed.
+ */
+static int detect_port(int port) {
+  int status;
+  int dark, dark_spread;
+  int lit, lit_spread;
+
+  status = detect_sample(port, 0, &dark, &dark_spread);
+  if (status == 0) {
+    status = detect_sample(port, 1, &lit, &lit_spread);
+  }
+  gpio_set_value(nxt_sense_board_ports[port].scl_gpio, 0);
+  nxt_sense_dev.port[port].scl_value = 0;
+
+  if (status != 0) {
+    printk(KERN_ERR DEVICE_NAME ": could not sample port %d for auto-detection\n", port);
+    return NONE_CODE;
+  }
+
+  printk(KERN_DEBUG DEVICE_NAME ": port %d signature: %d (%d) with SCL low, %d (%d) with SCL high\n", port, dark, dark_spread, lit, lit_spread);
+
+  if (abs(lit - dark) >= DETECT_LED_DELTA) {
+    return LIGHT_CODE;
+  }
+  if (dark <= DETECT_PRESSED_MAX) {
+    return TOUCH_CODE;
+  }
+  if (dark >= DETECT_OPEN_MIN) {
+    return NONE_CODE;
+  }
+  if (dark_spread >= DETECT_NOISE_MIN || lit_spread >= DETECT_NOISE_MIN) {
+    return SOUND_CODE;
+  }
+
+  /* A steady reading in the middle of the range: a light sensor not seeing its own LED */
+  return LIGHT_CODE;
+}
+
+/* Looks for a LEGO digital sensor on the I2C bus of a port that showed no analog sensor, returns the sensor code or NONE_CODE */
+static int detect_i2c_port(int port) {
+  struct nxt_i2c_port *i2c;
+  u8 reg = NXT_DIGITAL_TYPE_REG;
+  char id[NXT_DIGITAL_ID_LEN + 1];
+  struct i2c_msg msgs[2] = {
+    {.addr = NXT_DIGITAL_ADDR, .flags = 0, .len = 1, .buf = &reg},
+    {.addr = NXT_DIGITAL_ADDR, .flags = I2C_M_RD, .len = NXT_DIGITAL_ID_LEN, .buf = (u8 *) id},
+  };
+  int status;
+
+  /* The port is unconfigured, so nothing else uses its pins. No adapter is registered for the probe, the bus only shows up once a sensor is configured */
+  if (nxt_sense_dev.port[port].i2c) {
+    return NONE_CODE;
+  }
+
+  i2c = nxt_i2c_open(nxt_sense_board_ports[port].scl_gpio, nxt_sense_board_ports[port].sda_gpio, nxt_sense_board_ports[port].sda_dir_gpio);
+  if (!i2c) {
+    return NONE_CODE;
+  }
+
+  status = nxt_i2c_transfer(i2c, msgs, 2);
+  nxt_i2c_close(i2c);
+
+  if (status != 2) {
+    return NONE_CODE;
+  }
+
+  id[NXT_DIGITAL_ID_LEN] = '\0';
+  printk(KERN_DEBUG DEVICE_NAME ": port %d has the digital sensor \"%s\"\n", port, id);
+
+  if (strncmp(id, "Sonar", 5) == 0) {
+    return ULTRASONIC_CODE;
+  }
+
+  /* Some other digital sensor, left to i2c-dev or an in-kernel I2C driver */
+  return I2C_CODE;
+}
+
+/* Probes every port configured as NONE_CODE and loads the submodule for the detected sensors, requires the nxt_sense_core_mutex */
+static void detect_ports(void) {
+  int i;
+  int j;
+  int code;
+  int cfg[NUMBER_OF_PORTS];
+
+  for (i = 0; i < NUMBER_OF_PORTS; ++i) {
+    if (port_code(i) != NONE_CODE || boot_cfg[i] != NONE_CODE) {
+      continue;
+    }
+
+    code = detect_port(i);
+    if (code == NONE_CODE) {
+      code = detect_i2c_port(i);
+    }
+    if (code == NONE_CODE) {
+      continue;
+    }
+
+    printk(KERN_INFO DEVICE_NAME ": detected sensor code %d on port %d\n", code, i);
+
+    /* One port at a time, so a sensor failing to load does not hold back the others */
+    for (j = 0; j < NUMBER_OF_PORTS; ++j) {
+      cfg[j] = port_code(j);
+    }
+    cfg[i] = code;
+
+    if (update_port_cfg(cfg) != 0) {
+      printk(KERN_ERR DEVICE_NAME ": could not load the detected sensor code %d on port %d\n", code, i);
+    }
+  }
+}
+
+static void autodetect_work_handler(struct work_struct *work) {
+  mutex_lock(&nxt_sense_core_mutex);
+  detect_ports();
+  mutex_unlock(&nxt_sense_core_mutex);
+
+  if (autodetect_interval > 0) {
+    schedule_delayed_work(&autodetect_work, autodetect_interval * HZ);
+  }
+}
+
+/***********************************************************************
+ *
+ * Boot-time configuration from the ports module parameter or the
+ * config_file firmware file. The submodules depend on nxt_sense, so
+ * they cannot be loaded before nxt_sense_init() returns: the ports of
+ * the types not registered yet are configured as soon as their
+ * submodule registers, i.e. before its insmod returns.
+ *
+ ***********************************************************************/
+/* Parses one sensor code per port, returns the number of codes read */
+static int parse_port_cfg(const char *buf, int cfg[]) {
+  int res = 0;
+  int consumed;
+  const char *pos = buf;
+
+  while (res < NUMBER_OF_PORTS && sscanf(pos, "%d%n", &cfg[res], &consumed) == 1) {
+    pos += consumed;
+    ++res;
+  }
+
+  return res;
+}
+
+/* Configures the waiting ports whose type is registered, with load_modules the missing submodules are requested first. Requires the nxt_sense_core_mutex */
+static void apply_boot_cfg(bool load_modules) {
+  int i;
+  int cfg[NUMBER_OF_PORTS];
+  bool changed = false;
+  struct nxt_sense_type_ops *ops;
+
+  for (i = 0; i < NUMBER_OF_PORTS; ++i) {
+    cfg[i] = port_code(i);
+
+    if (boot_cfg[i] == NONE_CODE) {
+      continue;
+    }
+
+    ops = (load_modules ? find_type(boot_cfg[i]) : get_type(boot_cfg[i]));
+    if (!ops) {
+      if (load_modules) {
+        printk(KERN_ERR DEVICE_NAME ": no submodule for sensor code %d, port %d is left unconfigured\n", boot_cfg[i], i);
+        boot_cfg[i] = NONE_CODE;
       }
+      continue;
+    }
+    module_put(ops->owner); /* build_port_cfg() takes its own reference */
+
+    cfg[i] = boot_cfg[i];
+    boot_cfg[i] = NONE_CODE;
+    changed = true;
+  }
+
+  if (changed && update_port_cfg(cfg) != 0) {
+    printk(KERN_ERR DEVICE_NAME ": the boot-time configuration could not be applied\n");
+  }
+}
+
+static void boot_cfg_type_registered(int code) {
+  /* The core mutex is held while nxt_sense waits in request_module() for the very submodule registering here, so this must not block on it */
+  if (mutex_trylock(&nxt_sense_core_mutex)) {
+    apply_boot_cfg(false);
+    mutex_unlock(&nxt_sense_core_mutex);
+  } else {
+    schedule_work(&boot_cfg_work);
+  }
+}
+
+/* Loads the submodules no one has loaded yet, for the systems having the modules where modprobe finds them */
+static void boot_cfg_work_handler(struct work_struct *work) {
+  mutex_lock(&nxt_sense_core_mutex);
+  apply_boot_cfg(true);
+  mutex_unlock(&nxt_sense_core_mutex);
+}
+
+/* Drops the unknown sensor codes from boot_cfg */
+static void check_boot_cfg(void) {
+  int i;
+
+  for (i = 0; i < NUMBER_OF_PORTS; ++i) {
+    if (boot_cfg[i] != NONE_CODE && !valid_type_code(boot_cfg[i])) {
+      printk(KERN_ERR DEVICE_NAME ": ignoring the unknown sensor code %d for port %d\n", boot_cfg[i], i);
+      boot_cfg[i] = NONE_CODE;
+    }
+  }
+}
+
+/* Completion of the config_file request, applying it like the ports parameter. fw is NULL when the file could not be read */
+static void config_file_loaded(const struct firmware *fw, void *context) {
+  char *text;
+  int res;
+  int cfg[NUMBER_OF_PORTS];
+
+  if (!fw) {
+    printk(KERN_ERR DEVICE_NAME ": could not read the config_file %s\n", config_file);
+    return;
+  }
+
+  text = kmalloc(fw->size + 1, GFP_KERNEL);
+  if (!text) {
+    release_firmware(fw);
+    return;
+  }
+  memcpy(text, fw->data, fw->size);
+  text[fw->size] = '\0';
+  release_firmware(fw);
+
+  res = parse_port_cfg(text, cfg);
+  kfree(text);
+
+  if (res != NUMBER_OF_PORTS) {
+    printk(KERN_ERR DEVICE_NAME ": the config_file %s does not hold %d sensor codes\n", config_file, NUMBER_OF_PORTS);
+    return;
+  }
+
+  mutex_lock(&nxt_sense_core_mutex);
+  memcpy(boot_cfg, cfg, sizeof(boot_cfg));
+  check_boot_cfg();
+  apply_boot_cfg(false);
+  mutex_unlock(&nxt_sense_core_mutex);
+
+  schedule_work(&boot_cfg_work);
+}
+
+/* Returns 0 when boot_cfg is ready to be applied. The config_file is requested without waiting, as the firmware loader may wait for user space (which may not even run yet while modules load), and applied by config_file_loaded() */
+static int __init read_boot_cfg(void) {
+  int error;
 
+  if (ports_count > 0) {
+    if (ports_count != NUMBER_OF_PORTS) {
+      printk(KERN_ERR DEVICE_NAME ": ports takes %d sensor codes\n", NUMBER_OF_PORTS);
+      return -1;
     }
+    memcpy(boot_cfg, ports, sizeof(boot_cfg));
+  } else if (config_file && config_file[0] != '\0') {
+    error = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG, config_file, nxt_sense_dev.device, GFP_KERNEL, NULL, config_file_loaded);
+    if (error) {
+      printk(KERN_ERR DEVICE_NAME ": could not request the config_file %s: %d\n", config_file, error);
+    }
+    return -1;
+  }
+
+  check_boot_cfg();
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * Sysfs entries for the statistics, added by nxt_sense to every sensor
+ * device
+ *
+ ***********************************************************************/
+static struct nxt_sense_stats *dev_to_stats(struct device *dev) {
+  return &nxt_sense_dev.port[nxt_sense_dev.sensor_minor_port[MINOR(dev->devt) - SENSOR_MINOR_MIN]].stats;
+}
+
+/* Shows "count min max mean variance rate" of the last complete window, the rate in samples per second */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct nxt_sense_stats *stats = dev_to_stats(dev);
+  struct nxt_sense_stats_window window;
+  unsigned int window_ms;
+  s64 mean;
+  s64 variance;
+  unsigned long flags;
+
+  spin_lock_irqsave(&stats->lock, flags);
+  stats_expire(stats, jiffies);
+  window = stats->last_window;
+  window_ms = stats->last_window_ms;
+  spin_unlock_irqrestore(&stats->lock, flags);
+
+  if (window.count == 0 || window_ms == 0) {
+    return scnprintf(buf, PAGE_SIZE, "0 0 0 0 0 0\n");
+  }
+
+  mean = div_s64(window.sum, window.count);
+  variance = (s64) div_u64(window.sum_of_squares, window.count) - mean * mean;
+
+  return scnprintf(buf, PAGE_SIZE, "%u %d %d %lld %lld %u\n", window.count, window.min, window.max, mean, variance, (unsigned int) ((u64) window.count * 1000 / window_ms));
+}
+
+static ssize_t stats_window_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  return scnprintf(buf, PAGE_SIZE, "%u\n", dev_to_stats(dev)->window_ms);
+}
+
+/* Takes the window length in milliseconds, starting over with the statistics */
+static ssize_t stats_window_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  struct nxt_sense_stats *stats = dev_to_stats(dev);
+  unsigned int window_ms;
+  unsigned long flags;
+
+  if (sscanf(buf, "%u", &window_ms) != 1 || window_ms == 0) {
+    printk(KERN_WARNING DEVICE_NAME ": stats_window takes a positive number of milliseconds\n");
+    return count;
   }
 
-  return error_occurred;
+  spin_lock_irqsave(&stats->lock, flags);
+  stats->window_ms = window_ms;
+  stats_reset(stats);
+  spin_unlock_irqrestore(&stats->lock, flags);
+
+  return count;
 }
 
+DEVICE_ATTR(stats, S_IRUGO, stats_show, NULL);
+DEVICE_ATTR(stats_window, (S_IRUGO | S_IWUSR), stats_window_show, stats_window_store);
 
 /***********************************************************************
  *
@@ -228,12 +1109,12 @@ static int update_port_cfg(int cfg[]) {
  ***********************************************************************/
 
 /* Just a utility function, not meant to be used as a hook
- * Comments: nxt_sense implements that there is a correspondence between port number and minor number for now, but keeps the implementation details like this in nxt_sense_core
+ * Comments: the minor numbers of the sensors are handed out by build_port_cfg(), the port of a minor number is kept in nxt_sense_dev.sensor_minor_port
  */
 static bool valid_devt(dev_t *devt) {
   bool res = false;
   if (MAJOR(*devt) == MAJOR(nxt_sense_dev.devt)) {
-    if (MINOR(*devt) >= PORT_MIN && MINOR(*devt) < (PORT_MIN + NUMBER_OF_PORTS)) {
+    if (MINOR(*devt) >= SENSOR_MINOR_MIN && MINOR(*devt) < (SENSOR_MINOR_MIN + NUMBER_OF_SENSOR_MINORS)) {
       res = true;
     }
   }
@@ -248,77 +1129,121 @@ int nxt_setup_sensor_chrdev(const struct file_operations *fops, struct nxt_sense
     return -1;
   }
 
-  cdev_init(&nxt_sense_device_data->cdev, fops);
-  
-  error = cdev_add(&nxt_sense_device_data->cdev, nxt_sense_device_data->devt, 1);
+  nxt_sense_device_data->port = nxt_sense_dev.sensor_minor_port[MINOR(nxt_sense_device_data->devt) - SENSOR_MINOR_MIN];
+  nxt_sense_device_data->get_sample = get_sample;
+  nxt_sense_device_data->get_samples = get_samples;
+  nxt_sense_device_data->scl = scl;
+
+  /* Set before cdev_add(), as the device may be opened at once */
+  spin_lock(&nxt_sense_dev.sensor_data_lock);
+  nxt_sense_dev.sensor_minor_data[MINOR(nxt_sense_device_data->devt) - SENSOR_MINOR_MIN] = nxt_sense_device_data;
+  spin_unlock(&nxt_sense_dev.sensor_data_lock);
+
+  /* Not embedded in the instance: the open files hold the cdev until they are released, which may be after the last reference to the instance is put */
+  nxt_sense_device_data->cdev = cdev_alloc();
+  if (!nxt_sense_device_data->cdev) {
+    printk(KERN_ERR DEVICE_NAME ": could not allocate cdev for %s\n", name);
+    goto setup_fail_1;
+  }
+  nxt_sense_device_data->cdev->ops = fops;
+  nxt_sense_device_data->cdev->owner = fops->owner;
+
+  error = cdev_add(nxt_sense_device_data->cdev, nxt_sense_device_data->devt, 1);
   if (error) {
     printk(KERN_ERR DEVICE_NAME ": could not add cdev for %s: %d\n", name, error);
-    return -1;
+    goto setup_fail_2;
   }
 
   /* Having the first NULL replaced with nxt_sense_dev.device : what does it exactly do? */
-  nxt_sense_device_data->device = device_create(nxt_sense_dev.class, NULL, nxt_sense_device_data->devt, NULL, "%s%d", name, MINOR(nxt_sense_device_data->devt)); /* Hardcoded correspondence between minor number and port number */
+  nxt_sense_device_data->device = device_create(nxt_sense_dev.class, NULL, nxt_sense_device_data->devt, NULL, "%s%d", name, nxt_sense_device_data->port); /* Named after the port, the minor number is just the next free one */
   if (IS_ERR(nxt_sense_device_data->device)) {
-    printk(KERN_ERR DEVICE_NAME ": device_create() failed for sensor %s%d: %ld", name, MINOR(nxt_sense_device_data->devt), PTR_ERR(nxt_sense_device_data->device));
-    cdev_del(&nxt_sense_device_data->cdev);
-    return -1;
+    printk(KERN_ERR DEVICE_NAME ": device_create() failed for sensor %s%d: %ld", name, nxt_sense_device_data->port, PTR_ERR(nxt_sense_device_data->device));
+    goto setup_fail_2;
   }
 
-  switch (MINOR(nxt_sense_device_data->devt)) {
-  case 0:
-    nxt_sense_device_data->get_sample = get_sample_0;
-    break;
-  case 1:
-    nxt_sense_device_data->get_sample = get_sample_1;
-    break;
-  case 2:
-    nxt_sense_device_data->get_sample = get_sample_2;
-    break;
-  case 3:
-    nxt_sense_device_data->get_sample = get_sample_3;
-    break;
-  default:
-    printk(KERN_WARNING DEVICE_NAME ": The given minor number in devt is valid but the hardcoded values for setting up sampling functions is incorrect - FIX ME NOW!\n");
-    return -1;
-  }
-
-  switch (MINOR(nxt_sense_device_data->devt)) {
-  case 0:
-    nxt_sense_device_data->scl = scl_0;
-    break;
-  case 1:
-    nxt_sense_device_data->scl = scl_1;
-    break;
-  case 2:
-    nxt_sense_device_data->scl = scl_2;
-    break;
-  case 3:
-    nxt_sense_device_data->scl = scl_3;
-    break;
-  default:
-    printk(KERN_WARNING DEVICE_NAME ": The given minor number in devt is valid but the hardcoded values for setting up scl functions is incorrect - FIX ME NOW!\n");
-    return -1;
+  if (device_create_file(nxt_sense_device_data->device, &dev_attr_stats) || device_create_file(nxt_sense_device_data->device, &dev_attr_stats_window)) {
+    printk(KERN_ERR DEVICE_NAME ": device_create_file(stats) failed for sensor %s%d\n", name, nxt_sense_device_data->port);
+    device_remove_file(nxt_sense_device_data->device, &dev_attr_stats);
+    device_destroy(nxt_sense_dev.class, nxt_sense_device_data->devt);
+    goto setup_fail_2;
   }
 
   return 0;
+
+ setup_fail_2:
+  cdev_del(nxt_sense_device_data->cdev); /* Also frees a cdev never added */
+  nxt_sense_device_data->cdev = NULL;
+ setup_fail_1:
+  spin_lock(&nxt_sense_dev.sensor_data_lock);
+  nxt_sense_dev.sensor_minor_data[MINOR(nxt_sense_device_data->devt) - SENSOR_MINOR_MIN] = NULL;
+  spin_unlock(&nxt_sense_dev.sensor_data_lock);
+  return -1;
 }
+EXPORT_SYMBOL(nxt_setup_sensor_chrdev);
 
 int nxt_teardown_sensor_chrdev(struct nxt_sense_device_data *nxt_sense_device_data) {
   if (!valid_devt(&nxt_sense_device_data->devt)) {
     return -1;
   }
 
+  /* No new opens, the files still open keep their reference to the instance and get -ENODEV from get_sample() and get_samples() */
+  spin_lock(&nxt_sense_dev.sensor_data_lock);
+  nxt_sense_dev.sensor_minor_data[MINOR(nxt_sense_device_data->devt) - SENSOR_MINOR_MIN] = NULL;
+  nxt_sense_device_data->removed = true;
+  spin_unlock(&nxt_sense_dev.sensor_data_lock);
+
+  device_remove_file(nxt_sense_device_data->device, &dev_attr_stats_window);
+  device_remove_file(nxt_sense_device_data->device, &dev_attr_stats);
   device_destroy(nxt_sense_dev.class, nxt_sense_device_data->devt);
-  cdev_del(&nxt_sense_device_data->cdev);
+  cdev_del(nxt_sense_device_data->cdev); /* Freed with the last open file */
+  nxt_sense_device_data->cdev = NULL;
 
+  nxt_sense_device_data->scl(nxt_sense_device_data, SCL_LOW); /* reset the SCL pin, only done while the sensor still owns it */
   nxt_sense_device_data->devt = MKDEV(0, 0);
   nxt_sense_device_data->device = NULL;
-  nxt_sense_device_data->get_sample = NULL;
-  nxt_sense_device_data->scl(SCL_LOW); /* reset the SCL pin */
   nxt_sense_device_data->scl = NULL;
 
   return 0;
 }
+EXPORT_SYMBOL(nxt_teardown_sensor_chrdev);
+
+static void release_device_data(struct kref *kref) {
+  struct nxt_sense_device_data *nxt_sense_device_data = container_of(kref, struct nxt_sense_device_data, kref);
+
+  nxt_sense_device_data->release(nxt_sense_device_data);
+}
+
+/* Called by the submodules on a new instance, before nxt_setup_sensor_chrdev(). The port holds the first reference, release is called when the last one is put */
+void nxt_sense_init_device_data(struct nxt_sense_device_data *nxt_sense_device_data, void (*release)(struct nxt_sense_device_data *)) {
+  kref_init(&nxt_sense_device_data->kref);
+  nxt_sense_device_data->release = release;
+}
+EXPORT_SYMBOL(nxt_sense_init_device_data);
+
+/* For the open of a sensor device: the instance behind the device file with a reference taken, or NULL when the port was reconfigured in the meantime */
+struct nxt_sense_device_data *nxt_sense_get_device_data(struct inode *inode) {
+  struct nxt_sense_device_data *nxt_sense_device_data = NULL;
+  dev_t devt = inode->i_rdev;
+
+  if (!valid_devt(&devt)) {
+    return NULL;
+  }
+
+  spin_lock(&nxt_sense_dev.sensor_data_lock);
+  nxt_sense_device_data = nxt_sense_dev.sensor_minor_data[MINOR(devt) - SENSOR_MINOR_MIN];
+  if (nxt_sense_device_data) {
+    kref_get(&nxt_sense_device_data->kref);
+  }
+  spin_unlock(&nxt_sense_dev.sensor_data_lock);
+
+  return nxt_sense_device_data;
+}
+EXPORT_SYMBOL(nxt_sense_get_device_data);
+
+void nxt_sense_put_device_data(struct nxt_sense_device_data *nxt_sense_device_data) {
+  kref_put(&nxt_sense_device_data->kref, release_device_data);
+}
+EXPORT_SYMBOL(nxt_sense_put_device_data);
 
 /***********************************************************************
  *
@@ -326,35 +1251,52 @@ int nxt_teardown_sensor_chrdev(struct nxt_sense_device_data *nxt_sense_device_da
  *
  ***********************************************************************/
 static ssize_t nxt_sense_show(struct device *dev, struct device_attribute *attr, char *buf) {
-  
-  return scnprintf(buf, PAGE_SIZE, "%d %d %d %d\n", nxt_sense_dev.port_cfg[0], nxt_sense_dev.port_cfg[1], nxt_sense_dev.port_cfg[2], nxt_sense_dev.port_cfg[3]);
+  ssize_t len = 0;
+  int i;
+
+  for (i = 0; i < NUMBER_OF_PORTS; ++i) {
+    len += scnprintf(buf + len, PAGE_SIZE - len, (i == 0 ? "%d" : " %d"), port_code(i));
+  }
+  len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+  return len;
 }
 
+/* Takes one integer (sensor code) per port */
 static ssize_t nxt_sense_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
   int p[NUMBER_OF_PORTS];
   int res;
   int status;
 
-  res = sscanf(buf, "%d %d %d %d", &p[0], &p[1], &p[2], &p[3]);
+  res = parse_port_cfg(buf, p);
 
   if (res != NUMBER_OF_PORTS) {
-    printk(KERN_WARNING DEVICE_NAME ": sysfs input was not four integers!\n");
+    printk(KERN_WARNING DEVICE_NAME ": sysfs input was not %d integers!\n", NUMBER_OF_PORTS);
   } else {
-    printk(KERN_DEBUG DEVICE_NAME ": sysfs input: %d %d %d %d\n", p[0], p[1], p[2], p[3]);
-
     mutex_lock(&nxt_sense_core_mutex);
+    memset(boot_cfg, 0, sizeof(boot_cfg)); /* An explicit configuration replaces what is still waiting from the boot-time one */
     status = update_port_cfg(p);
     mutex_unlock(&nxt_sense_core_mutex);
     if (status != 0) {
-      printk(KERN_ERR DEVICE_NAME ": error from update_port_cfg([%d] [%d] [%d] [%d]): %d\n", p[0], p[1], p[2], p[3], status);
+      printk(KERN_ERR DEVICE_NAME ": error from update_port_cfg(%s): %d\n", buf, status);
     }
   }
 
   return count;
 }
 
+/* Any write probes the unconfigured ports for sensors, returning when the detected sensors are loaded */
+static ssize_t rescan_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  mutex_lock(&nxt_sense_core_mutex);
+  detect_ports();
+  mutex_unlock(&nxt_sense_core_mutex);
+
+  return count;
+}
+
 /* See linux/stat.h for more info: S_IRUGO gives read permission for everyone and S_IWUSR gives write permission for the user (in this case root is the owner) */
 DEVICE_ATTR(config, (S_IRUGO | S_IWUSR), nxt_sense_show, nxt_sense_store);
+DEVICE_ATTR(rescan, S_IWUSR, NULL, rescan_store);
 
 /***********************************************************************
  *
@@ -365,18 +1307,6 @@ static const struct file_operations nxt_sense_fops = {
   .owner =	THIS_MODULE,
 };
 
-/* Most of this function could be placed in a macro to only write the code once */
-#define GPIO_INIT_MACRO(_port)						\
-  if (gpio_request(GPIO_SCL_##_port, "SCL" #_port)) {			\
-    printk(KERN_CRIT DEVICE_NAME ": gpio_request for pin %d failed\n", GPIO_SCL_##_port); \
-    goto init_gpio_pins_fail_##_port;					\
-  }									\
-  									\
-  if (gpio_direction_output(GPIO_SCL_##_port, 0)) {			\
-    printk(KERN_CRIT DEVICE_NAME ": could not set direction output on pin %d\n", GPIO_SCL_##_port); \
-    goto init_gpio_pins_fail_##_port;					\
-  }
-
 static int __init nxt_sense_level_shifter_init(void) {
   if (register_use_of_level_shifter(LS_U3_1)) {
     printk(KERN_CRIT DEVICE_NAME ": register_use_of_level_shifter failed for LS_U3_1\n");
@@ -387,23 +1317,38 @@ static int __init nxt_sense_level_shifter_init(void) {
 }
 
 
+static void nxt_sense_free_gpio_pins(int count) {
+  int i;
+
+  for (i = count - 1; i >= 0; --i) {
+    gpio_free(nxt_sense_board_ports[i].scl_gpio);
+  }
+}
+
 static int __init nxt_sense_init_gpio_pins(void) {
-  GPIO_INIT_MACRO(1);
-  GPIO_INIT_MACRO(2);
-  GPIO_INIT_MACRO(3);
-  GPIO_INIT_MACRO(4);
+  int i;
+  int pin;
+
+  for (i = 0; i < NUMBER_OF_PORTS; ++i) {
+    pin = nxt_sense_board_ports[i].scl_gpio;
+
+    if (gpio_request(pin, "SCL")) {
+      printk(KERN_CRIT DEVICE_NAME ": gpio_request for pin %d failed\n", pin);
+      goto init_gpio_pins_fail;
+    }
+
+    if (gpio_direction_output(pin, 0)) {
+      printk(KERN_CRIT DEVICE_NAME ": could not set direction output on pin %d\n", pin);
+      gpio_free(pin);
+      goto init_gpio_pins_fail;
+    }
+  }
 
   return 0;
 
- init_gpio_pins_fail_4:
-  gpio_free(GPIO_SCL_3);
- init_gpio_pins_fail_3:
-  gpio_free(GPIO_SCL_2);
- init_gpio_pins_fail_2:
-  gpio_free(GPIO_SCL_1);
- init_gpio_pins_fail_1:
+ init_gpio_pins_fail:
+  nxt_sense_free_gpio_pins(i);
   return -1;
-
 }
 
 static int __init nxt_sense_init_cdev(void)
@@ -411,6 +1356,7 @@ static int __init nxt_sense_init_cdev(void)
   int error;
 
   nxt_sense_dev.devt = MKDEV(0, 0);
+  spin_lock_init(&nxt_sense_dev.sensor_data_lock);
 
   error = alloc_chrdev_region(&nxt_sense_dev.devt, 0, NUMBER_OF_DEVICES, DEVICE_NAME);
   if (error < 0) {
@@ -456,12 +1402,25 @@ static int __init nxt_sense_init_class(void)
     return -1;
   }
 
+  if (device_create_file(nxt_sense_dev.device, &dev_attr_rescan)) {
+    printk(KERN_CRIT DEVICE_NAME ": device_create_file(rescan) failed\n");
+    device_remove_file(nxt_sense_dev.device, &dev_attr_config);
+    device_destroy(nxt_sense_dev.class, MKDEV(MAJOR(nxt_sense_dev.devt), NXT_SENSE_MINOR));
+    class_destroy(nxt_sense_dev.class);
+    return -1;
+  }
+
   return 0;
 }
 
 static int __init nxt_sense_init(void) {
+  int i;
   printk(KERN_DEBUG DEVICE_NAME ": Initialising nxt_sense...\n");
   memset(&nxt_sense_dev, 0, sizeof(nxt_sense_dev));
+  for (i = 0; i < NUMBER_OF_PORTS; ++i) {
+    spin_lock_init(&nxt_sense_dev.port[i].stats.lock);
+    nxt_sense_dev.port[i].stats.window_ms = STATS_DEFAULT_WINDOW_MS;
+  }
 
   if (nxt_sense_level_shifter_init() < 0)
     goto fail_1;
@@ -475,17 +1434,43 @@ static int __init nxt_sense_init(void) {
   if (nxt_sense_init_class() < 0)  
     goto fail_4;
 
+  nxt_i2c_engine_init();
+
+  if (nxt_reflex_init(nxt_sense_dev.device, NUMBER_OF_PORTS, reflex_sample_port) < 0)
+    goto fail_5;
+
+  INIT_WORK(&boot_cfg_work, boot_cfg_work_handler);
+  nxt_sense_register_type(&i2c_type_ops);
+
+  /* The types registered already (the built-in ones) are configured right away, the others when their submodule registers */
+  if (read_boot_cfg() == 0) {
+    mutex_lock(&nxt_sense_core_mutex);
+    apply_boot_cfg(false);
+    mutex_unlock(&nxt_sense_core_mutex);
+    schedule_work(&boot_cfg_work);
+  }
+
+  /* Probing loads submodules depending on nxt_sense, so it is left to the workqueue instead of blocking the initialisation */
+  INIT_DELAYED_WORK(&autodetect_work, autodetect_work_handler);
+  if (autodetect || autodetect_interval > 0) {
+    schedule_delayed_work(&autodetect_work, 0);
+  }
+
   return 0;
 
+ fail_5:
+  nxt_i2c_engine_exit();
+  device_remove_file(nxt_sense_dev.device, &dev_attr_rescan);
+  device_remove_file(nxt_sense_dev.device, &dev_attr_config);
+  device_destroy(nxt_sense_dev.class, MKDEV(MAJOR(nxt_sense_dev.devt), NXT_SENSE_MINOR));
+  class_destroy(nxt_sense_dev.class);
+
  fail_4:
   cdev_del(&nxt_sense_dev.cdev);
   unregister_chrdev_region(nxt_sense_dev.devt, NUMBER_OF_DEVICES);
 
  fail_3:
-  gpio_free(GPIO_SCL_4);
-  gpio_free(GPIO_SCL_3);
-  gpio_free(GPIO_SCL_2);
-  gpio_free(GPIO_SCL_1);
+  nxt_sense_free_gpio_pins(NUMBER_OF_PORTS);
 
  fail_2:
   unregister_use_of_level_shifter(LS_U3_1);
@@ -496,9 +1481,17 @@ static int __init nxt_sense_init(void) {
 module_init(nxt_sense_init);
 
 static void __exit nxt_sense_exit(void) {
-  int p[NUMBER_OF_PORTS] = {0, 0, 0, 0};
+  int p[NUMBER_OF_PORTS];
+  memset(p, 0, sizeof(p)); /* NONE_CODE on every port */
+
+  cancel_delayed_work_sync(&autodetect_work);
+  cancel_work_sync(&boot_cfg_work);
   update_port_cfg(p);
+  nxt_sense_unregister_type(&i2c_type_ops);
+  nxt_reflex_exit();
+  nxt_i2c_engine_exit();
 
+  device_remove_file(nxt_sense_dev.device, &dev_attr_rescan);
   device_remove_file(nxt_sense_dev.device, &dev_attr_config);
   device_destroy(nxt_sense_dev.class, MKDEV(MAJOR(nxt_sense_dev.devt), NXT_SENSE_MINOR));
   class_destroy(nxt_sense_dev.class);
@@ -506,10 +1499,7 @@ static void __exit nxt_sense_exit(void) {
   cdev_del(&nxt_sense_dev.cdev);
   unregister_chrdev_region(nxt_sense_dev.devt, NUMBER_OF_DEVICES);
 
-  gpio_free(GPIO_SCL_1);
-  gpio_free(GPIO_SCL_2);
-  gpio_free(GPIO_SCL_3);
-  gpio_free(GPIO_SCL_4);
+  nxt_sense_free_gpio_pins(NUMBER_OF_PORTS);
   unregister_use_of_level_shifter(LS_U3_1);
 
   printk(KERN_DEBUG DEVICE_NAME ": Exiting nxt_sense...\n");
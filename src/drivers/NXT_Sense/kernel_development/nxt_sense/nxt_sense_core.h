@@ -1,17 +1,88 @@
 #ifndef __H_nxt_sense_core_h_
 #define __H_nxt_sense_core_h_
 
+/* sensor types - the codes are the values written to the config attribute of nxt_sense */
+#define NONWORKING_PORT_CODE -1
+#define NONE_CODE 0
+#define TOUCH_CODE 1
+#define LIGHT_CODE 2
+#define SOUND_CODE 3
+#define I2C_CODE 4 /* The bare I2C bus of the port, for i2c-dev */
+#define ULTRASONIC_CODE 5
+/* Size of the sensor type table, valid type codes are 1 to NXT_SENSE_MAX_TYPES - 1 */
+#define NXT_SENSE_MAX_TYPES 8
+
+/* Submodules declare this alias, so nxt_sense can load them on demand through request_module() */
+#define NXT_SENSE_TYPE_ALIAS_PREFIX "nxt-sense-type-"
+#define MODULE_ALIAS_NXT_SENSE_TYPE(_code) MODULE_ALIAS(NXT_SENSE_TYPE_ALIAS_PREFIX __stringify(_code))
+
+/* The I2C address and common registers of the LEGO digital sensors */
+#define NXT_DIGITAL_ADDR 0x01
+#define NXT_DIGITAL_VERSION_REG 0x00
+#define NXT_DIGITAL_VENDOR_REG 0x08
+#define NXT_DIGITAL_TYPE_REG 0x10
+#define NXT_DIGITAL_ID_LEN 8
+
 enum scl_bit_flags {SCL_LOW = 0, SCL_HIGH, SCL_TOGGLE};
 
 struct nxt_sense_device_data {
   dev_t devt;
-  struct cdev cdev;
+  struct cdev *cdev; /* Allocated apart from the instance, as the open files of the device still use it after the instance is freed */
   struct device *device;
-  int (*get_sample)(int *);
-  int (*scl)(enum scl_bit_flags);
+  int port;
+  bool removed; /* Set by nxt_teardown_sensor_chrdev(), the files still open get -ENODEV */
+  struct kref kref; /* Held by the port and by every open file, see nxt_sense_get_device_data() */
+  void (*release)(struct nxt_sense_device_data *); /* Frees the instance with its last reference */
+  int (*get_sample)(struct nxt_sense_device_data *, int *);
+  int (*get_samples)(struct nxt_sense_device_data *, int *, int, unsigned int); /* A burst of count samples at the given rate, see adc_sample_channel_burst() */
+  int (*scl)(struct nxt_sense_device_data *, enum scl_bit_flags);
+};
+
+/* The hooks a sensor type submodule hands to nxt_sense_register_type(), add, start and remove are called with the nxt_sense_core_mutex held.
+ * add allocates the instance for the port (returning NULL on failure) and remove releases it again. add runs while the old sensor of the port is still active, so it must not touch the pins of the port.
+ * start is optional, called once the instance replaced the old sensor and owns the pins, e.g. for a digital sensor to take the I2C bus of the port. An instance failing to start is removed again, leaving its port unconfigured.
+ */
+struct nxt_sense_type_ops {
+  int code;
+  const char *name;
+  struct module *owner;
+  struct nxt_sense_device_data *(*add)(int port, dev_t devt);
+  int (*start)(struct nxt_sense_device_data *);
+  int (*remove)(struct nxt_sense_device_data *);
 };
 
 extern int nxt_setup_sensor_chrdev(const struct file_operations *, struct nxt_sense_device_data *, const char *);
 extern int nxt_teardown_sensor_chrdev(struct nxt_sense_device_data *);
+extern void nxt_sense_init_device_data(struct nxt_sense_device_data *, void (*)(struct nxt_sense_device_data *));
+extern struct nxt_sense_device_data *nxt_sense_get_device_data(struct inode *);
+extern void nxt_sense_put_device_data(struct nxt_sense_device_data *);
+
+/* Digital sensors share the I2C bus of their port, only valid from within the start and remove hooks */
+extern struct i2c_adapter *nxt_sense_get_i2c_adapter(struct nxt_sense_device_data *);
+extern void nxt_sense_put_i2c_adapter(struct nxt_sense_device_data *);
+
+/* Counts a reading in the statistics of the port, for sensors not sampling through get_sample() */
+extern void nxt_sense_add_stats_sample(struct nxt_sense_device_data *, int);
+
+extern int nxt_sense_register_type(struct nxt_sense_type_ops *);
+extern int nxt_sense_unregister_type(struct nxt_sense_type_ops *);
+
+/* An action of the reflex engine, bound to a sensor condition by the rules written to /sys/class/nxt_sense/nxt_sense/reflexes.
+ * check validates the arguments of a new rule (may be NULL), fire is called on the sampling path with a spinlock held and must not sleep.
+ * get and put (may be NULL) are called when a rule using the action is added and removed, and may sleep, e.g. to request the resource the rule fires on.
+ */
+#define NXT_REFLEX_MAX_ARGS 2
+
+struct nxt_sense_reflex_action {
+  const char *name;
+  int (*check)(const int *);
+  void (*fire)(const int *);
+  int (*get)(const int *);
+  void (*put)(const int *);
+  struct list_head list;
+};
+
+extern int nxt_sense_register_reflex_action(struct nxt_sense_reflex_action *);
+extern void nxt_sense_unregister_reflex_action(struct nxt_sense_reflex_action *);
 
 #endif
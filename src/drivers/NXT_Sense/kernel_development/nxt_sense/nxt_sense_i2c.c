@@ -0,0 +1,599 @@
+/* Notes:
+ * - The NXT sensor ports run I2C at 9600 Hz. A transfer is first compiled into a program of steps, one step for every half clock period, and then run on the GPIO pins of the port.
+ * - SDA is connected through a level shifter with a direction pin, so SDA is never driven high: it is either driven low or released (direction towards the Gumstix) and pulled up on the sensor side.
+ * - Messages are separated by a stop and a start condition instead of a repeated start, with an extra clock pulse in between, as done by the NXT firmware (the LEGO ultrasonic sensor depends on it).
+ * - One hrtimer ticks every half clock period and advances the programs of all the ports with a transfer in progress, so the ports run in lockstep and four transfers take the time of the longest one.
+ * - The pins of all the ports changing in a tick are written with one SETDATAOUT or CLEARDATAOUT write per OMAP GPIO bank, instead of one gpio_set_value() per pin.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/i2c.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+#include <asm/io.h>
+#include <mach/gpio.h>
+
+#include "nxt_sense_i2c.h"
+
+#define DEVICE_NAME "nxt_sense_i2c"
+
+#define NXT_I2C_CLOCK_HZ 9600
+#define NXT_I2C_HALF_PERIOD_NS (NSEC_PER_SEC / (2 * NXT_I2C_CLOCK_HZ))
+
+/* Limits of a single transfer (all its messages) */
+#define NXT_I2C_MAX_MSGS 4
+#define NXT_I2C_MAX_BYTES 32
+#define NXT_I2C_STEPS_PER_BYTE 18 /* 8 data bits and the acknowledge, two steps each */
+#define NXT_I2C_STEPS_PER_MSG 8 /* Start, stop and the extra clock pulse */
+#define NXT_I2C_MAX_STEPS ((NXT_I2C_MAX_BYTES + NXT_I2C_MAX_MSGS) * NXT_I2C_STEPS_PER_BYTE + (NXT_I2C_MAX_MSGS + 1) * NXT_I2C_STEPS_PER_MSG)
+
+/* A transfer of NXT_I2C_MAX_STEPS takes about 40 ms */
+#define NXT_I2C_TIMEOUT_MS 200
+
+/* OMAP3 GPIO banks, 32 pins each */
+#define OMAP_GPIO_BANKS 6
+#define OMAP_GPIO_BANK_SIZE 0x200
+#define OMAP_GPIO_DATAIN 0x38
+#define OMAP_GPIO_CLEARDATAOUT 0x90
+#define OMAP_GPIO_SETDATAOUT 0x94
+#define GPIO_BANK(gpio) ((gpio) >> 5)
+#define GPIO_BIT(gpio) (1 << ((gpio) & 31))
+
+static const unsigned long omap_gpio_bank_base[OMAP_GPIO_BANKS] = {
+  0x48310000, 0x49050000, 0x49052000, 0x49054000, 0x49056000, 0x49058000,
+};
+
+/* The direction pin of the SDA level shifter */
+#define SDA_DIR_OUT 1
+#define SDA_DIR_IN 0
+
+enum nxt_i2c_sda {SDA_RELEASE = 0, SDA_LOW};
+
+/* What to sample from SDA before executing the step, i.e. at the end of the previous SCL high period */
+#define STEP_SAMPLE_DATA 0x01
+#define STEP_SAMPLE_ACK 0x02
+#define STEP_SAMPLE_ADDR_ACK 0x04
+
+struct nxt_i2c_step {
+  u8 scl;
+  u8 sda;
+  u8 flags;
+};
+
+struct nxt_i2c_port {
+  struct i2c_adapter adapter;
+  int scl_gpio;
+  int sda_gpio;
+  int sda_dir_gpio;
+  enum nxt_i2c_sda sda_state;
+
+  /* The compiled program of the current transfer */
+  struct nxt_i2c_step step[NXT_I2C_MAX_STEPS];
+  int nsteps;
+  int stop_index; /* The program continues from here when a byte is not acknowledged */
+  u8 pending_flags;
+  bool overflow;
+
+  /* The result of running the program */
+  u8 rx[NXT_I2C_MAX_BYTES];
+  int rx_bits;
+  int error;
+
+  /* State of the program while it is run by the engine */
+  struct list_head node; /* In nxt_i2c_engine.active */
+  int pc;
+  struct nxt_i2c_step *cur; /* The step executed in the current tick */
+  struct completion done;
+};
+
+/* Pin changes collected from all the ports during a tick */
+struct nxt_i2c_batch {
+  u32 set[OMAP_GPIO_BANKS];
+  u32 clear[OMAP_GPIO_BANKS];
+};
+
+struct nxt_i2c_engine {
+  spinlock_t lock;
+  struct hrtimer timer;
+  bool running;
+  struct list_head active; /* The ports with a transfer in progress */
+  void __iomem *bank[OMAP_GPIO_BANKS]; /* NULL when the bank is not mapped, its pins then use gpio_set_value() */
+};
+
+static struct nxt_i2c_engine engine;
+
+static bool restart_pulse = true;
+module_param(restart_pulse, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(restart_pulse, "Give an extra clock pulse between the stop and start separating two messages");
+
+static bool bank_writes = true;
+module_param(bank_writes, bool, S_IRUGO);
+MODULE_PARM_DESC(bank_writes, "Write the I2C pins through the OMAP GPIO bank registers, instead of gpio_set_value() for each pin");
+
+/***********************************************************************
+ *
+ * Compiling a transfer into steps
+ *
+ ***********************************************************************/
+static void emit(struct nxt_i2c_port *p, int scl, enum nxt_i2c_sda sda) {
+  struct nxt_i2c_step *step;
+
+  if (p->nsteps >= NXT_I2C_MAX_STEPS) {
+    p->overflow = true;
+    return;
+  }
+
+  step = &p->step[p->nsteps++];
+  step->scl = scl;
+  step->sda = sda;
+  step->flags = p->pending_flags;
+  p->pending_flags = 0;
+}
+
+/* SDA only changes while SCL is low, the sample flags are attached to the step following the SCL high period */
+static void emit_bit(struct nxt_i2c_port *p, enum nxt_i2c_sda sda, u8 sample_flags) {
+  emit(p, 0, sda);
+  emit(p, 1, sda);
+  p->pending_flags = sample_flags;
+}
+
+/* Expects SCL high and SDA released */
+static void emit_start(struct nxt_i2c_port *p) {
+  emit(p, 1, SDA_LOW);
+}
+
+static void emit_stop(struct nxt_i2c_port *p) {
+  emit(p, 0, SDA_LOW);
+  emit(p, 1, SDA_LOW);
+  emit(p, 1, SDA_RELEASE);
+}
+
+static void emit_write_byte(struct nxt_i2c_port *p, u8 byte, u8 ack_flag) {
+  int bit;
+
+  for (bit = 7; bit >= 0; --bit) {
+    emit_bit(p, ((byte >> bit) & 1) ? SDA_RELEASE : SDA_LOW, 0);
+  }
+  emit_bit(p, SDA_RELEASE, ack_flag);
+}
+
+static void emit_read_byte(struct nxt_i2c_port *p, bool ack) {
+  int bit;
+
+  for (bit = 7; bit >= 0; --bit) {
+    emit_bit(p, SDA_RELEASE, STEP_SAMPLE_DATA);
+  }
+  emit_bit(p, ack ? SDA_LOW : SDA_RELEASE, 0);
+}
+
+static int compile_transfer(struct nxt_i2c_port *p, struct i2c_msg *msgs, int num) {
+  int i;
+  int j;
+  int bytes = 0;
+
+  if (num > NXT_I2C_MAX_MSGS) {
+    return -EOPNOTSUPP;
+  }
+
+  for (i = 0; i < num; ++i) {
+    if (msgs[i].flags & I2C_M_TEN) {
+      return -EOPNOTSUPP;
+    }
+    bytes += msgs[i].len;
+  }
+
+  if (bytes > NXT_I2C_MAX_BYTES) {
+    return -EOPNOTSUPP;
+  }
+
+  p->nsteps = 0;
+  p->pending_flags = 0;
+  p->overflow = false;
+
+  emit_start(p);
+
+  for (i = 0; i < num; ++i) {
+    if (i > 0) {
+      emit_stop(p);
+      if (restart_pulse) {
+        emit(p, 0, SDA_RELEASE);
+        emit(p, 1, SDA_RELEASE);
+      }
+      emit_start(p);
+    }
+
+    emit_write_byte(p, (msgs[i].addr << 1) | ((msgs[i].flags & I2C_M_RD) ? 1 : 0), STEP_SAMPLE_ADDR_ACK);
+
+    for (j = 0; j < msgs[i].len; ++j) {
+      if (msgs[i].flags & I2C_M_RD) {
+        emit_read_byte(p, j < msgs[i].len - 1);
+      } else {
+        emit_write_byte(p, msgs[i].buf[j], STEP_SAMPLE_ACK);
+      }
+    }
+  }
+
+  p->stop_index = p->nsteps;
+  emit_stop(p);
+
+  return p->overflow ? -EOPNOTSUPP : 0;
+}
+
+/***********************************************************************
+ *
+ * Batched access to the GPIO pins of the ports
+ *
+ ***********************************************************************/
+static void batch_add(struct nxt_i2c_batch *batch, int gpio, int value) {
+  if (value) {
+    batch->set[GPIO_BANK(gpio)] |= GPIO_BIT(gpio);
+  } else {
+    batch->clear[GPIO_BANK(gpio)] |= GPIO_BIT(gpio);
+  }
+}
+
+/* Clears before setting, as a batch never holds both changes for the same pin */
+static void batch_flush(struct nxt_i2c_batch *batch) {
+  int bank;
+  int bit;
+
+  for (bank = 0; bank < OMAP_GPIO_BANKS; ++bank) {
+    if (!batch->set[bank] && !batch->clear[bank]) {
+      continue;
+    }
+
+    if (engine.bank[bank]) {
+      if (batch->clear[bank]) {
+        __raw_writel(batch->clear[bank], engine.bank[bank] + OMAP_GPIO_CLEARDATAOUT);
+      }
+      if (batch->set[bank]) {
+        __raw_writel(batch->set[bank], engine.bank[bank] + OMAP_GPIO_SETDATAOUT);
+      }
+    } else {
+      for (bit = 0; bit < 32; ++bit) {
+        if (batch->clear[bank] & (1 << bit)) {
+          gpio_set_value(bank * 32 + bit, 0);
+        }
+        if (batch->set[bank] & (1 << bit)) {
+          gpio_set_value(bank * 32 + bit, 1);
+        }
+      }
+    }
+
+    batch->set[bank] = 0;
+    batch->clear[bank] = 0;
+  }
+}
+
+static int read_pin(int gpio) {
+  void __iomem *bank = engine.bank[GPIO_BANK(gpio)];
+
+  if (bank) {
+    return (__raw_readl(bank + OMAP_GPIO_DATAIN) & GPIO_BIT(gpio)) != 0;
+  }
+
+  return gpio_get_value(gpio);
+}
+
+static void engine_map_banks(void) {
+  int bank;
+
+  if (!bank_writes) {
+    return;
+  }
+
+  for (bank = 0; bank < OMAP_GPIO_BANKS; ++bank) {
+    engine.bank[bank] = ioremap(omap_gpio_bank_base[bank], OMAP_GPIO_BANK_SIZE);
+    if (!engine.bank[bank]) {
+      printk(KERN_WARNING DEVICE_NAME ": could not map GPIO bank %d, using gpio_set_value() for its pins\n", bank + 1);
+    }
+  }
+}
+
+static void engine_unmap_banks(void) {
+  int bank;
+
+  for (bank = 0; bank < OMAP_GPIO_BANKS; ++bank) {
+    if (engine.bank[bank]) {
+      iounmap(engine.bank[bank]);
+      engine.bank[bank] = NULL;
+    }
+  }
+}
+
+/***********************************************************************
+ *
+ * The engine running the programs of all the ports in lockstep
+ *
+ ***********************************************************************/
+/* Samples SDA for the step at pc and moves pc to the stop condition when a byte was not acknowledged, returns the step to execute */
+static struct nxt_i2c_step *begin_step(struct nxt_i2c_port *p) {
+  struct nxt_i2c_step *step = &p->step[p->pc];
+
+  if (step->flags & STEP_SAMPLE_DATA) {
+    if (read_pin(p->sda_gpio)) {
+      p->rx[p->rx_bits / 8] |= 0x80 >> (p->rx_bits % 8);
+    }
+    ++p->rx_bits;
+  }
+
+  if ((step->flags & (STEP_SAMPLE_ACK | STEP_SAMPLE_ADDR_ACK)) && read_pin(p->sda_gpio)) {
+    p->error = (step->flags & STEP_SAMPLE_ADDR_ACK) ? -ENXIO : -EREMOTEIO;
+    if (p->pc < p->stop_index) {
+      p->pc = p->stop_index;
+      step = &p->step[p->pc];
+    }
+  }
+
+  return step;
+}
+
+/* Executes one step of every active port. SCL falls before and rises after SDA changes, and the gumstix side of SDA is only an output while the level shifter points outwards */
+static void engine_tick(void) {
+  struct nxt_i2c_port *p;
+  struct nxt_i2c_port *next;
+  struct nxt_i2c_batch batch;
+
+  memset(&batch, 0, sizeof(batch));
+
+  list_for_each_entry(p, &engine.active, node) {
+    p->cur = begin_step(p);
+    if (!p->cur->scl) {
+      batch_add(&batch, p->scl_gpio, 0);
+    }
+  }
+  batch_flush(&batch);
+
+  list_for_each_entry(p, &engine.active, node) {
+    if (p->cur->sda != p->sda_state) {
+      if (p->cur->sda == SDA_LOW) {
+        gpio_direction_output(p->sda_gpio, 0);
+        batch_add(&batch, p->sda_dir_gpio, SDA_DIR_OUT);
+      } else {
+        batch_add(&batch, p->sda_dir_gpio, SDA_DIR_IN);
+      }
+    }
+  }
+  batch_flush(&batch);
+
+  list_for_each_entry(p, &engine.active, node) {
+    if (p->cur->sda != p->sda_state) {
+      if (p->cur->sda == SDA_RELEASE) {
+        gpio_direction_input(p->sda_gpio);
+      }
+      p->sda_state = p->cur->sda;
+    }
+    if (p->cur->scl) {
+      batch_add(&batch, p->scl_gpio, 1);
+    }
+  }
+  batch_flush(&batch);
+
+  list_for_each_entry_safe(p, next, &engine.active, node) {
+    if (++p->pc >= p->nsteps) {
+      list_del_init(&p->node);
+      complete(&p->done);
+    }
+  }
+}
+
+static enum hrtimer_restart engine_timer_callback(struct hrtimer *timer) {
+  unsigned long flags;
+  enum hrtimer_restart restart = HRTIMER_RESTART;
+
+  spin_lock_irqsave(&engine.lock, flags);
+
+  engine_tick();
+
+  if (list_empty(&engine.active)) {
+    engine.running = false;
+    restart = HRTIMER_NORESTART;
+  } else {
+    hrtimer_forward_now(timer, ktime_set(0, NXT_I2C_HALF_PERIOD_NS));
+  }
+
+  spin_unlock_irqrestore(&engine.lock, flags);
+
+  return restart;
+}
+
+/* Hands the compiled program to the engine and waits for it to finish */
+static int engine_run(struct nxt_i2c_port *p) {
+  unsigned long flags;
+  unsigned long left;
+
+  memset(p->rx, 0, sizeof(p->rx));
+  p->rx_bits = 0;
+  p->error = 0;
+  p->pc = 0;
+  INIT_COMPLETION(p->done);
+
+  spin_lock_irqsave(&engine.lock, flags);
+  list_add_tail(&p->node, &engine.active);
+  if (!engine.running) {
+    engine.running = true;
+    hrtimer_start(&engine.timer, ktime_set(0, NXT_I2C_HALF_PERIOD_NS), HRTIMER_MODE_REL);
+  }
+  spin_unlock_irqrestore(&engine.lock, flags);
+
+  left = wait_for_completion_timeout(&p->done, msecs_to_jiffies(NXT_I2C_TIMEOUT_MS));
+  if (left == 0) {
+    spin_lock_irqsave(&engine.lock, flags);
+    if (!list_empty(&p->node)) {
+      /* Leave the bus idle for the next transfer */
+      list_del_init(&p->node);
+      gpio_set_value(p->sda_dir_gpio, SDA_DIR_IN);
+      gpio_direction_input(p->sda_gpio);
+      p->sda_state = SDA_RELEASE;
+      gpio_set_value(p->scl_gpio, 1);
+      p->error = -ETIMEDOUT;
+    }
+    spin_unlock_irqrestore(&engine.lock, flags);
+  }
+
+  return p->error;
+}
+
+int nxt_i2c_engine_init(void) {
+  spin_lock_init(&engine.lock);
+  INIT_LIST_HEAD(&engine.active);
+  engine.running = false;
+
+  hrtimer_init(&engine.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  engine.timer.function = engine_timer_callback;
+
+  engine_map_banks();
+
+  return 0;
+}
+
+/* Every adapter is destroyed at this point, so the timer is idle */
+void nxt_i2c_engine_exit(void) {
+  hrtimer_cancel(&engine.timer);
+  engine_unmap_banks();
+}
+
+/***********************************************************************
+ *
+ * The i2c_algorithm of the NXT ports
+ *
+ ***********************************************************************/
+/* Runs a transfer on the port, the caller makes sure there is only one transfer per port at a time */
+int nxt_i2c_transfer(struct nxt_i2c_port *p, struct i2c_msg *msgs, int num) {
+  int status;
+  int i;
+  int rx_byte = 0;
+
+  status = compile_transfer(p, msgs, num);
+  if (status != 0) {
+    return status;
+  }
+
+  status = engine_run(p);
+  if (status != 0) {
+    return status;
+  }
+
+  for (i = 0; i < num; ++i) {
+    if (msgs[i].flags & I2C_M_RD) {
+      memcpy(msgs[i].buf, &p->rx[rx_byte], msgs[i].len);
+      rx_byte += msgs[i].len;
+    }
+  }
+
+  return num;
+}
+
+/* The I2C core holds the bus lock of the adapter, so there is only one transfer per port at a time, while the other ports run their transfers alongside in the engine */
+static int nxt_i2c_xfer(struct i2c_adapter *adapter, struct i2c_msg *msgs, int num) {
+  return nxt_i2c_transfer(i2c_get_adapdata(adapter), msgs, num);
+}
+
+static u32 nxt_i2c_functionality(struct i2c_adapter *adapter) {
+  return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm nxt_i2c_algorithm = {
+  .master_xfer = nxt_i2c_xfer,
+  .functionality = nxt_i2c_functionality,
+};
+
+/***********************************************************************
+ *
+ * Creating and destroying the I2C bus of a port, called from
+ * nxt_sense_core.c which owns the SCL pin
+ *
+ ***********************************************************************/
+/* Takes the SDA pins of the port and idles the bus, without registering an adapter. For probing the port, nxt_i2c_transfer() then runs transfers on it */
+struct nxt_i2c_port *nxt_i2c_open(int scl_gpio, int sda_gpio, int sda_dir_gpio) {
+  struct nxt_i2c_port *p;
+
+  p = kzalloc(sizeof(*p), GFP_KERNEL);
+  if (!p) {
+    return NULL;
+  }
+
+  p->scl_gpio = scl_gpio;
+  p->sda_gpio = sda_gpio;
+  p->sda_dir_gpio = sda_dir_gpio;
+  p->sda_state = SDA_RELEASE;
+  INIT_LIST_HEAD(&p->node);
+  init_completion(&p->done);
+
+  if (gpio_request(sda_gpio, "SDA")) {
+    printk(KERN_ERR DEVICE_NAME ": gpio_request for pin %d failed\n", sda_gpio);
+    goto open_fail_1;
+  }
+
+  if (gpio_request(sda_dir_gpio, "SDA_DIR")) {
+    printk(KERN_ERR DEVICE_NAME ": gpio_request for pin %d failed\n", sda_dir_gpio);
+    goto open_fail_2;
+  }
+
+  if (gpio_direction_output(sda_dir_gpio, SDA_DIR_IN) || gpio_direction_input(sda_gpio)) {
+    printk(KERN_ERR DEVICE_NAME ": could not set the direction of the SDA pins %d and %d\n", sda_gpio, sda_dir_gpio);
+    goto open_fail_3;
+  }
+
+  /* Idle bus */
+  gpio_set_value(scl_gpio, 1);
+
+  return p;
+
+ open_fail_3:
+  gpio_free(sda_dir_gpio);
+ open_fail_2:
+  gpio_free(sda_gpio);
+ open_fail_1:
+  kfree(p);
+  return NULL;
+}
+
+void nxt_i2c_close(struct nxt_i2c_port *p) {
+  gpio_set_value(p->scl_gpio, 0);
+  gpio_free(p->sda_dir_gpio);
+  gpio_free(p->sda_gpio);
+
+  kfree(p);
+}
+
+/* The port with its adapter registered, for the digital sensors and i2c-dev */
+struct nxt_i2c_port *nxt_i2c_create(int port, int scl_gpio, int sda_gpio, int sda_dir_gpio, struct device *parent) {
+  struct nxt_i2c_port *p;
+  int error;
+
+  p = nxt_i2c_open(scl_gpio, sda_gpio, sda_dir_gpio);
+  if (!p) {
+    return NULL;
+  }
+
+  p->adapter.owner = THIS_MODULE;
+  p->adapter.class = I2C_CLASS_HWMON;
+  p->adapter.algo = &nxt_i2c_algorithm;
+  p->adapter.dev.parent = parent;
+  snprintf(p->adapter.name, sizeof(p->adapter.name), "NXT sensor port %d", port);
+  i2c_set_adapdata(&p->adapter, p);
+
+  error = i2c_add_adapter(&p->adapter);
+  if (error) {
+    printk(KERN_ERR DEVICE_NAME ": i2c_add_adapter() failed for port %d: %d\n", port, error);
+    nxt_i2c_close(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+void nxt_i2c_destroy(struct nxt_i2c_port *p) {
+  i2c_del_adapter(&p->adapter);
+  nxt_i2c_close(p);
+}
+
+struct i2c_adapter *nxt_i2c_adapter(struct nxt_i2c_port *p) {
+  return &p->adapter;
+}
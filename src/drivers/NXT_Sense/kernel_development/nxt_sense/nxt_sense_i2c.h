@@ -0,0 +1,16 @@
+#ifndef __H_nxt_sense_i2c_h_
+#define __H_nxt_sense_i2c_h_
+
+/* The bit-banged I2C bus of a NXT port, only used from within nxt_sense_core */
+struct nxt_i2c_port;
+
+extern int nxt_i2c_engine_init(void);
+extern void nxt_i2c_engine_exit(void);
+extern struct nxt_i2c_port *nxt_i2c_create(int, int, int, int, struct device *);
+extern void nxt_i2c_destroy(struct nxt_i2c_port *);
+extern struct nxt_i2c_port *nxt_i2c_open(int, int, int);
+extern void nxt_i2c_close(struct nxt_i2c_port *);
+extern int nxt_i2c_transfer(struct nxt_i2c_port *, struct i2c_msg *, int);
+extern struct i2c_adapter *nxt_i2c_adapter(struct nxt_i2c_port *);
+
+#endif
@@ -0,0 +1,470 @@
+/* Notes:
+ * - A reflex is a rule binding a condition on the samples of a port to an action, e.g. "touch sensor on port 0 pressed -> stop the motors". The rules are evaluated in the kernel for every sample of the port, so an action follows the sample within one sample period without a round trip through userspace.
+ * - Every sample taken through nxt_sense is evaluated (reads, the sound sampler, the ultrasonic poller). The touch and light sensors are only sampled when read, so the reflex thread samples the ports having rules every reflex_period_ms as well. The thread only runs while there are rules.
+ * - A rule fires once when its condition has held for hold consecutive samples, and is armed again when the condition no longer holds. Releasing an output is a second rule with the opposite condition.
+ * - Actions are registered by name, the gpio action is built in. Actions are fired with the rule lock held and must not sleep.
+ * - The gpio action only drives pins it requested itself, when the first rule using the pin was added. A pin owned by another driver (e.g. the ENABLE pins of motor) cannot be used, that driver registers an action of its own instead.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/string.h>
+#include <linux/stat.h>
+#include <linux/mutex.h>
+#include <mach/gpio.h>
+
+#include "nxt_sense_core.h"
+#include "nxt_sense_reflex.h"
+
+#define DEVICE_NAME "nxt_sense_reflex"
+
+#define NXT_REFLEX_MAX_RULES 16
+#define NXT_REFLEX_NAME_LEN 16
+
+enum nxt_reflex_op {REFLEX_BELOW = 0, REFLEX_ABOVE};
+
+struct nxt_reflex_rule {
+  bool used;
+  int port;
+  enum nxt_reflex_op op;
+  int threshold;
+  unsigned int hold; /* Consecutive samples meeting the condition before the rule fires */
+  struct nxt_sense_reflex_action *action;
+  int args[NXT_REFLEX_MAX_ARGS];
+  unsigned int matches;
+  bool fired;
+  unsigned long fire_count;
+};
+
+static unsigned int reflex_period_ms = 10;
+module_param(reflex_period_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(reflex_period_ms, "Milliseconds between the samples the reflex thread takes of the ports having rules");
+
+/* Serialises the changes of the rules and of the registered actions, which may sleep in the get and put hooks of the actions or when starting and stopping the reflex thread */
+static DEFINE_MUTEX(reflex_mutex);
+/* Guards the rules and the registered actions against the sampling path */
+static DEFINE_SPINLOCK(reflex_lock);
+static struct nxt_reflex_rule reflex_rules[NXT_REFLEX_MAX_RULES];
+static unsigned long reflex_ports; /* Bitmask of the ports having rules */
+static LIST_HEAD(reflex_actions);
+
+static int reflex_number_of_ports;
+static int (*reflex_sample_port)(int, int *);
+static struct task_struct *reflex_thread;
+static struct device *reflex_device;
+
+/***********************************************************************
+ *
+ * Registration of the actions
+ *
+ ***********************************************************************/
+/* Requires the reflex_mutex or the reflex_lock */
+static struct nxt_sense_reflex_action *find_action(const char *name) {
+  struct nxt_sense_reflex_action *action;
+
+  list_for_each_entry(action, &reflex_actions, list) {
+    if (strcmp(action->name, name) == 0) {
+      return action;
+    }
+  }
+
+  return NULL;
+}
+
+/* Requires the reflex_lock */
+static void update_reflex_ports(void) {
+  int i;
+
+  reflex_ports = 0;
+  for (i = 0; i < NXT_REFLEX_MAX_RULES; ++i) {
+    if (reflex_rules[i].used) {
+      reflex_ports |= (1UL << reflex_rules[i].port);
+    }
+  }
+}
+
+static int reflex_sampler(void *data);
+
+/* Requires the reflex_mutex. The reflex thread runs while there are rules */
+static void update_reflex_thread(void) {
+  if (reflex_ports && !reflex_thread) {
+    reflex_thread = kthread_run(reflex_sampler, NULL, "nxt_reflex");
+    if (IS_ERR(reflex_thread)) {
+      printk(KERN_ERR DEVICE_NAME ": could not start the reflex thread: %ld\n", PTR_ERR(reflex_thread));
+      reflex_thread = NULL;
+    }
+  } else if (!reflex_ports && reflex_thread) {
+    kthread_stop(reflex_thread);
+    reflex_thread = NULL;
+  }
+}
+
+/* Requires the reflex_mutex. Removes the rule and lets its action release what it holds for the rule */
+static void remove_rule(int id) {
+  struct nxt_reflex_rule rule;
+  unsigned long flags;
+
+  spin_lock_irqsave(&reflex_lock, flags);
+  rule = reflex_rules[id];
+  reflex_rules[id].used = false;
+  update_reflex_ports();
+  spin_unlock_irqrestore(&reflex_lock, flags);
+
+  if (rule.used && rule.action->put) {
+    rule.action->put(rule.args);
+  }
+}
+
+int nxt_sense_register_reflex_action(struct nxt_sense_reflex_action *action) {
+  unsigned long flags;
+  int status = 0;
+
+  if (!action || !action->name || !action->fire || strlen(action->name) >= NXT_REFLEX_NAME_LEN) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&reflex_mutex);
+  spin_lock_irqsave(&reflex_lock, flags);
+  if (find_action(action->name)) {
+    status = -EBUSY;
+  } else {
+    list_add_tail(&action->list, &reflex_actions);
+  }
+  spin_unlock_irqrestore(&reflex_lock, flags);
+  mutex_unlock(&reflex_mutex);
+
+  if (status != 0) {
+    printk(KERN_WARNING DEVICE_NAME ": the reflex action %s is registered already\n", action->name);
+  }
+
+  return status;
+}
+EXPORT_SYMBOL(nxt_sense_register_reflex_action);
+
+/* The rules using the action are removed with it, no rule fires it once this returns */
+void nxt_sense_unregister_reflex_action(struct nxt_sense_reflex_action *action) {
+  unsigned long flags;
+  int i;
+
+  mutex_lock(&reflex_mutex);
+  for (i = 0; i < NXT_REFLEX_MAX_RULES; ++i) {
+    if (reflex_rules[i].used && reflex_rules[i].action == action) {
+      remove_rule(i);
+    }
+  }
+  update_reflex_thread();
+
+  spin_lock_irqsave(&reflex_lock, flags);
+  list_del(&action->list);
+  spin_unlock_irqrestore(&reflex_lock, flags);
+  mutex_unlock(&reflex_mutex);
+}
+EXPORT_SYMBOL(nxt_sense_unregister_reflex_action);
+
+/* The built-in action, setting an output pin: gpio <pin> <value>. The pin is requested with the first rule using it, as an output driven low, and freed with the last one */
+struct reflex_gpio {
+  int pin;
+  unsigned int rules; /* 0 when the entry is free */
+};
+
+/* Guarded by the reflex_mutex, a pin per rule at most */
+static struct reflex_gpio reflex_gpios[NXT_REFLEX_MAX_RULES];
+
+static int gpio_action_check(const int *args) {
+  return (gpio_is_valid(args[0]) && (args[1] == 0 || args[1] == 1)) ? 0 : -EINVAL;
+}
+
+static void gpio_action_fire(const int *args) {
+  gpio_set_value(args[0], args[1]);
+}
+
+static int gpio_action_get(const int *args) {
+  struct reflex_gpio *free_entry = NULL;
+  int i;
+
+  for (i = 0; i < NXT_REFLEX_MAX_RULES; ++i) {
+    if (reflex_gpios[i].rules > 0 && reflex_gpios[i].pin == args[0]) {
+      ++reflex_gpios[i].rules;
+      return 0;
+    }
+    if (reflex_gpios[i].rules == 0 && !free_entry) {
+      free_entry = &reflex_gpios[i];
+    }
+  }
+
+  if (!free_entry) {
+    return -ENOSPC;
+  }
+
+  if (gpio_request(args[0], "nxt_reflex")) {
+    printk(KERN_WARNING DEVICE_NAME ": gpio_request for pin %d failed, is it owned by another driver?\n", args[0]);
+    return -EBUSY;
+  }
+
+  if (gpio_direction_output(args[0], 0)) {
+    printk(KERN_WARNING DEVICE_NAME ": could not make pin %d an output\n", args[0]);
+    gpio_free(args[0]);
+    return -EIO;
+  }
+
+  free_entry->pin = args[0];
+  free_entry->rules = 1;
+
+  return 0;
+}
+
+static void gpio_action_put(const int *args) {
+  int i;
+
+  for (i = 0; i < NXT_REFLEX_MAX_RULES; ++i) {
+    if (reflex_gpios[i].rules > 0 && reflex_gpios[i].pin == args[0]) {
+      if (--reflex_gpios[i].rules == 0) {
+        gpio_free(args[0]);
+      }
+      return;
+    }
+  }
+}
+
+static struct nxt_sense_reflex_action gpio_action = {
+  .name = "gpio",
+  .check = gpio_action_check,
+  .fire = gpio_action_fire,
+  .get = gpio_action_get,
+  .put = gpio_action_put,
+};
+
+/***********************************************************************
+ *
+ * Evaluation of the rules
+ *
+ ***********************************************************************/
+void nxt_reflex_sample(int port, int value) {
+  struct nxt_reflex_rule *rule;
+  unsigned long flags;
+  bool condition;
+  int i;
+
+  /* Checked without the lock, a rule added meanwhile is evaluated from the next sample on */
+  if (!(reflex_ports & (1UL << port))) {
+    return;
+  }
+
+  spin_lock_irqsave(&reflex_lock, flags);
+  for (i = 0; i < NXT_REFLEX_MAX_RULES; ++i) {
+    rule = &reflex_rules[i];
+    if (!rule->used || rule->port != port) {
+      continue;
+    }
+
+    condition = (rule->op == REFLEX_BELOW ? value < rule->threshold : value > rule->threshold);
+    if (!condition) {
+      rule->matches = 0;
+      rule->fired = false;
+      continue;
+    }
+
+    if (rule->fired || ++rule->matches < rule->hold) {
+      continue;
+    }
+
+    rule->action->fire(rule->args);
+    rule->fired = true;
+    ++rule->fire_count;
+  }
+  spin_unlock_irqrestore(&reflex_lock, flags);
+}
+
+static int reflex_sampler(void *data) {
+  int port;
+  int value;
+
+  while (!kthread_should_stop()) {
+    for (port = 0; port < reflex_number_of_ports; ++port) {
+      if ((reflex_ports & (1UL << port)) && reflex_sample_port(port, &value) == 0) {
+        nxt_reflex_sample(port, value);
+      }
+    }
+
+    msleep(reflex_period_ms > 0 ? reflex_period_ms : 1);
+  }
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * Sysfs entry for the rules
+ *
+ ***********************************************************************/
+static ssize_t reflexes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct nxt_reflex_rule *rule;
+  unsigned long flags;
+  ssize_t len = 0;
+  int i;
+
+  spin_lock_irqsave(&reflex_lock, flags);
+  for (i = 0; i < NXT_REFLEX_MAX_RULES; ++i) {
+    rule = &reflex_rules[i];
+    if (!rule->used) {
+      continue;
+    }
+
+    len += scnprintf(buf + len, PAGE_SIZE - len, "%d: %d %c %d %u %s %d %d fired %lu\n", i, rule->port, (rule->op == REFLEX_BELOW ? '<' : '>'), rule->threshold, rule->hold, rule->action->name, rule->args[0], rule->args[1], rule->fire_count);
+  }
+  spin_unlock_irqrestore(&reflex_lock, flags);
+
+  return len;
+}
+
+/* Requires the reflex_mutex */
+static int add_rule(int port, enum nxt_reflex_op op, int threshold, unsigned int hold, const char *action_name, const int *args) {
+  struct nxt_sense_reflex_action *action;
+  struct nxt_reflex_rule *rule;
+  unsigned long flags;
+  int status;
+  int i;
+
+  action = find_action(action_name);
+  if (!action) {
+    return -ENOENT;
+  }
+
+  if (action->check && action->check(args) != 0) {
+    return -EINVAL;
+  }
+
+  for (i = 0; i < NXT_REFLEX_MAX_RULES; ++i) {
+    if (!reflex_rules[i].used) {
+      break;
+    }
+  }
+
+  if (i == NXT_REFLEX_MAX_RULES) {
+    return -ENOSPC;
+  }
+
+  if (action->get) {
+    status = action->get(args);
+    if (status != 0) {
+      return status;
+    }
+  }
+
+  spin_lock_irqsave(&reflex_lock, flags);
+  rule = &reflex_rules[i];
+  memset(rule, 0, sizeof(*rule));
+  rule->port = port;
+  rule->op = op;
+  rule->threshold = threshold;
+  rule->hold = (hold > 0 ? hold : 1);
+  rule->action = action;
+  memcpy(rule->args, args, sizeof(rule->args));
+  rule->used = true;
+  update_reflex_ports();
+  spin_unlock_irqrestore(&reflex_lock, flags);
+
+  return i;
+}
+
+/* Requires the reflex_mutex */
+static void clear_rules(void) {
+  int i;
+
+  for (i = 0; i < NXT_REFLEX_MAX_RULES; ++i) {
+    remove_rule(i);
+  }
+}
+
+/* Takes "<port> <|> <threshold> <hold> <action> [<arg> [<arg>]]" adding a rule, "del <id>" or "clear" */
+static ssize_t reflexes_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  char op;
+  char action_name[NXT_REFLEX_NAME_LEN];
+  int args[NXT_REFLEX_MAX_ARGS] = {0, 0};
+  int port;
+  int threshold;
+  unsigned int hold;
+  int id;
+  int res;
+
+  if (strncmp(buf, "clear", 5) == 0) {
+    mutex_lock(&reflex_mutex);
+    clear_rules();
+    update_reflex_thread();
+    mutex_unlock(&reflex_mutex);
+
+    return count;
+  }
+
+  if (sscanf(buf, "del %d", &id) == 1) {
+    if (id < 0 || id >= NXT_REFLEX_MAX_RULES) {
+      return -EINVAL;
+    }
+
+    mutex_lock(&reflex_mutex);
+    remove_rule(id);
+    update_reflex_thread();
+    mutex_unlock(&reflex_mutex);
+
+    return count;
+  }
+
+  res = sscanf(buf, "%d %c %d %u %15s %d %d", &port, &op, &threshold, &hold, action_name, &args[0], &args[1]);
+  if (res < 5 || port < 0 || port >= reflex_number_of_ports || (op != '<' && op != '>')) {
+    printk(KERN_WARNING DEVICE_NAME ": a rule is \"<port> <|> <threshold> <hold> <action> [<arg> [<arg>]]\"\n");
+    return -EINVAL;
+  }
+
+  mutex_lock(&reflex_mutex);
+  id = add_rule(port, (op == '<' ? REFLEX_BELOW : REFLEX_ABOVE), threshold, hold, action_name, args);
+  update_reflex_thread();
+  mutex_unlock(&reflex_mutex);
+
+  if (id < 0) {
+    printk(KERN_WARNING DEVICE_NAME ": could not add the rule for port %d: %d\n", port, id);
+    return id;
+  }
+
+  return count;
+}
+
+DEVICE_ATTR(reflexes, (S_IRUGO | S_IWUSR), reflexes_show, reflexes_store);
+
+/***********************************************************************
+ *
+ * Initialisation and uninitialisation, called by nxt_sense_core
+ *
+ ***********************************************************************/
+int nxt_reflex_init(struct device *device, int number_of_ports, int (*sample_port)(int, int *)) {
+  reflex_device = device;
+  reflex_number_of_ports = number_of_ports;
+  reflex_sample_port = sample_port;
+
+  nxt_sense_register_reflex_action(&gpio_action);
+
+  if (device_create_file(reflex_device, &dev_attr_reflexes)) {
+    printk(KERN_ERR DEVICE_NAME ": device_create_file(reflexes) failed\n");
+    goto init_fail_1;
+  }
+
+  return 0;
+
+ init_fail_1:
+  nxt_sense_unregister_reflex_action(&gpio_action);
+  return -1;
+}
+
+void nxt_reflex_exit(void) {
+  device_remove_file(reflex_device, &dev_attr_reflexes);
+
+  mutex_lock(&reflex_mutex);
+  clear_rules();
+  update_reflex_thread();
+  mutex_unlock(&reflex_mutex);
+
+  nxt_sense_unregister_reflex_action(&gpio_action);
+}
@@ -0,0 +1,10 @@
+#ifndef __H_nxt_sense_reflex_h_
+#define __H_nxt_sense_reflex_h_
+
+/* The reflex engine of nxt_sense, only used from within nxt_sense_core: the device for the sysfs entry, the number of ports and the hook sampling a port for the reflex thread (non-zero when the port is sampled by its sensor instead) */
+extern int nxt_reflex_init(struct device *, int, int (*)(int, int *));
+extern void nxt_reflex_exit(void);
+/* Evaluates the rules of the port for a new sample */
+extern void nxt_reflex_sample(int, int);
+
+#endif
@@ -0,0 +1,524 @@
+/* Notes:
+ * - The sound sensor is sampled by a kernel thread in bursts of SOUND_BURST samples at sample_rate, and reduced to an envelope for every window of window_ms: the RMS and the peak of the level, and the RMS in dB.
+ * - The thread is started in the start hook, once the sensor has replaced the old one of the port, so a sensor built for a reconfiguration that is rolled back never samples.
+ * - Only the envelope leaves the kernel: every read of /dev/sound# returns the envelope of one window as a line, blocking until a window newer than the last one read through the same file is done. The file can be opened by several readers at a time and supports poll().
+ * - The level is 4095 minus the ADC reading, as the sensor pulls its output down for louder sounds. The dB value is 20 * log10(RMS), i.e. relative to one ADC step, in tenths of a dB.
+ * - The sensor applies the A-weighting itself, selected with SCL: SCL high gives dB and SCL low gives dBA.
+ */
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <asm/uaccess.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/bitops.h>
+
+#include "nxt_sense_core.h"
+
+#define DEVICE_NAME "sound"
+
+#define ADC_MAX 4095
+/* Samples taken in one ADC transfer, the other ADC users wait for at most one burst */
+#define SOUND_BURST 128
+/* Time to back off when the ADC fails */
+#define SOUND_ERROR_BACKOFF_MS 100
+
+enum sound_mode {SOUND_MODE_DBA = 0, SOUND_MODE_DB};
+
+static unsigned int sample_rate = 8000;
+module_param(sample_rate, uint, S_IRUGO);
+MODULE_PARM_DESC(sample_rate, "Sample rate in Hz of the sound sensors");
+
+static unsigned int window_ms = 100;
+module_param(window_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(window_ms, "Milliseconds of sound reduced to one envelope");
+
+struct sound_envelope {
+  int rms;
+  int peak;
+  int db10; /* Tenths of a dB */
+};
+
+/* nxt_sense_device_data has to be placed at the top/front of the struct, see the comment in touch.c */
+struct sound_data {
+  struct nxt_sense_device_data nxt_sense_device_data; /* Has to be placed at the beginning! */
+  struct device_attribute dev_attr_envelope;
+  struct device_attribute dev_attr_mode;
+  struct task_struct *sampler; /* NULL until started */
+  struct mutex mutex; /* Guards the mode */
+  enum sound_mode mode;
+  spinlock_t lock; /* Guards the envelope, a spinlock as it is taken in the wait condition of the readers */
+  wait_queue_head_t wait; /* Readers waiting for a new envelope */
+  struct sound_envelope envelope;
+  unsigned int sequence; /* Incremented for every window done */
+  bool removed; /* Set when the port is reconfigured, the readers still holding the device open get -ENODEV */
+
+  /* Owned by the sampler thread */
+  int burst[SOUND_BURST];
+  unsigned int window_samples;
+  unsigned int count;
+  u64 sum_of_squares;
+  int peak;
+};
+
+/* What a reader has seen, one for every open file */
+struct sound_reader {
+  struct sound_data *sd;
+  unsigned int sequence;
+};
+
+/* The sound_data instances are allocated when a port is configured as a sound sensor */
+static struct kmem_cache *sound_cache;
+
+/* The instance is freed when the port is reconfigured and the device is no longer open */
+static void free_sound_data(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct sound_data *sd = container_of(nxt_sense_device_data, struct sound_data, nxt_sense_device_data);
+
+  mutex_destroy(&sd->mutex);
+  kmem_cache_free(sound_cache, sd);
+}
+
+/***********************************************************************
+ *
+ * Reducing the samples to the envelope, in fixed point
+ *
+ ***********************************************************************/
+/* log2(x) with 8 fractional bits, for x > 0: the integer part from the highest set bit, the fraction by repeated squaring of the mantissa */
+static int log2_q8(u32 x) {
+  int integer = fls(x) - 1;
+  int result = integer << 8;
+  int bit;
+  u32 y; /* The mantissa x / 2^integer with 16 fractional bits, between 1 and 2 */
+
+  y = integer > 16 ? x >> (integer - 16) : x << (16 - integer);
+
+  for (bit = 7; bit >= 0; --bit) {
+    y = (u32) (((u64) y * y) >> 16);
+    if (y >= (2 << 16)) {
+      y >>= 1;
+      result |= 1 << bit;
+    }
+  }
+
+  return result;
+}
+
+/* 20 * log10(x) = 6.0206 * log2(x), in tenths of a dB */
+static int db10(u32 x) {
+  if (x == 0) {
+    return 0;
+  }
+
+  return (log2_q8(x) * 60206) / (1000 * 256);
+}
+
+static void sound_add_samples(struct sound_data *sd, int *samples, int count) {
+  int i;
+  int level;
+  struct sound_envelope envelope;
+
+  for (i = 0; i < count; ++i) {
+    level = ADC_MAX - samples[i];
+    if (level < 0) {
+      level = 0;
+    }
+
+    sd->sum_of_squares += (u64) (level * level);
+    sd->peak = max(sd->peak, level);
+
+    if (++sd->count < sd->window_samples) {
+      continue;
+    }
+
+    do_div(sd->sum_of_squares, sd->count);
+    envelope.rms = int_sqrt((unsigned long) sd->sum_of_squares);
+    envelope.peak = sd->peak;
+    envelope.db10 = db10(envelope.rms);
+
+    spin_lock(&sd->lock);
+    sd->envelope = envelope;
+    ++sd->sequence;
+    spin_unlock(&sd->lock);
+
+    wake_up_interruptible(&sd->wait);
+
+    sd->count = 0;
+    sd->sum_of_squares = 0;
+    sd->peak = 0;
+  }
+}
+
+static int sound_sampler(void *data) {
+  struct sound_data *sd = data;
+  int status;
+
+  while (!kthread_should_stop()) {
+    status = sd->nxt_sense_device_data.get_samples(&sd->nxt_sense_device_data, sd->burst, SOUND_BURST, sample_rate);
+    if (status != 0) {
+      msleep(SOUND_ERROR_BACKOFF_MS);
+      continue;
+    }
+
+    sound_add_samples(sd, sd->burst, SOUND_BURST);
+  }
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * File operations for the /dev/sound# files
+ *
+ ***********************************************************************/
+static int sound_open(struct inode *inode, struct file *filp) {
+  struct nxt_sense_device_data *nxt_sense_device_data;
+  struct sound_data *sd;
+  struct sound_reader *reader;
+
+  nxt_sense_device_data = nxt_sense_get_device_data(inode);
+  if (!nxt_sense_device_data) {
+    return -ENODEV;
+  }
+  sd = container_of(nxt_sense_device_data, struct sound_data, nxt_sense_device_data);
+
+  reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+  if (!reader) {
+    nxt_sense_put_device_data(nxt_sense_device_data);
+    return -ENOMEM;
+  }
+
+  spin_lock(&sd->lock);
+  reader->sd = sd;
+  reader->sequence = sd->sequence; /* Only windows done after opening are read */
+  spin_unlock(&sd->lock);
+
+  filp->private_data = reader;
+
+  return 0;
+}
+
+static int sound_release(struct inode *inode, struct file *filp) {
+  struct sound_reader *reader = filp->private_data;
+
+  nxt_sense_put_device_data(&reader->sd->nxt_sense_device_data);
+  kfree(reader);
+
+  return 0;
+}
+
+/* True when the reader has something to return, a new envelope or an error */
+static bool reader_ready(struct sound_reader *reader) {
+  struct sound_data *sd = reader->sd;
+  bool ready;
+
+  spin_lock(&sd->lock);
+  ready = sd->removed || sd->sequence != reader->sequence;
+  spin_unlock(&sd->lock);
+
+  return ready;
+}
+
+static ssize_t sound_read(struct file *filp, char __user *buff, size_t count, loff_t *offp) {
+  size_t len;
+  char output[24]; /* "rms peak db" */
+  struct sound_envelope envelope;
+  struct sound_reader *reader = filp->private_data;
+  struct sound_data *sd = reader->sd;
+
+  if (!buff)
+    return -EFAULT;
+
+  if (!reader_ready(reader)) {
+    if (filp->f_flags & O_NONBLOCK) {
+      return -EAGAIN;
+    }
+    if (wait_event_interruptible(sd->wait, reader_ready(reader))) {
+      return -ERESTARTSYS;
+    }
+  }
+
+  spin_lock(&sd->lock);
+  if (sd->removed) {
+    spin_unlock(&sd->lock);
+    return -ENODEV;
+  }
+  reader->sequence = sd->sequence;
+  envelope = sd->envelope;
+  spin_unlock(&sd->lock);
+
+  snprintf(output, sizeof(output), "%d %d %d.%d\n", envelope.rms, envelope.peak, envelope.db10 / 10, envelope.db10 % 10);
+
+  len = strlen(output);
+
+  if (len < count)
+    count = len;
+
+  if (copy_to_user(buff, output, count)) {
+    return -EFAULT;
+  }
+
+  return count;
+}
+
+static unsigned int sound_poll(struct file *filp, poll_table *wait) {
+  struct sound_reader *reader = filp->private_data;
+  struct sound_data *sd = reader->sd;
+  unsigned int mask = 0;
+
+  poll_wait(filp, &sd->wait, wait);
+
+  spin_lock(&sd->lock);
+  if (sd->removed) {
+    mask |= POLLERR | POLLHUP;
+  } else if (sd->sequence != reader->sequence) {
+    mask |= POLLIN | POLLRDNORM;
+  }
+  spin_unlock(&sd->lock);
+
+  return mask;
+}
+
+static const struct file_operations sound_fops = {
+  .owner = THIS_MODULE,
+  .read = sound_read,
+  .poll = sound_poll,
+  .open = sound_open,
+  .release = sound_release,
+};
+
+/***********************************************************************
+ *
+ * Sysfs entries for reading the last envelope and for switching
+ * between dB and dBA
+ *
+ ***********************************************************************/
+static ssize_t envelope_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  struct sound_envelope envelope;
+  struct sound_data *sd;
+  sd = container_of(attr, struct sound_data, dev_attr_envelope);
+
+  spin_lock(&sd->lock);
+  envelope = sd->envelope;
+  spin_unlock(&sd->lock);
+
+  return scnprintf(buf, PAGE_SIZE, "%d %d %d.%d\n", envelope.rms, envelope.peak, envelope.db10 / 10, envelope.db10 % 10);
+}
+
+static ssize_t mode_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  enum sound_mode mode;
+  struct sound_data *sd;
+  sd = container_of(attr, struct sound_data, dev_attr_mode);
+
+  mutex_lock(&sd->mutex);
+  mode = sd->mode;
+  mutex_unlock(&sd->mutex);
+
+  return scnprintf(buf, PAGE_SIZE, "%s\n", mode == SOUND_MODE_DB ? "dB" : "dBA");
+}
+
+/* Takes "dB" or "dBA" */
+static ssize_t mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+  enum sound_mode new_mode;
+  struct sound_data *sd;
+  sd = container_of(attr, struct sound_data, dev_attr_mode);
+
+  if (strncmp(buf, "dBA", 3) == 0) {
+    new_mode = SOUND_MODE_DBA;
+  } else if (strncmp(buf, "dB", 2) == 0) {
+    new_mode = SOUND_MODE_DB;
+  } else {
+    printk(KERN_WARNING DEVICE_NAME "%d: the sysfs input for mode is supposed to be dB or dBA\n", sd->nxt_sense_device_data.port);
+    return count;
+  }
+
+  mutex_lock(&sd->mutex);
+
+  sd->mode = new_mode;
+  sd->nxt_sense_device_data.scl(&sd->nxt_sense_device_data, (new_mode == SOUND_MODE_DB ? SCL_HIGH : SCL_LOW));
+
+  mutex_unlock(&sd->mutex);
+
+  return count;
+}
+
+/***********************************************************************
+ *
+ * Utility functions for actually setting up the sysfs entries
+ * and removing them again.
+ *
+ ***********************************************************************/
+static int init_sysfs(struct sound_data *sd) {
+  int error = 0;
+
+  sd->dev_attr_envelope.attr.name = __stringify(envelope);
+  sd->dev_attr_envelope.attr.mode = (S_IRUGO);
+  sd->dev_attr_envelope.show = envelope_show;
+  sd->dev_attr_envelope.store = NULL;
+
+  sd->dev_attr_mode.attr.name = __stringify(mode);
+  sd->dev_attr_mode.attr.mode = (S_IRUGO | S_IWUSR);
+  sd->dev_attr_mode.show = mode_show;
+  sd->dev_attr_mode.store = mode_store;
+
+  error = device_create_file(sd->nxt_sense_device_data.device, &sd->dev_attr_envelope);
+  if (error != 0) {
+    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(envelope) error: %d\n", sd->nxt_sense_device_data.port, error);
+    return -1;
+  }
+
+  error = device_create_file(sd->nxt_sense_device_data.device, &sd->dev_attr_mode);
+  if (error != 0) {
+    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(mode) error: %d\n", sd->nxt_sense_device_data.port, error);
+    device_remove_file(sd->nxt_sense_device_data.device, &sd->dev_attr_envelope);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int destroy_sysfs(struct sound_data *sd) {
+  device_remove_file(sd->nxt_sense_device_data.device, &sd->dev_attr_envelope);
+  device_remove_file(sd->nxt_sense_device_data.device, &sd->dev_attr_mode);
+
+  return 0;
+}
+
+/***********************************************************************
+ *
+ * Hooks for adding and removing devices for the sound sensor submodule,
+ * called from nxt_sense_core.c through the registered nxt_sense_type_ops
+ *
+ ***********************************************************************/
+static struct nxt_sense_device_data *add_sound_sensor(int port, dev_t devt) {
+  int res;
+  struct sound_data *sd;
+  printk(KERN_DEBUG DEVICE_NAME ": Adding sound sensor on port %d\n", port);
+
+  if (sample_rate == 0 || window_ms == 0) {
+    printk(KERN_ERR DEVICE_NAME ": sample_rate and window_ms have to be positive\n");
+    return NULL;
+  }
+
+  sd = kmem_cache_zalloc(sound_cache, GFP_KERNEL);
+  if (!sd) {
+    return NULL;
+  }
+
+  mutex_init(&sd->mutex);
+  spin_lock_init(&sd->lock);
+  nxt_sense_init_device_data(&sd->nxt_sense_device_data, free_sound_data);
+  init_waitqueue_head(&sd->wait);
+
+  sd->window_samples = max(sample_rate * window_ms / 1000, 1U);
+  sd->nxt_sense_device_data.devt = devt;
+
+  res = nxt_setup_sensor_chrdev(&sound_fops, &sd->nxt_sense_device_data, DEVICE_NAME);
+  if (res != 0) {
+    goto add_fail_1;
+  }
+
+  sd->mode = SOUND_MODE_DB;
+  sd->nxt_sense_device_data.scl(&sd->nxt_sense_device_data, SCL_HIGH);
+
+  if (init_sysfs(sd) != 0) {
+    goto add_fail_2;
+  }
+
+  return &sd->nxt_sense_device_data;
+
+ add_fail_2:
+  nxt_teardown_sensor_chrdev(&sd->nxt_sense_device_data);
+ add_fail_1:
+  nxt_sense_put_device_data(&sd->nxt_sense_device_data);
+  return NULL;
+}
+
+/* The sensor owns the port from here on, so it starts sampling */
+static int start_sound_sensor(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct sound_data *sd = container_of(nxt_sense_device_data, struct sound_data, nxt_sense_device_data);
+  struct task_struct *sampler;
+
+  sampler = kthread_run(sound_sampler, sd, "nxt_sound%d", nxt_sense_device_data->port);
+  if (IS_ERR(sampler)) {
+    printk(KERN_ERR DEVICE_NAME "%d: could not start the sampler thread: %ld\n", nxt_sense_device_data->port, PTR_ERR(sampler));
+    return PTR_ERR(sampler);
+  }
+
+  sd->sampler = sampler;
+
+  return 0;
+}
+
+static int remove_sound_sensor(struct nxt_sense_device_data *nxt_sense_device_data) {
+  int res;
+  struct sound_data *sd = container_of(nxt_sense_device_data, struct sound_data, nxt_sense_device_data);
+  printk(KERN_DEBUG DEVICE_NAME ": Removing sound sensor on port %d\n", nxt_sense_device_data->port);
+
+  if (sd->sampler) {
+    kthread_stop(sd->sampler);
+    sd->sampler = NULL;
+  }
+
+  destroy_sysfs(sd);
+
+  spin_lock(&sd->lock);
+  sd->removed = true;
+  spin_unlock(&sd->lock);
+  wake_up_interruptible(&sd->wait);
+
+  res = nxt_teardown_sensor_chrdev(nxt_sense_device_data);
+
+  nxt_sense_put_device_data(&sd->nxt_sense_device_data);
+
+  return res;
+}
+
+static struct nxt_sense_type_ops sound_type_ops = {
+  .code = SOUND_CODE,
+  .name = DEVICE_NAME,
+  .owner = THIS_MODULE,
+  .add = add_sound_sensor,
+  .start = start_sound_sensor,
+  .remove = remove_sound_sensor,
+};
+
+/***********************************************************************
+ *
+ * Module initialisation and exit, registering the sound sensor type
+ * with nxt_sense
+ *
+ ***********************************************************************/
+static int __init sound_init(void) {
+  int error;
+
+  sound_cache = kmem_cache_create("nxt_sound_data", sizeof(struct sound_data), 0, 0, NULL);
+  if (!sound_cache) {
+    printk(KERN_CRIT DEVICE_NAME ": kmem_cache_create() failed\n");
+    return -ENOMEM;
+  }
+
+  error = nxt_sense_register_type(&sound_type_ops);
+  if (error) {
+    kmem_cache_destroy(sound_cache);
+  }
+
+  return error;
+}
+module_init(sound_init);
+
+static void __exit sound_exit(void) {
+  nxt_sense_unregister_type(&sound_type_ops);
+  kmem_cache_destroy(sound_cache);
+}
+module_exit(sound_exit);
+
+MODULE_ALIAS_NXT_SENSE_TYPE(SOUND_CODE);
+MODULE_LICENSE("GPL");
@@ -1,9 +1,3 @@
-/* TODO:
- * - Remove the knowledge of which port an instance of this touch_data / touch sensor is using:
- *     - Maybe make use of a linked list instead of a static defined array with 4 touch_data objects.
- *     - Create the touch_data objects dynamically and free them again to avoid wasting memory.
- */
-
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <asm/uaccess.h>
@@ -11,8 +5,8 @@
 #include <linux/cdev.h>
 #include <linux/kernel.h>
 #include <linux/mutex.h>
-
-#include "touch.h"
+#include <linux/slab.h>
+#include <linux/kref.h>
 
 #include "nxt_sense_core.h"
 
@@ -24,12 +18,20 @@ struct touch_data {
   struct nxt_sense_device_data nxt_sense_device_data; /* Has to be placed at the beginning, see comment above! */
   struct device_attribute dev_attr_threshold;
   struct device_attribute dev_attr_raw_sample;
-  int port;
   int threshold;
   struct mutex mutex;
 };
 
-static struct touch_data touch_data[4];
+/* The touch_data instances are allocated when a port is configured as a touch sensor */
+static struct kmem_cache *touch_cache;
+
+/* The instance is freed when the port is reconfigured and the device is no longer open */
+static void free_touch_data(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct touch_data *td = container_of(nxt_sense_device_data, struct touch_data, nxt_sense_device_data);
+
+  mutex_destroy(&td->mutex);
+  kmem_cache_free(touch_cache, td);
+}
 
 /***********************************************************************
  *
@@ -37,11 +39,17 @@ static struct touch_data touch_data[4];
  *
  ***********************************************************************/
 static int touch_open(struct inode *inode, struct file *filp) {
+  struct nxt_sense_device_data *nxt_sense_device_data;
   struct touch_data *td;
 
-  td = (struct touch_data *) container_of(inode->i_cdev, struct nxt_sense_device_data, cdev);
+  nxt_sense_device_data = nxt_sense_get_device_data(inode);
+  if (!nxt_sense_device_data) {
+    return -ENODEV;
+  }
+  td = container_of(nxt_sense_device_data, struct touch_data, nxt_sense_device_data);
 
   if (!mutex_trylock(&td->mutex)) {
+    nxt_sense_put_device_data(nxt_sense_device_data);
     return -EBUSY;
   }
 
@@ -51,10 +59,10 @@ static int touch_open(struct inode *inode, struct file *filp) {
 }
 
 static int touch_release(struct inode *inode, struct file *filp) {
-  struct touch_data *td;
-  td = (struct touch_data *) container_of(inode->i_cdev, struct nxt_sense_device_data, cdev);
+  struct touch_data *td = filp->private_data;
 
   mutex_unlock(&td->mutex);
+  nxt_sense_put_device_data(&td->nxt_sense_device_data);
 
   return 0;
 }
@@ -69,7 +77,14 @@ static ssize_t touch_read(struct file *filp, char __user *buff, size_t count, lo
   int status_sampling;
   struct touch_data *td = filp->private_data;
 
-  status_sampling = td->nxt_sense_device_data.get_sample(&data);
+  if (td->nxt_sense_device_data.removed) {
+    return -ENODEV;
+  }
+
+  status_sampling = td->nxt_sense_device_data.get_sample(&td->nxt_sense_device_data, &data);
+  if (status_sampling == -ENODEV) {
+    return -ENODEV; /* Removed while sampling */
+  }
 
   if (data < td->threshold) {
     data = 1;
@@ -138,7 +153,7 @@ static ssize_t threshold_store(struct device *dev, struct device_attribute *attr
   res = sscanf(buf, "%d", &new_threshold);
 
   if (res != 1) {
-    printk(KERN_WARNING DEVICE_NAME "%d: wrong sysfs input for threshold, only takes a value for the threshold\n", MINOR(td->nxt_sense_device_data.devt));
+    printk(KERN_WARNING DEVICE_NAME "%d: wrong sysfs input for threshold, only takes a value for the threshold\n", td->nxt_sense_device_data.port);
   } else {
     /* not looking at echo return values by default, so when the return value is not shown to the user, it requires a read of the value to confirm that it was actually set (the device was not busy) -- so just doing a sleep wait
     if (!mutex_trylock(&td->mutex)) {
@@ -166,16 +181,16 @@ static ssize_t raw_sample_show(struct device *dev, struct device_attribute *attr
   struct touch_data *td;
   td = container_of(attr, struct touch_data, dev_attr_raw_sample);
 
-  if (mutex_trylock(&td->mutex)) {
+  if (!mutex_trylock(&td->mutex)) {
     return -EBUSY;
   }
 
-  status = td->nxt_sense_device_data.get_sample(&sample);
+  status = td->nxt_sense_device_data.get_sample(&td->nxt_sense_device_data, &sample);
 
   mutex_unlock(&td->mutex);
 
   if (status != 0) {
-    printk(KERN_ERR DEVICE_NAME "%d: error trying to get a sample: %d\n", MINOR(td->nxt_sense_device_data.devt), status);
+    printk(KERN_ERR DEVICE_NAME "%d: error trying to get a sample: %d\n", td->nxt_sense_device_data.port, status);
     sample = -1;
   }
 
@@ -204,13 +219,13 @@ static int init_sysfs(struct touch_data *td) {
 
   error = device_create_file(td->nxt_sense_device_data.device, &td->dev_attr_threshold);
   if (error != 0) {
-    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(threshold) error: %d\n", MINOR(td->nxt_sense_device_data.devt), error);
+    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(threshold) error: %d\n", td->nxt_sense_device_data.port, error);
     return -1;
   }
 
   error = device_create_file(td->nxt_sense_device_data.device, &td->dev_attr_raw_sample);
   if (error != 0) {
-    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(raw_sample) error: %d\n", MINOR(td->nxt_sense_device_data.devt), error);
+    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(raw_sample) error: %d\n", td->nxt_sense_device_data.port, error);
     device_remove_file(td->nxt_sense_device_data.device, &td->dev_attr_threshold);
     return -1;
   }
@@ -228,55 +243,100 @@ static int destroy_sysfs(struct touch_data *td) {
 /***********************************************************************
  *
  * Hooks for adding and removing devices for the touch sensor submodule,
- * called from nxt_sense_core.c
+ * called from nxt_sense_core.c through the registered nxt_sense_type_ops
  *
  ***********************************************************************/
-int add_touch_sensor(int port, dev_t devt) {
+static struct nxt_sense_device_data *add_touch_sensor(int port, dev_t devt) {
   int res;
   int error;
+  struct touch_data *td;
   printk(KERN_DEBUG DEVICE_NAME ": Adding touch sensor on port %d\n", port);
 
-  mutex_init(&touch_data[port].mutex);
-  mutex_lock(&touch_data[port].mutex); /* void, so sleeps until the lock is acquired? mutex_lock_interruptible returns an error indicating it was interrupted... */
+  td = kmem_cache_zalloc(touch_cache, GFP_KERNEL);
+  if (!td) {
+    return NULL;
+  }
+
+  mutex_init(&td->mutex);
+  nxt_sense_init_device_data(&td->nxt_sense_device_data, free_touch_data);
+  mutex_lock(&td->mutex); /* void, so sleeps until the lock is acquired? mutex_lock_interruptible returns an error indicating it was interrupted... */
 
-  touch_data[port].nxt_sense_device_data.devt = devt;
+  td->nxt_sense_device_data.devt = devt;
 
-  res = nxt_setup_sensor_chrdev(&touch_fops, &touch_data[port].nxt_sense_device_data, DEVICE_NAME);
+  res = nxt_setup_sensor_chrdev(&touch_fops, &td->nxt_sense_device_data, DEVICE_NAME);
 
   printk(KERN_DEBUG DEVICE_NAME ": return value for nxt_setup_sensor_chrdev: %d\n", res);
 
-  touch_data[port].port = port;
-  touch_data[port].threshold = DEFAULT_THRESHOLD;
+  if (res != 0) {
+    mutex_unlock(&td->mutex);
+    nxt_sense_put_device_data(&td->nxt_sense_device_data);
+    return NULL;
+  }
+
+  td->threshold = DEFAULT_THRESHOLD;
 
-  error = init_sysfs(&touch_data[port]);
-  mutex_unlock(&touch_data[port].mutex);
+  error = init_sysfs(td);
+  mutex_unlock(&td->mutex);
   if (error != 0) {
-    /* error .... handle this if you want */
-    return -1;
+    nxt_teardown_sensor_chrdev(&td->nxt_sense_device_data);
+    nxt_sense_put_device_data(&td->nxt_sense_device_data);
+    return NULL;
   }
 
-  return res;
+  return &td->nxt_sense_device_data;
 }
 
-static int uninitialise_touch_data(struct touch_data *td) {
-  mutex_destroy(&td->mutex);
-  td->port = 0;
-  td->threshold = 0;
+static int remove_touch_sensor(struct nxt_sense_device_data *nxt_sense_device_data) {
+  int res;
+  struct touch_data *td = container_of(nxt_sense_device_data, struct touch_data, nxt_sense_device_data);
+  printk(KERN_DEBUG DEVICE_NAME ": Removing touch sensor on port %d\n", nxt_sense_device_data->port);
 
-  return 0;
+  destroy_sysfs(td);
+
+  res = nxt_teardown_sensor_chrdev(nxt_sense_device_data);
+
+  nxt_sense_put_device_data(&td->nxt_sense_device_data);
+
+  return res;
 }
 
-int remove_touch_sensor(int port) {
-  int res;
-  printk(KERN_DEBUG DEVICE_NAME ": Removing touch sensor on port %d\n", port);
+static struct nxt_sense_type_ops touch_type_ops = {
+  .code = TOUCH_CODE,
+  .name = DEVICE_NAME,
+  .owner = THIS_MODULE,
+  .add = add_touch_sensor,
+  .remove = remove_touch_sensor,
+};
 
-  destroy_sysfs(&touch_data[port]);
+/***********************************************************************
+ *
+ * Module initialisation and exit, registering the touch sensor type
+ * with nxt_sense
+ *
+ ***********************************************************************/
+static int __init touch_init(void) {
+  int error;
 
-  res = nxt_teardown_sensor_chrdev(&touch_data[port].nxt_sense_device_data);
+  touch_cache = kmem_cache_create("nxt_touch_data", sizeof(struct touch_data), 0, 0, NULL);
+  if (!touch_cache) {
+    printk(KERN_CRIT DEVICE_NAME ": kmem_cache_create() failed\n");
+    return -ENOMEM;
+  }
 
-  uninitialise_touch_data(&touch_data[port]);
+  error = nxt_sense_register_type(&touch_type_ops);
+  if (error) {
+    kmem_cache_destroy(touch_cache);
+  }
 
-  return res;
+  return error;
+}
+module_init(touch_init);
+
+static void __exit touch_exit(void) {
+  nxt_sense_unregister_type(&touch_type_ops);
+  kmem_cache_destroy(touch_cache);
 }
+module_exit(touch_exit);
 
+MODULE_ALIAS_NXT_SENSE_TYPE(TOUCH_CODE);
 MODULE_LICENSE("GPL");
@@ -1,8 +0,0 @@
-#ifndef __H_touch_h_
-#define __H_touch_h_
-/* should include header file for dev_t type */
-
-extern int add_touch_sensor(int, dev_t);
-extern int remove_touch_sensor(int);
-
-#endif
@@ -0,0 +1,406 @@
+/* Notes:
+ * - The LEGO ultrasonic sensor is a digital sensor on the I2C bus of its port. It is put in continuous measurement mode when the port is configured, and a background poller reads the distances of the (up to) eight echoes and caches them.
+ * - Reading /dev/ultrasonic# never goes to the bus: every read returns the distance of the nearest echo of one measurement as a line, blocking until a measurement newer than the last one read through the same file is in the cache. The file can be opened by several readers at a time and supports poll().
+ * - A distance of 255 means that there was no echo.
+ */
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <asm/uaccess.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/i2c.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+
+#include "nxt_sense_core.h"
+
+#define DEVICE_NAME "ultrasonic"
+
+/* Registers of the ultrasonic sensor, besides the common ones in nxt_sense_core.h */
+#define ULTRASONIC_COMMAND_REG 0x41
+#define ULTRASONIC_COMMAND_OFF 0x00
+#define ULTRASONIC_COMMAND_CONTINUOUS 0x02
+#define ULTRASONIC_ECHO_REG 0x42
+#define ULTRASONIC_ECHOES 8
+#define ULTRASONIC_NO_ECHO 255
+
+static unsigned int poll_interval = 50;
+module_param(poll_interval, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_interval, "Milliseconds between reading the echoes from the sensors");
+
+/* nxt_sense_device_data has to be placed at the top/front of the struct, see the comment in touch.c */
+struct ultrasonic_data {
+  struct nxt_sense_device_data nxt_sense_device_data; /* Has to be placed at the beginning! */
+  struct device_attribute dev_attr_echoes;
+  struct i2c_adapter *adapter;
+  struct delayed_work poll_work;
+  spinlock_t lock; /* Guards the cached measurement, a spinlock as it is taken in the wait condition of the readers */
+  wait_queue_head_t wait; /* Readers waiting for a new measurement */
+  u8 echo[ULTRASONIC_ECHOES];
+  unsigned int sequence; /* Incremented for every measurement cached */
+  bool removed; /* Set when the port is reconfigured, the readers still holding the device open get -ENODEV */
+};
+
+/* What a reader has seen, one for every open file */
+struct ultrasonic_reader {
+  struct ultrasonic_data *ud;
+  unsigned int sequence;
+};
+
+/* The ultrasonic_data instances are allocated when a port is configured as an ultrasonic sensor */
+static struct kmem_cache *ultrasonic_cache;
+
+/* The instance is freed when the port is reconfigured and the device is no longer open */
+static void free_ultrasonic_data(struct nxt_sense_device_data *nxt_sense_device_data) {
+  struct ultrasonic_data *ud = container_of(nxt_sense_device_data, struct ultrasonic_data, nxt_sense_device_data);
+
+  kmem_cache_free(ultrasonic_cache, ud);
+}
+
+/***********************************************************************
+ *
+ * Talking to the sensor on the I2C bus of the port
+ *
+ ***********************************************************************/
+static int ultrasonic_write_reg(struct ultrasonic_data *ud, u8 reg, u8 value) {
+  u8 buf[2] = {reg, value};
+  struct i2c_msg msg = {
+    .addr = NXT_DIGITAL_ADDR,
+    .flags = 0,
+    .len = sizeof(buf),
+    .buf = buf,
+  };
+  int status;
+
+  status = i2c_transfer(ud->adapter, &msg, 1);
+
+  return status == 1 ? 0 : (status < 0 ? status : -EIO);
+}
+
+static int ultrasonic_read_regs(struct ultrasonic_data *ud, u8 reg, u8 *values, int len) {
+  struct i2c_msg msgs[2] = {
+    {.addr = NXT_DIGITAL_ADDR, .flags = 0, .len = 1, .buf = &reg},
+    {.addr = NXT_DIGITAL_ADDR, .flags = I2C_M_RD, .len = len, .buf = values},
+  };
+  int status;
+
+  status = i2c_transfer(ud->adapter, msgs, 2);
+
+  return status == 2 ? 0 : (status < 0 ? status : -EIO);
+}
+
+/* Reads the echoes of the last measurement into the cache and wakes up the readers */
+static void poll_work_handler(struct work_struct *work) {
+  struct ultrasonic_data *ud = container_of(work, struct ultrasonic_data, poll_work.work);
+  u8 echo[ULTRASONIC_ECHOES];
+  int status;
+
+  status = ultrasonic_read_regs(ud, ULTRASONIC_ECHO_REG, echo, ULTRASONIC_ECHOES);
+  if (status != 0) {
+    printk(KERN_DEBUG DEVICE_NAME "%d: could not read the echoes: %d\n", ud->nxt_sense_device_data.port, status);
+  } else {
+    spin_lock(&ud->lock);
+    memcpy(ud->echo, echo, ULTRASONIC_ECHOES);
+    ++ud->sequence;
+    spin_unlock(&ud->lock);
+
+    wake_up_interruptible(&ud->wait);
+
+    nxt_sense_add_stats_sample(&ud->nxt_sense_device_data, echo[0]);
+  }
+
+  schedule_delayed_work(&ud->poll_work, msecs_to_jiffies(poll_interval));
+}
+
+/***********************************************************************
+ *
+ * File operations for the /dev/ultrasonic# files
+ *
+ ***********************************************************************/
+static int ultrasonic_open(struct inode *inode, struct file *filp) {
+  struct nxt_sense_device_data *nxt_sense_device_data;
+  struct ultrasonic_data *ud;
+  struct ultrasonic_reader *reader;
+
+  nxt_sense_device_data = nxt_sense_get_device_data(inode);
+  if (!nxt_sense_device_data) {
+    return -ENODEV;
+  }
+  ud = container_of(nxt_sense_device_data, struct ultrasonic_data, nxt_sense_device_data);
+
+  reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+  if (!reader) {
+    nxt_sense_put_device_data(nxt_sense_device_data);
+    return -ENOMEM;
+  }
+
+  spin_lock(&ud->lock);
+  reader->ud = ud;
+  reader->sequence = ud->sequence; /* Only measurements made after opening are read */
+  spin_unlock(&ud->lock);
+
+  filp->private_data = reader;
+
+  return 0;
+}
+
+static int ultrasonic_release(struct inode *inode, struct file *filp) {
+  struct ultrasonic_reader *reader = filp->private_data;
+
+  nxt_sense_put_device_data(&reader->ud->nxt_sense_device_data);
+  kfree(reader);
+
+  return 0;
+}
+
+/* True when the reader has something to return, a new measurement or an error */
+static bool reader_ready(struct ultrasonic_reader *reader) {
+  struct ultrasonic_data *ud = reader->ud;
+  bool ready;
+
+  spin_lock(&ud->lock);
+  ready = ud->removed || ud->sequence != reader->sequence;
+  spin_unlock(&ud->lock);
+
+  return ready;
+}
+
+static ssize_t ultrasonic_read(struct file *filp, char __user *buff, size_t count, loff_t *offp) {
+  size_t len;
+  char output[5]; /* 3 digits + newline and the null-character */
+  struct ultrasonic_reader *reader = filp->private_data;
+  struct ultrasonic_data *ud = reader->ud;
+
+  if (!buff)
+    return -EFAULT;
+
+  if (!reader_ready(reader)) {
+    if (filp->f_flags & O_NONBLOCK) {
+      return -EAGAIN;
+    }
+    if (wait_event_interruptible(ud->wait, reader_ready(reader))) {
+      return -ERESTARTSYS;
+    }
+  }
+
+  spin_lock(&ud->lock);
+  if (ud->removed) {
+    spin_unlock(&ud->lock);
+    return -ENODEV;
+  }
+  reader->sequence = ud->sequence;
+  snprintf(output, sizeof(output), "%d\n", ud->echo[0]);
+  spin_unlock(&ud->lock);
+
+  len = strlen(output);
+
+  if (len < count)
+    count = len;
+
+  if (copy_to_user(buff, output, count)) {
+    return -EFAULT;
+  }
+
+  return count;
+}
+
+static unsigned int ultrasonic_poll(struct file *filp, poll_table *wait) {
+  struct ultrasonic_reader *reader = filp->private_data;
+  struct ultrasonic_data *ud = reader->ud;
+  unsigned int mask = 0;
+
+  poll_wait(filp, &ud->wait, wait);
+
+  spin_lock(&ud->lock);
+  if (ud->removed) {
+    mask |= POLLERR | POLLHUP;
+  } else if (ud->sequence != reader->sequence) {
+    mask |= POLLIN | POLLRDNORM;
+  }
+  spin_unlock(&ud->lock);
+
+  return mask;
+}
+
+static const struct file_operations ultrasonic_fops = {
+  .owner = THIS_MODULE,
+  .read = ultrasonic_read,
+  .poll = ultrasonic_poll,
+  .open = ultrasonic_open,
+  .release = ultrasonic_release,
+};
+
+/***********************************************************************
+ *
+ * Sysfs entry for reading the distances of all the echoes
+ *
+ ***********************************************************************/
+static ssize_t echoes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+  u8 echo[ULTRASONIC_ECHOES];
+  ssize_t len = 0;
+  int i;
+  struct ultrasonic_data *ud;
+  ud = container_of(attr, struct ultrasonic_data, dev_attr_echoes);
+
+  spin_lock(&ud->lock);
+  memcpy(echo, ud->echo, ULTRASONIC_ECHOES);
+  spin_unlock(&ud->lock);
+
+  for (i = 0; i < ULTRASONIC_ECHOES; ++i) {
+    len += scnprintf(buf + len, PAGE_SIZE - len, (i == 0 ? "%d" : " %d"), echo[i]);
+  }
+  len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+  return len;
+}
+
+/***********************************************************************
+ *
+ * Hooks for adding and removing devices for the ultrasonic sensor
+ * submodule, called from nxt_sense_core.c through the registered
+ * nxt_sense_type_ops
+ *
+ ***********************************************************************/
+static struct nxt_sense_device_data *add_ultrasonic_sensor(int port, dev_t devt) {
+  int res;
+  struct ultrasonic_data *ud;
+  printk(KERN_DEBUG DEVICE_NAME ": Adding ultrasonic sensor on port %d\n", port);
+
+  ud = kmem_cache_zalloc(ultrasonic_cache, GFP_KERNEL);
+  if (!ud) {
+    return NULL;
+  }
+
+  spin_lock_init(&ud->lock);
+  nxt_sense_init_device_data(&ud->nxt_sense_device_data, free_ultrasonic_data);
+  init_waitqueue_head(&ud->wait);
+  INIT_DELAYED_WORK(&ud->poll_work, poll_work_handler);
+  memset(ud->echo, ULTRASONIC_NO_ECHO, ULTRASONIC_ECHOES);
+
+  ud->nxt_sense_device_data.devt = devt;
+  ud->nxt_sense_device_data.port = port;
+
+  res = nxt_setup_sensor_chrdev(&ultrasonic_fops, &ud->nxt_sense_device_data, DEVICE_NAME);
+  if (res != 0) {
+    goto add_fail_1;
+  }
+
+  ud->dev_attr_echoes.attr.name = __stringify(echoes);
+  ud->dev_attr_echoes.attr.mode = (S_IRUGO);
+  ud->dev_attr_echoes.show = echoes_show;
+  ud->dev_attr_echoes.store = NULL;
+
+  res = device_create_file(ud->nxt_sense_device_data.device, &ud->dev_attr_echoes);
+  if (res != 0) {
+    printk(KERN_ALERT DEVICE_NAME "%d: device_create_file(echoes) error: %d\n", port, res);
+    goto add_fail_2;
+  }
+
+  return &ud->nxt_sense_device_data;
+
+ add_fail_2:
+  nxt_teardown_sensor_chrdev(&ud->nxt_sense_device_data);
+ add_fail_1:
+  nxt_sense_put_device_data(&ud->nxt_sense_device_data);
+  return NULL;
+}
+
+/* The sensor owns the pins of the port from here on, so it takes the I2C bus and starts measuring */
+static int start_ultrasonic_sensor(struct nxt_sense_device_data *nxt_sense_device_data) {
+  int res;
+  struct ultrasonic_data *ud = container_of(nxt_sense_device_data, struct ultrasonic_data, nxt_sense_device_data);
+
+  ud->adapter = nxt_sense_get_i2c_adapter(nxt_sense_device_data);
+  if (!ud->adapter) {
+    return -ENODEV;
+  }
+
+  res = ultrasonic_write_reg(ud, ULTRASONIC_COMMAND_REG, ULTRASONIC_COMMAND_CONTINUOUS);
+  if (res != 0) {
+    printk(KERN_ERR DEVICE_NAME ": no ultrasonic sensor answering on port %d: %d\n", nxt_sense_device_data->port, res);
+    nxt_sense_put_i2c_adapter(nxt_sense_device_data);
+    ud->adapter = NULL;
+    return res;
+  }
+
+  schedule_delayed_work(&ud->poll_work, msecs_to_jiffies(poll_interval));
+
+  return 0;
+}
+
+static int remove_ultrasonic_sensor(struct nxt_sense_device_data *nxt_sense_device_data) {
+  int res;
+  struct ultrasonic_data *ud = container_of(nxt_sense_device_data, struct ultrasonic_data, nxt_sense_device_data);
+  printk(KERN_DEBUG DEVICE_NAME ": Removing ultrasonic sensor on port %d\n", nxt_sense_device_data->port);
+
+  cancel_delayed_work_sync(&ud->poll_work);
+  if (ud->adapter) {
+    ultrasonic_write_reg(ud, ULTRASONIC_COMMAND_REG, ULTRASONIC_COMMAND_OFF);
+  }
+
+  device_remove_file(nxt_sense_device_data->device, &ud->dev_attr_echoes);
+
+  spin_lock(&ud->lock);
+  ud->removed = true;
+  spin_unlock(&ud->lock);
+  wake_up_interruptible(&ud->wait);
+
+  if (ud->adapter) {
+    nxt_sense_put_i2c_adapter(nxt_sense_device_data);
+    ud->adapter = NULL;
+  }
+
+  res = nxt_teardown_sensor_chrdev(nxt_sense_device_data);
+
+  nxt_sense_put_device_data(&ud->nxt_sense_device_data);
+
+  return res;
+}
+
+static struct nxt_sense_type_ops ultrasonic_type_ops = {
+  .code = ULTRASONIC_CODE,
+  .name = DEVICE_NAME,
+  .owner = THIS_MODULE,
+  .add = add_ultrasonic_sensor,
+  .start = start_ultrasonic_sensor,
+  .remove = remove_ultrasonic_sensor,
+};
+
+/***********************************************************************
+ *
+ * Module initialisation and exit, registering the ultrasonic sensor
+ * type with nxt_sense
+ *
+ ***********************************************************************/
+static int __init ultrasonic_init(void) {
+  int error;
+
+  ultrasonic_cache = kmem_cache_create("nxt_ultrasonic_data", sizeof(struct ultrasonic_data), 0, 0, NULL);
+  if (!ultrasonic_cache) {
+    printk(KERN_CRIT DEVICE_NAME ": kmem_cache_create() failed\n");
+    return -ENOMEM;
+  }
+
+  error = nxt_sense_register_type(&ultrasonic_type_ops);
+  if (error) {
+    kmem_cache_destroy(ultrasonic_cache);
+  }
+
+  return error;
+}
+module_init(ultrasonic_init);
+
+static void __exit ultrasonic_exit(void) {
+  nxt_sense_unregister_type(&ultrasonic_type_ops);
+  kmem_cache_destroy(ultrasonic_cache);
+}
+module_exit(ultrasonic_exit);
+
+MODULE_ALIAS_NXT_SENSE_TYPE(ULTRASONIC_CODE);
+MODULE_LICENSE("GPL");
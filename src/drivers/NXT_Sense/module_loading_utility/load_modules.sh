@@ -1,4 +1,14 @@
 insmod /own_modules/level_shifter.ko
 insmod /own_modules/adc.ko
 insmod /own_modules/voltage_sensor.ko
+insmod /own_modules/control_loop.ko
+# Add e.g. ports=1,2,0,5 to configure the ports while loading
 insmod /own_modules/nxt_sense.ko
+# Sensor types, only the ones used on the robot are needed
+insmod /own_modules/nxt_touch.ko
+insmod /own_modules/nxt_light.ko
+insmod /own_modules/nxt_sound.ko
+insmod /own_modules/nxt_ultrasonic.ko
+# After nxt_sense, so motor adds its reflex action
+# Add hw_pwm=1 when u-boot muxes the ENABLE pins to the GP timers
+insmod /own_modules/motor.ko
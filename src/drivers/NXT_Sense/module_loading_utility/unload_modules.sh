@@ -1,4 +1,13 @@
+# Unconfigure the ports first, every configured port holds its sensor type module
+echo "0 0 0 0" > /sys/class/nxt_sense/nxt_sense/config
+rmmod nxt_ultrasonic
+rmmod nxt_sound
+rmmod nxt_light
+rmmod nxt_touch
+# Before nxt_sense, as motor holds the symbols of nxt_sense for its reflex action
+rmmod motor
 rmmod nxt_sense
+rmmod control_loop
 rmmod voltage_sensor
 rmmod adc
 rmmod level_shifter
@@ -8,6 +8,11 @@ insmod leddev.ko
 echo set0set5 > /dev/leddev
 echo inv > /dev/leddev
 echo clr2clr3clr7inv > /dev/leddev
+echo vala5 > /dev/leddev
+
+All the commands of one write are applied together, and when the LED
+pins share a GPIO bank (they do on the GumstixNXT) the eight LEDs
+change at once through the set and clear registers of the bank.
 
 */
 
@@ -19,6 +24,7 @@ echo clr2clr3clr7inv > /dev/leddev
 #include <linux/string.h>
 #include <linux/kernel.h>
 #include <linux/device.h>
+#include <linux/io.h>
 #include <mach/gpio.h>
 #include <linux/interrupt.h>
 #include <linux/workqueue.h>
@@ -45,6 +51,16 @@ echo clr2clr3clr7inv > /dev/leddev
 #define BIT_ON 0
 #define BIT_OFF 1
 
+/* OMAP3 GPIO banks, 32 GPIOs each, and the registers setting and
+   clearing output bits (a 1 bit changes the pin, a 0 bit leaves it) */
+#define GPIO_BANK_WIDTH 32
+#define GPIO_BANK_SIZE 0x100
+#define GPIO_CLEARDATAOUT 0x90
+#define GPIO_SETDATAOUT 0x94
+
+/* Longest write handled in one call, longer ones are continued by the caller */
+#define CMD_BUFFER_SIZE 64
+
 /* leddev device structure */
 struct leddev_dev {
   /* Standard fields */
@@ -56,6 +72,7 @@ struct leddev_dev {
 
   /* Driver-specific fields */
   int value; // the integer value currently shown (interpreting the LEDs as bits in a number)
+  void __iomem *bank; // the GPIO bank of all the bits, NULL if they are in different banks
 };
 
 /* device structure instance */
@@ -67,79 +84,148 @@ static int gpio_bits[] = {
   GPIO_BIT3, GPIO_BIT4, GPIO_BIT5,
   GPIO_BIT6, GPIO_BIT7 };
 
+/* Physical addresses of the OMAP3 GPIO banks, GPIO 0-31 are in the first one */
+static const unsigned long gpio_banks[] = {
+  0x48310000, 0x49050000, 0x49052000,
+  0x49054000, 0x49056000, 0x49058000 };
+
+/* Show a value on the LEDs. With all bits in one bank it takes one
+   write to the set and one to the clear register, the LEDs changing
+   together within two bus cycles; otherwise each bit is set on its own */
+static void leddev_show(int value)
+{
+  u32 set = 0, clear = 0;
+  int index;
+
+  if (leddev_dev.bank) {
+    for(index=0; index<GPIO_N_BITS; index++) {
+      u32 mask = 1 << (gpio_bits[index] % GPIO_BANK_WIDTH);
+      int level = value&(1<<index) ? BIT_ON : BIT_OFF;
+      if (level)
+        set |= mask;
+      else
+        clear |= mask;
+    }
+    if (set)
+      writel(set, leddev_dev.bank + GPIO_SETDATAOUT);
+    if (clear)
+      writel(clear, leddev_dev.bank + GPIO_CLEARDATAOUT);
+  }
+  else {
+    for(index=0; index<GPIO_N_BITS; index++)
+      gpio_set_value(gpio_bits[index], value&(1<<index) ? BIT_ON : BIT_OFF);
+  }
+
+  leddev_dev.value = value;
+}
+
 /* Reset hardware settings and driver state */
 static void leddev_reset(void)
 {
-  int index;
   // Reset level shifter control
   gpio_set_value(GPIO_OE, 0);
   gpio_set_value(GPIO_DIR, 1);
-  // Reset each bit to off state
-  for(index=0; index<GPIO_N_BITS; index++)
-    gpio_set_value(gpio_bits[index], BIT_OFF);
-  // Reset driver state
-  leddev_dev.value = 0;
+  // Reset each bit to off state, and the driver state
+  leddev_show(0);
 }
 
-/* Respond to a command that has been written to the device special file */
+/* Value of a hex digit, -1 if it is none */
+static int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Respond to the commands that have been written to the device special file */
 static ssize_t leddev_write(struct file *filp, const char __user *buff, size_t count, loff_t *f_pos)
 {
-  char cmd[4]; // Buffer for command written by user
-  ssize_t status = 0; // Return status, updated depending on input
+  char cmd[CMD_BUFFER_SIZE]; // Buffer for the commands written by user
+  size_t len = min(count, sizeof(cmd)); // Bytes of the commands in the buffer
+  size_t pos = 0; // Start of the command being processed
+  int value = leddev_dev.value; // The value after the commands, shown at once
   int bit; // Bit that the operation has an effect on
+  int high, low; // Digits of a value
+
+  if (count == 0)
+    return 0;
 
   /* Copy the data the user wrote from userspace (how much is read depends on return value) */
-  if (copy_from_user(cmd, buff, 4)) {
+  if (copy_from_user(cmd, buff, len)) {
     printk(KERN_ALERT "Error copy_from_user\n");
-    status = -EFAULT;
-    goto leddev_write_done;
+    return -EFAULT;
   }
-    
+
   /*
-    Process the command stored in the data
+    Process the commands stored in the data
     'setN' means set bit #N
     'clrN' means clear bit #N
     'inv' means invert pattern
+    'valHH' means show the value HH (two hex digits)
   */
-  bit = cmd[3] - '0'; // Assuming a legal command, this is the bit to manipulate
+  while (pos < len) {
+    size_t left = len - pos; // Bytes of the command, and of the ones after it
+    char *c = cmd + pos;
+
+    /* A command cut off by the end of the buffer is taken by the next call */
+    if (len < count && left < 5 && (c[0] == 's' || c[0] == 'c' || c[0] == 'i' || c[0] == 'v'))
+      break;
+
+    if (left >= 4 && c[0] == 's' && c[1] == 'e' && c[2] == 't') { // Set command?
+      bit = c[3] - '0';
+      if(bit<0 || bit>=GPIO_N_BITS) { // Check that pin argument is legal
+        printk(KERN_ALERT "LED illegal numeric argument to set\n");
+        break;
+      }
+      value |= 1<<bit; // Turn the selected bit on
+      pos += 4;
+    }
 
-  if (cmd[0] == 's' && cmd[1] == 'e' && cmd[2] == 't') { // Set command?
-    if(bit<0 || bit>=GPIO_N_BITS) { // Check that pin argument is legal
-      printk(KERN_ALERT "LED illegal numeric argument to set\n");
-      return -1;
+    else if (left >= 4 && c[0] == 'c' && c[1] == 'l' && c[2] == 'r') { // Clear command?
+      bit = c[3] - '0';
+      if(bit<0 || bit>=GPIO_N_BITS) { // Check that pin argument is legal
+        printk(KERN_ALERT "LED illegal numeric argument to clr\n");
+        break;
+      }
+      value &= ~(1<<bit); // Turn the selected bit off
+      pos += 4;
     }
-    gpio_set_value(gpio_bits[bit], BIT_ON); // Turn the selected hardware bit on 
-    leddev_dev.value |= 1<<bit; // Store the selected software bit
-    status = 4; // Read 4 bytes, update return status correspondingly
-  }
 
-  else if (cmd[0] == 'c' && cmd[1] == 'l' && cmd[2] == 'r') { // Clear command?
-    if(bit<0 || bit>=GPIO_N_BITS) { // Check that pin argument is legal
-      printk(KERN_ALERT "LED illegal numeric argument to clr\n");
-      return -1;
+    else if (left >= 3 && c[0] == 'i' && c[1] == 'n' && c[2] == 'v') { // Invert command?
+      value = ~value & ((1<<GPIO_N_BITS)-1); // Invert bit pattern
+      pos += 3;
     }
-    gpio_set_value(gpio_bits[bit], BIT_OFF); // Turn the selected hardware bit off
-    leddev_dev.value ^= 1<<bit; // Turn the selected software bit off
-    status = 4; // Read 4 bytes, update return status correspondingly
-  }
 
-  else if (cmd[0] == 'i' && cmd[1] == 'n' && cmd[2] == 'v') { // Invert command?
-    int index;
-    leddev_dev.value = ~leddev_dev.value; // Invert bit pattern
-    for(index=0; index<GPIO_N_BITS; index++) // Set each bit
-      gpio_set_value(gpio_bits[index], leddev_dev.value&(1<<index) ? BIT_ON : BIT_OFF);
-    status = 3; // Read 3 bytes, update return status correspondingly
-  } 
-
-  else { // Unrecognized command
-    status = 1; // Read one byte, will be called again if there is more input
-    if(cmd[0]!=10 && cmd[0]!=' ') // Ignore newline and space
-      printk(KERN_ALERT "LED illegal command char %d\n", cmd[0]);
+    else if (left >= 5 && c[0] == 'v' && c[1] == 'a' && c[2] == 'l') { // Value command?
+      high = hex_digit(c[3]);
+      low = hex_digit(c[4]);
+      if (high < 0 || low < 0) {
+        printk(KERN_ALERT "LED illegal hex argument to val\n");
+        break;
+      }
+      value = high<<4 | low;
+      pos += 5;
+    }
+
+    else { // Unrecognized command
+      if(c[0]!=10 && c[0]!=' ') // Ignore newline and space
+        printk(KERN_ALERT "LED illegal command char %d\n", c[0]);
+      pos += 1; // Skip one byte, will go on with the rest
+    }
   }
 
- leddev_write_done:
+  /* An illegal argument fails the write once the commands before it are shown */
+  if (pos == 0)
+    return -1;
+
+  if (value != leddev_dev.value)
+    leddev_show(value);
 
-  return status; // Negative=error, positive=success and indicates #bytes read
+  return pos; // Positive=success and indicates #bytes read
 }
 
 /* The file operations structure, operations not listed here are illegal */
@@ -265,6 +351,24 @@ static int __init leddev_init_pins(void)
   return -1;
 }
 
+/* Map the GPIO bank of the bits if they all share one, else leave them to gpio_set_value() */
+static void __init leddev_init_bank(void)
+{
+  int bank = gpio_bits[0] / GPIO_BANK_WIDTH;
+  int index;
+
+  for(index=1; index<GPIO_N_BITS; index++)
+    if (gpio_bits[index] / GPIO_BANK_WIDTH != bank)
+      return;
+
+  if (bank >= ARRAY_SIZE(gpio_banks))
+    return;
+
+  leddev_dev.bank = ioremap(gpio_banks[bank], GPIO_BANK_SIZE);
+  if (!leddev_dev.bank)
+    printk(KERN_ALERT "ioremap of GPIO bank %d failed, setting the bits one by one\n", bank + 1);
+}
+
 /* Kernel module initialization function */
 static int __init leddev_init(void)
 {
@@ -281,6 +385,9 @@ static int __init leddev_init(void)
   if (leddev_init_pins() < 0)
     goto init_fail_3;
 
+  /* Use the registers of the bank when possible */
+  leddev_init_bank();
+
   /* Reset driver state */
   leddev_reset();
 
@@ -307,6 +414,10 @@ module_init(leddev_init);
 static void __exit leddev_exit(void)
 {
   int index;
+  /* Unmap the GPIO bank */
+  if (leddev_dev.bank)
+    iounmap(leddev_dev.bank);
+
   /* Free all GPIOs */
   gpio_free(GPIO_OE);
   gpio_free(GPIO_DIR);
@@ -328,4 +439,4 @@ module_exit(leddev_exit);
 MODULE_AUTHOR("Ulrik Pagh Schultz");
 MODULE_DESCRIPTION("A module for controlling GumstixNXT LEDs");
 MODULE_LICENSE("Dual BSD/GPL");
-MODULE_VERSION("0.4");
+MODULE_VERSION("0.5");